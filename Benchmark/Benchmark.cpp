@@ -0,0 +1,288 @@
+﻿// Measures the render and load performance of tsf.h with SoundFonts built in memory.
+// Runs all benchmarks (or the one given) and prints their results, build it in Release.
+//
+//   Benchmark [benchmark name]
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define TSF_IMPLEMENTATION
+#define TSF_SAMPLES_SHORT
+#include "../Keyboard Lyre/tsf.h"
+
+#include "../Tests/TestSoundFont.h"
+
+// Builds of tsf.h with different options, each one in a BenchmarkVariant*.c file and this one
+struct Variant
+{
+    void* (*load)(const void* buffer, int size, int voices);
+    void (*render)(void* f, float* buffer, int samples);
+    void (*noteOffAll)(void* f);
+    void (*close)(void* f);
+};
+
+#define BENCHMARK_VARIANT(name) Default##name
+#include "BenchmarkVariant.h"
+#undef BENCHMARK_VARIANT
+
+#define BENCHMARK_VARIANT(prefix) \
+    extern "C" void* prefix##Load(const void* buffer, int size, int voices); \
+    extern "C" void prefix##Render(void* f, float* buffer, int samples); \
+    extern "C" void prefix##NoteOffAll(void* f); \
+    extern "C" void prefix##Close(void* f);
+BENCHMARK_VARIANT(Scalar)
+BENCHMARK_VARIANT(FloatSamples)
+BENCHMARK_VARIANT(NoFlushDenormals)
+#undef BENCHMARK_VARIANT
+
+static const Variant defaultVariant = { DefaultLoad, DefaultRender, DefaultNoteOffAll, DefaultClose };
+static const Variant scalar = { ScalarLoad, ScalarRender, ScalarNoteOffAll, ScalarClose };
+static const Variant floatSamples = { FloatSamplesLoad, FloatSamplesRender, FloatSamplesNoteOffAll, FloatSamplesClose };
+static const Variant noFlushDenormals = { NoFlushDenormalsLoad, NoFlushDenormalsRender, NoFlushDenormalsNoteOffAll, NoFlushDenormalsClose };
+
+static double Now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Start voices which keep playing (looped samples, no note off) spread over the presets and keys
+static void StartVoices(tsf* f, int voices)
+{
+    int presets = tsf_get_presetcount(f);
+    for (int i = 0; i != voices; i++)
+        tsf_note_on(f, i % presets, 24 + (i * 7) % 84, 0.5f + 0.5f * (i % 5) / 4);
+}
+
+// Milliseconds to render one second of stereo audio at 44.1 kHz in blocks of blockSize
+template <typename Render> static double RenderTime(Render render, int blockSize, double seconds)
+{
+    std::vector<float> buffer(2 * blockSize);
+    int blocks = (int)(seconds * 44100 / blockSize);
+    render(&buffer[0], blockSize); // warm up
+    double start = Now();
+    for (int i = 0; i != blocks; i++) render(&buffer[0], blockSize);
+    return (Now() - start) * 1000.0 / (blocks * blockSize / 44100.0);
+}
+
+static double RenderTime(tsf* f, int blockSize, double seconds)
+{
+    return RenderTime([f](float* buffer, int samples) { tsf_render_float(f, buffer, samples, 0); }, blockSize, seconds);
+}
+
+static double RenderTime(const Variant& variant, void* f, int blockSize, double seconds)
+{
+    return RenderTime([&](float* buffer, int samples) { variant.render(f, buffer, samples); }, blockSize, seconds);
+}
+
+// Average milliseconds of a number of calls to load
+template <typename Load> static double LoadTime(Load load, int runs)
+{
+    double start = Now();
+    for (int i = 0; i != runs; i++) tsf_close(load());
+    return (Now() - start) * 1000.0 / runs;
+}
+
+static tsf* Load(const std::vector<unsigned char>& font, int voices)
+{
+    tsf* f = tsf_load_memory(&font[0], (int)font.size());
+    tsf_set_output(f, TSF_STEREO_INTERLEAVED, 44100, 0);
+    tsf_set_max_voices(f, voices * 2); // no stealing
+    return f;
+}
+
+// Voices rendered with the scalar kernels (TSF_NO_SIMD) and with the SIMD kernels picked for the CPU
+static void BenchmarkKernels()
+{
+    TestSoundFontDesc desc;
+    desc.presets = 16;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    printf("  ms to render 1 s of audio in blocks of 512, voices one core can render in real time\n");
+    printf("  %8s %10s %10s %10s %16s\n", "kernels", "64", "128", "256", "voices per core");
+    for (const Variant* variant : { &scalar, &defaultVariant })
+    {
+        printf("  %8s", variant == &scalar ? "scalar" : "SIMD");
+        double ms = 0;
+        for (int voices : { 64, 128, 256 })
+        {
+            void* f = variant->load(&font[0], (int)font.size(), voices);
+            printf(" %10.2f", ms = RenderTime(*variant, f, 512, 5.0));
+            variant->close(f);
+        }
+        printf(" %16d\n", (int)(256 * 1000.0 / ms));
+    }
+}
+
+// Cost of each interpolation mode
+static void BenchmarkInterpolation()
+{
+    static const char* names[] = { "nearest", "linear", "cubic", "sinc" };
+    TestSoundFontDesc desc;
+    desc.presets = 16;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    printf("  ms to render 1 s of audio in blocks of 512\n");
+    printf("  %8s %10s %10s %10s\n", "mode", "64", "128", "256");
+    for (int mode = TSF_INTERP_NEAREST; mode <= TSF_INTERP_SINC; mode++)
+    {
+        printf("  %8s", names[mode]);
+        for (int voices : { 64, 128, 256 })
+        {
+            tsf* f = Load(font, voices);
+            tsf_set_interpolation(f, (enum TSFInterpolation)mode);
+            StartVoices(f, voices);
+            printf(" %10.2f", RenderTime(f, 512, 5.0));
+            tsf_close(f);
+        }
+        printf("\n");
+    }
+}
+
+// Long release tails of filtered voices whose samples end in a looped silence, where the filter state rings
+// out into denormal numbers, with the render functions flushing them to zero and with TSF_NO_FLUSH_DENORMALS
+static void BenchmarkReleaseTails()
+{
+    TestSoundFontDesc desc;
+    desc.presets = 16;
+    desc.sampleLength = 4410;
+    desc.silentTail = 1000;
+    desc.releaseTimecents = 5186; // 20 seconds
+    desc.filterCents = 5000;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    printf("  ms to render 1 s of audio in blocks of 512, 64 voices in a 20 s release started after 0.5 s\n");
+    printf("  %16s %10s\n", "denormals", "ms");
+    for (const Variant* variant : { &defaultVariant, &noFlushDenormals })
+    {
+        std::vector<float> buffer(2 * 512);
+        void* f = variant->load(&font[0], (int)font.size(), 64);
+        for (int i = 0; i != 44100 / 2 / 512; i++) variant->render(f, &buffer[0], 512);
+        variant->noteOffAll(f);
+        printf("  %16s %10.2f\n", variant == &defaultVariant ? "flushed" : "not flushed", RenderTime(*variant, f, 512, 19.0));
+        variant->close(f);
+    }
+}
+
+// Float against 16-bit samples in memory with many voices playing different samples
+static void BenchmarkSampleFormat()
+{
+    TestSoundFontDesc desc;
+    desc.presets = 64;
+    desc.samples = 256;
+    desc.sampleLength = 88200;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    printf("  ms to render 1 s of audio in blocks of 512, %d samples of %d points\n", desc.samples, desc.sampleLength);
+    printf("  %8s %10s %10s %10s %10s\n", "format", "MB", "64", "128", "256");
+    for (int format = 0; format != 2; format++)
+    {
+        printf("  %8s %10.1f", format ? "float" : "16-bit", desc.samples * (desc.sampleLength + 46) * (format ? 4 : 2) / 1e6);
+        for (int voices : { 64, 128, 256 })
+        {
+            const Variant& variant = (format ? floatSamples : defaultVariant);
+            void* f = variant.load(&font[0], (int)font.size(), voices);
+            printf(" %10.2f", RenderTime(variant, f, 512, 5.0));
+            variant.close(f);
+        }
+        printf("\n");
+    }
+}
+
+struct MemoryStream { const unsigned char* data; unsigned int pos, size; };
+
+static int MemoryStreamRead(void* data, void* ptr, unsigned int size)
+{
+    MemoryStream* stream = (MemoryStream*)data;
+    if (size > stream->size - stream->pos) size = stream->size - stream->pos;
+    memcpy(ptr, stream->data + stream->pos, size);
+    stream->pos += size;
+    return (int)size;
+}
+
+static int MemoryStreamSkip(void* data, unsigned int count)
+{
+    MemoryStream* stream = (MemoryStream*)data;
+    if (count > stream->size - stream->pos) return 0;
+    stream->pos += count;
+    return 1;
+}
+
+// A bank the size of a large General MIDI SoundFont loaded from memory and through a tsf_stream
+static void BenchmarkLoadBank()
+{
+    TestSoundFontDesc desc;
+    desc.presets = 256;
+    desc.zones = 40;
+    desc.samples = 1024;
+    desc.sampleLength = 4000;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    printf("  ms to load %d presets with %d zones each, %.1f MB\n", desc.presets, desc.zones, font.size() / 1e6);
+    printf("  %16s %10.2f\n", "memory", LoadTime([&]() { return tsf_load_memory(&font[0], (int)font.size()); }, 20));
+    printf("  %16s %10.2f\n", "memory nocopy", LoadTime([&]() { return tsf_load_memory_nocopy(&font[0], (int)font.size()); }, 20));
+    printf("  %16s %10.2f\n", "stream", LoadTime([&]()
+    {
+        MemoryStream data = { &font[0], 0, (unsigned int)font.size() };
+        tsf_stream stream = { &data, MemoryStreamRead, MemoryStreamSkip };
+        return tsf_load(&stream);
+    }, 20));
+}
+
+// Load time with a growing number of presets
+static void BenchmarkLoadPresets()
+{
+    printf("  ms to load, the presets share 256 instruments with 16 zones\n");
+    printf("  %8s %10s\n", "presets", "ms");
+    for (int presets : { 10, 100, 1000, 10000 })
+    {
+        TestSoundFontDesc desc;
+        desc.presets = presets;
+        desc.instruments = (presets < 256 ? presets : 256);
+        std::vector<unsigned char> font = MakeTestSoundFont(desc);
+        printf("  %8d %10.2f\n", presets, LoadTime([&]() { return tsf_load_memory(&font[0], (int)font.size()); }, presets >= 1000 ? 5 : 50));
+    }
+}
+
+// The render pool with 1 to 16 threads against rendering on the calling thread alone
+static void BenchmarkRenderThreads()
+{
+    TestSoundFontDesc desc;
+    desc.presets = 16;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    printf("  %u hardware threads, ms to render 1 s of audio in blocks of 512\n", std::thread::hardware_concurrency());
+    printf("  %8s %10s %10s %10s %10s %10s %10s\n", "voices", "no pool", "1 thread", "2", "4", "8", "16");
+    for (int voices : { 32, 128, 256 })
+    {
+        printf("  %8d", voices);
+        for (int threads : { 0, 1, 2, 4, 8, 16 })
+        {
+            tsf* f = Load(font, voices);
+            if (threads && !tsf_set_render_threads(f, threads)) { printf(" %10s", "failed"); tsf_close(f); continue; }
+            StartVoices(f, voices);
+            if (tsf_active_voice_count(f) != voices) printf(" (%d voices)", tsf_active_voice_count(f));
+            printf(" %10.2f", RenderTime(f, 512, 5.0));
+            tsf_close(f);
+        }
+        printf("\n");
+    }
+}
+
+static const struct { const char* name; void (*run)(); } benchmarks[] =
+{
+    { "Kernels", BenchmarkKernels },
+    { "Interpolation", BenchmarkInterpolation },
+    { "ReleaseTails", BenchmarkReleaseTails },
+    { "SampleFormat", BenchmarkSampleFormat },
+    { "LoadBank", BenchmarkLoadBank },
+    { "LoadPresets", BenchmarkLoadPresets },
+    { "RenderThreads", BenchmarkRenderThreads },
+};
+
+int main(int argc, char** argv)
+{
+    for (const auto& benchmark : benchmarks)
+    {
+        if (argc > 1 && strcmp(argv[1], benchmark.name)) continue;
+        printf("%s\n", benchmark.name);
+        benchmark.run();
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+﻿// The functions a build of tsf.h with other options gives to Benchmark.cpp. Each BenchmarkVariant*.c file sets
+// the options, includes tsf.h (static, so the builds don't clash) and then this with BENCHMARK_VARIANT naming
+// the functions. Benchmark.cpp includes it as well for its own build.
+
+// Loads the SoundFont and starts the same voices as StartVoices in Benchmark.cpp
+void* BENCHMARK_VARIANT(Load)(const void* buffer, int size, int voices)
+{
+    tsf* f = tsf_load_memory(buffer, size);
+    int presets, i;
+    if (!f) return TSF_NULL;
+    tsf_set_output(f, TSF_STEREO_INTERLEAVED, 44100, 0);
+    tsf_set_max_voices(f, voices * 2);
+    presets = tsf_get_presetcount(f);
+    for (i = 0; i != voices; i++)
+        tsf_note_on(f, i % presets, 24 + (i * 7) % 84, 0.5f + 0.5f * (i % 5) / 4);
+    return f;
+}
+
+void BENCHMARK_VARIANT(Render)(void* f, float* buffer, int samples)
+{
+    tsf_render_float((tsf*)f, buffer, samples, 0);
+}
+
+void BENCHMARK_VARIANT(NoteOffAll)(void* f)
+{
+    tsf_note_off_all((tsf*)f);
+}
+
+void BENCHMARK_VARIANT(Close)(void* f)
+{
+    tsf_close((tsf*)f);
+}
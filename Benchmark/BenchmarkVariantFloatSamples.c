@@ -0,0 +1,10 @@
+﻿// tsf.h with float samples (without TSF_SAMPLES_SHORT), to compare the memory bandwidth of both sample formats
+#define TSF_IMPLEMENTATION
+#define TSF_STATIC
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function" // most of the static tsf API isn't used here
+#endif
+#include "../Keyboard Lyre/tsf.h"
+
+#define BENCHMARK_VARIANT(name) FloatSamples##name
+#include "BenchmarkVariant.h"
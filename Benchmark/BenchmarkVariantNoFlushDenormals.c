@@ -0,0 +1,12 @@
+﻿// tsf.h with TSF_NO_FLUSH_DENORMALS, to measure what flushing denormals to zero while rendering saves
+#define TSF_IMPLEMENTATION
+#define TSF_STATIC
+#define TSF_SAMPLES_SHORT
+#define TSF_NO_FLUSH_DENORMALS
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function" // most of the static tsf API isn't used here
+#endif
+#include "../Keyboard Lyre/tsf.h"
+
+#define BENCHMARK_VARIANT(name) NoFlushDenormals##name
+#include "BenchmarkVariant.h"
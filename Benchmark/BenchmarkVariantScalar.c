@@ -0,0 +1,12 @@
+﻿// tsf.h with TSF_NO_SIMD, to compare the portable scalar kernels with the SIMD ones picked for the CPU
+#define TSF_IMPLEMENTATION
+#define TSF_STATIC
+#define TSF_SAMPLES_SHORT
+#define TSF_NO_SIMD
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wunused-function" // most of the static tsf API isn't used here
+#endif
+#include "../Keyboard Lyre/tsf.h"
+
+#define BENCHMARK_VARIANT(name) Scalar##name
+#include "BenchmarkVariant.h"
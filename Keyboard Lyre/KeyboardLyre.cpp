@@ -12,6 +12,7 @@
 #include "ResourceFontContext.h"
 
 #define TSF_IMPLEMENTATION
+#define TSF_SAMPLES_SHORT
 #include "tsf.h"
 
 #pragma comment(lib, "Dwmapi.lib")
@@ -945,13 +946,18 @@ BOOL AudioInit()
     const void* pSoundFont = LockResource(hSoundFontGlobal);
 
     int SoundFontSize = SizeofResource(NULL, hRsrc);
-    g_TinySoundFont = tsf_load_memory(pSoundFont, SoundFontSize);
+    // The resource stays loaded for the lifetime of the process, so the samples can be used in place
+    g_TinySoundFont = tsf_load_memory_nocopy(pSoundFont, SoundFontSize);
     // g_TinySoundFont = tsf_load_filename("C:\\Users\\11603\\Downloads\\风物之诗琴.sf2");
     if (!g_TinySoundFont)
     {
         return FALSE;
     }
     tsf_set_max_voices(g_TinySoundFont, 256);
+    tsf_set_voice_stealing(g_TinySoundFont, TSF_STEAL_RELEASED);
+    tsf_set_audibility_floor(g_TinySoundFont, -90.0f);
+    // Page in the samples of the keys the lyre plays (see ButtonPressed) now instead of on the first key press
+    tsf_prefetch_preset(g_TinySoundFont, 0, 48 - 1, 72 + 11 + 1);
     // Set the SoundFont rendering output mode
     tsf_set_output(g_TinySoundFont, TSF_STEREO_INTERLEAVED, OutputAudioSpec.freq, 0);
 
@@ -12,7 +12,11 @@
    [OPTIONAL] #define TSF_NO_STDIO to remove stdio dependency
    [OPTIONAL] #define TSF_MALLOC, TSF_REALLOC, and TSF_FREE to avoid stdlib.h
    [OPTIONAL] #define TSF_MEMCPY, TSF_MEMSET to avoid string.h
-   [OPTIONAL] #define TSF_POW, TSF_POWF, TSF_EXPF, TSF_LOG, TSF_TAN, TSF_LOG10, TSF_SQRT to avoid math.h
+   [OPTIONAL] #define TSF_POW, TSF_POWF, TSF_EXPF, TSF_LOG, TSF_TAN, TSF_LOG10, TSF_SQRT, TSF_SIN, TSF_COS to avoid math.h
+   [OPTIONAL] #define TSF_NO_SIMD to only use the portable scalar render kernels
+   [OPTIONAL] #define TSF_NO_FLUSH_DENORMALS to leave the floating point mode alone while rendering
+   [OPTIONAL] #define TSF_NO_THREADS to remove the threading dependency (tsf_set_render_threads then only accepts 0 and 1)
+   [OPTIONAL] #define TSF_SAMPLES_SHORT to keep the samples as 16-bit in memory and convert them while rendering (half the sample memory)
 
    NOT YET IMPLEMENTED
      - Support for ChorusEffectsSend and ReverbEffectsSend generators
@@ -68,11 +72,63 @@ typedef struct tsf tsf;
 #ifndef TSF_NO_STDIO
 // Directly load a SoundFont from a .sf2 file path
 TSFDEF tsf* tsf_load_filename(const char* filename);
+
+// Load a SoundFont from a .sf2 file path without loading all sample data, for SoundFonts larger than
+// the memory. Only the first head_samples sample points of each sample header stay loaded, the rest of
+// a sample is read from the file by a background thread when a note using it starts. A voice that
+// gets ahead of the reading plays silence until the samples arrive, see tsf_underrun_count.
+// The file stays open until the loaded tsf and all copies of it are closed.
+//   head_samples: sample points to keep loaded from the start of each sample (e.g. 65536)
+TSFDEF tsf* tsf_load_filename_streaming(const char* filename, int head_samples);
 #endif
 
 // Load a SoundFont from a block of memory
 TSFDEF tsf* tsf_load_memory(const void* buffer, int size);
 
+// Load a SoundFont from a block of memory without copying the sample data, only the preset data is
+// read and allocated. The samples of a sample header are loaded when a region using it is played
+// the first time. With TSF_SAMPLES_SHORT they are used in place (and only get paged in), otherwise
+// they are converted into a float buffer at that point.
+// The buffer (i.e. a memory mapped file or a locked resource) must stay valid and unchanged until
+// the loaded tsf and all copies of it are closed.
+TSFDEF tsf* tsf_load_memory_nocopy(const void* buffer, int size);
+
+// Compress the sample data of a SoundFont in memory with the built-in lossless codec, returns the new
+// SoundFont in a buffer allocated with TSF_MALLOC (free by default) or null if the data is invalid or
+// allocation failed. Only TinySoundFont can load it, its smpl chunk is replaced by a tsfc chunk.
+// The samples of a compressed SoundFont get decoded in blocks as they are played, see tsf_set_sample_cache.
+// (SF3 files with Ogg Vorbis compressed samples are not supported.)
+//   compressed_size: receives the size of the returned buffer in bytes
+TSFDEF void* tsf_compress_memory(const void* buffer, int size, int* compressed_size);
+
+// A preset (by index in the loaded SoundFont) and the keys and velocities it gets played with
+struct tsf_strip_range { int preset_index, lokey, hikey, lovel, hivel; };
+
+// Make a smaller SoundFont in memory which only contains the presets in ranges with the zones and
+// instruments that play in the given keys and velocities and the sample data they use, returns it in a
+// buffer allocated with TSF_MALLOC (free by default) or null if the data is invalid or allocation failed.
+// Presets keep their order, so the preset indices in the new SoundFont count up in the order of
+// preset_index. Sample data and loop points are moved together, the sound of the kept ranges is unchanged.
+//   ranges: presets to keep, a preset can have multiple ranges
+//   stripped_size: receives the size of the returned buffer in bytes
+TSFDEF void* tsf_strip_memory(const void* buffer, int size, const struct tsf_strip_range* ranges, int range_count, int* stripped_size);
+
+// Write a loaded SoundFont as a baked image with its presets, regions and lookup tables fully resolved and
+// the sample data converted, returns it in a buffer allocated with TSF_MALLOC (free by default) or null if
+// allocation failed. Compressed or streamed samples get decoded or read from the file for this.
+// The image can only be loaded by a build with the same TSF_SAMPLES_SHORT setting and struct layout.
+//   baked_size: receives the size of the returned buffer in bytes
+TSFDEF void* tsf_bake(tsf* f, int* baked_size);
+
+// Load a baked image made by tsf_bake without parsing or converting anything, only the preset table is
+// allocated and everything else is used in place. Returns null if the image is from another version or
+// an incompatible build. Only the header and the section bounds are checked, the contents are trusted.
+// Like with tsf_load_memory_nocopy the samples of a sample header get paged in when a region using it is
+// played the first time.
+// The image (i.e. a memory mapped file, aligned to at least 4 bytes) must stay valid and unchanged until
+// the loaded tsf and all copies of it are closed.
+TSFDEF tsf* tsf_load_baked(const void* image, int size);
+
 // Stream structure for the generic loading
 struct tsf_stream
 {
@@ -92,7 +148,9 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream);
 // Copy a tsf instance from an existing one, use tsf_close to close it as well.
 // All copied tsf instances and their original instance are linked, and share the underlying soundfont.
 // This allows loading a soundfont only once, but using it for multiple independent playbacks.
-// (This function isn't thread-safe without locking.)
+// The copy starts with the settings of f but no voices or channels. The soundfont is freed
+// when the last instance using it is closed, no matter if that is the original or a copy.
+// (See item 5 of the thread safety notes below.)
 TSFDEF tsf* tsf_copy(tsf* f);
 
 // Free the memory related to this tsf instance
@@ -113,6 +171,27 @@ TSFDEF const char* tsf_get_presetname(const tsf* f, int preset_index);
 // Returns the name of a preset by bank and preset number
 TSFDEF const char* tsf_bank_get_presetname(const tsf* f, int bank, int preset_number);
 
+// Load the samples a preset plays in a range of keys (at any velocity) ahead of time, so playing the
+// notes later doesn't have to (only has an effect on SoundFonts loaded with tsf_load_memory_nocopy,
+// tsf_load_filename_streaming or compressed ones)
+//   lokey, hikey: range of keys between 0 and 127 (0 and 127 for the whole preset)
+TSFDEF void tsf_prefetch_preset(tsf* f, int preset_index, int lokey, int hikey);
+
+// Returns the number of sample points loaded for playback, and the number of sample points used by all
+// regions in total_samples (if not null). Only tsf_load_memory_nocopy, tsf_load_filename_streaming and compressed
+// SoundFonts load samples as they get played, for other SoundFonts this is the number of sample points in the SoundFont.
+TSFDEF int tsf_get_resident_samples(const tsf* f, int* total_samples);
+
+// Set the size of the cache of decoded samples of a compressed SoundFont or the samples read from the file
+// with tsf_load_filename_streaming (32 MB by default, shared by all copies of the tsf). Blocks used by playing
+// voices and the streamed sample heads are always kept, above the size the least recently used other
+// blocks get dropped and are decoded or read again when they are played the next time.
+//   max_bytes: cache size in bytes
+TSFDEF void tsf_set_sample_cache(tsf* f, int max_bytes);
+
+// Returns the number of bytes used by the per preset lookup tables from key to regions which get built when loading
+TSFDEF int tsf_get_keyindex_size(const tsf* f);
+
 // Supported output modes by the render methods
 enum TSFOutputMode
 {
@@ -146,13 +225,64 @@ enum TSFOutputMode
 // if no channel with that number was previously used. Make sure to
 // create all channels at the beginning as required if you call tsf_render*
 // from a different thread.
+//
+// 3. Render threads:
+//
+// With tsf_set_render_threads the tsf_render* functions hand voices to
+// worker threads and wait for them before returning, so the rules above
+// stay the same. tsf_set_render_threads itself must not be called while
+// another thread is inside tsf_render*.
+//
+// 4. Compressed and streamed samples:
+//
+// The sample cache of a compressed or streamed SoundFont has its own lock
+// and thread that decodes or reads the samples, playing notes on copies of
+// a tsf from different threads doesn't need any additional locking for it.
+// The render functions never wait for that thread.
+//
+// 5. Copies on many threads:
+//
+// The soundfont shared by copies of a tsf doesn't change after loading
+// apart from the samples loaded on first use, which have their own lock.
+// tsf_copy and tsf_close can be called on any thread at any time, for
+// example to create and close instances in parallel, as long as f isn't
+// being closed at the same time and no tsf_set_* function changes its
+// settings meanwhile. Each instance itself still follows the rules above.
 
 // Setup the parameters for the voice render methods
 //   outputmode: if mono or stereo and how stereo channel data is ordered
 //   samplerate: the number of samples per second (output frequency)
 //   global_gain_db: volume gain in decibels (>0 means higher, <0 means lower)
+// This also selects the render kernels (AVX2, SSE2 or scalar) for the running CPU.
 TSFDEF void tsf_set_output(tsf* f, enum TSFOutputMode outputmode, int samplerate, float global_gain_db CPP_DEFAULT0);
 
+// Supported interpolation modes for resampling the source samples to the output rate
+enum TSFInterpolation
+{
+	// Use the source sample closest to the playback position
+	TSF_INTERP_NEAREST,
+	// Linear interpolation between the two neighboring source samples (default)
+	TSF_INTERP_LINEAR,
+	// 4-point cubic Hermite (Catmull-Rom) interpolation
+	TSF_INTERP_CUBIC,
+	// 8-tap Blackman windowed sinc interpolation
+	TSF_INTERP_SINC,
+};
+
+// Set the interpolation quality of the voice render methods
+// Cubic and sinc use precomputed coefficient tables which get built once per process when the first tsf is loaded.
+// With linear interpolation voices get rendered in groups of up to 8 in lockstep.
+//   interpolation: one of the TSFInterpolation modes, each one costs more per voice than the one before
+TSFDEF void tsf_set_interpolation(tsf* f, enum TSFInterpolation interpolation);
+
+// Use approximations instead of the math library for the per block pitch, gain, filter and envelope
+// updates while rendering (off by default). Their relative error, measured against long double math,
+// is below 1.3e-12 for 2^x (used for pitch, gain, cutoff and envelope slopes, |x| < 1000) and below
+// 2e-13 for tan (the lowpass coefficients, for cutoffs up to 0.499 of the sample rate). That is far
+// below the float precision of the rendered samples.
+//   enable: TSF_TRUE to use the approximations, TSF_FALSE for the math library functions
+TSFDEF void tsf_set_fast_math(tsf* f, int enable);
+
 // Set the global gain as a volume factor
 //   global_gain: the desired volume where 1.0 is 100%
 TSFDEF void tsf_set_volume(tsf* f, float global_gain);
@@ -164,6 +294,41 @@ TSFDEF void tsf_set_volume(tsf* f, float global_gain);
 //   (tsf_set_max_voices returns 0 if allocation failed, otherwise 1)
 TSFDEF int tsf_set_max_voices(tsf* f, int max_voices);
 
+// Supported strategies for when a note is played while all voices set by tsf_set_max_voices are in use
+enum TSFVoiceStealing
+{
+	// Don't play the new note (default)
+	TSF_STEAL_NONE,
+	// End the voice that started playing first
+	TSF_STEAL_OLDEST,
+	// End the voice with the lowest envelope level times note gain, as of the last render and in 3 dB
+	// steps (voices still in their delay, attack or hold segment count with the peak level)
+	TSF_STEAL_QUIETEST,
+	// End the voice that was released first, or the oldest voice if no voice is in release
+	TSF_STEAL_RELEASED,
+};
+
+// Set how voices are stolen once the maximum number of voices is reached (no effect without tsf_set_max_voices)
+// Stolen voices fade out quickly instead of getting cut off, to make room for that the last
+// few voices (TSF_STEAL_HEADROOM) are only used while other voices are fading out.
+//   stealing: one of the TSFVoiceStealing strategies
+TSFDEF void tsf_set_voice_stealing(tsf* f, enum TSFVoiceStealing stealing);
+
+// Set the level below which decaying voices are ended early while rendering (off by default)
+// A voice is ended once its amplitude envelope is in decay, sustain or release and the envelope
+// level times its note gain (at the peak of the modulation LFO) is below the floor. Voices ended
+// this way don't come back if the channel volume is raised afterwards.
+//   floor_db: audibility floor in decibels below full scale (e.g. -90.0), 0 or above to turn culling off
+TSFDEF void tsf_set_audibility_floor(tsf* f, float floor_db);
+
+// Render the voices on a pool of threads (off by default)
+// The active voices get split into groups of up to 8 which the threads render into separate
+// buffers that are then summed in a fixed order, so the output is the same for any number of
+// threads (but can differ in the last bits from rendering without a pool).
+//   threads: number of threads including the one calling tsf_render*, 1 to 16, or 0 to stop the pool
+//   (tsf_set_render_threads returns 0 if starting the threads or allocation failed, otherwise 1)
+TSFDEF int tsf_set_render_threads(tsf* f, int threads);
+
 // Start playing a note
 //   preset_index: preset index >= 0 and < tsf_get_presetcount()
 //   key: note value between 0 and 127 (60 being middle C)
@@ -186,9 +351,18 @@ TSFDEF void tsf_note_off_all(tsf* f);
 // Returns the number of active voices
 TSFDEF int tsf_active_voice_count(tsf* f);
 
+// Returns the number of voices ended below the audibility floor since loading or copying
+TSFDEF int tsf_culled_voice_count(tsf* f);
+
+// Returns how often a voice played a block of TSF_RENDER_EFFECTSAMPLEBLOCK output samples from samples
+// that weren't read from the file (or decoded) in time since loading or copying
+TSFDEF int tsf_underrun_count(tsf* f);
+
 // Render output samples into a buffer
 // You can either render as signed 16-bit values (tsf_render_short) or
 // as 32-bit float values (tsf_render_float)
+// While rendering, denormal numbers are flushed to zero (on x86 with SSE2, so on every x86-64 CPU, and on AArch64,
+// unless TSF_NO_FLUSH_DENORMALS is defined), the floating point mode of the calling thread is restored before returning.
 //   buffer: target buffer of size samples * output_channels * sizeof(type)
 //   samples: number of samples to render
 //   flag_mixing: if 0 clear the buffer first, otherwise mix into existing data
@@ -272,6 +446,27 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 // Grace release time for quick voice off (avoid clicking noise)
 #define TSF_FASTRELEASETIME 0.01f
 
+// Silent samples before and after the sample data so the widest interpolation
+// kernel (8-tap sinc reads 3 samples before and 4 after) never reads outside of it
+#define TSF_INTERP_PADDING 4
+
+// Each looping region gets a copy of the samples around its loop end followed by
+// the samples from its loop start, so playback across the loop end can read the
+// interpolation taps without checking for the wrap on every sample
+#define TSF_LOOPGUARD_BEFORE 8
+#define TSF_LOOPGUARD_AFTER 8
+
+// Compressed sample data is coded in independent blocks of TSF_DECODE_BLOCK sample points. When a voice
+// starts, the blocks up to TSF_DECODE_HEAD sample points after its start get decoded right away and the
+// rest of its sample by the decode thread.
+#define TSF_DECODE_BLOCK 4096
+#define TSF_DECODE_HEAD 65536
+#define TSF_DECODE_CACHE (32 << 20)
+#define TSF_PAGE_SIZE 4096
+
+// Number of ones in a Rice code quotient after which the residual is stored raw
+#define TSF_DECODE_ESCAPE 16
+
 #if !defined(TSF_MALLOC) || !defined(TSF_FREE) || !defined(TSF_REALLOC)
 #  include <stdlib.h>
 #  define TSF_MALLOC  malloc
@@ -285,7 +480,7 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 #  define TSF_MEMSET  memset
 #endif
 
-#if !defined(TSF_POW) || !defined(TSF_POWF) || !defined(TSF_EXPF) || !defined(TSF_LOG) || !defined(TSF_TAN) || !defined(TSF_LOG10) || !defined(TSF_SQRT)
+#if !defined(TSF_POW) || !defined(TSF_POWF) || !defined(TSF_EXPF) || !defined(TSF_LOG) || !defined(TSF_TAN) || !defined(TSF_LOG10) || !defined(TSF_SQRT) || !defined(TSF_SIN) || !defined(TSF_COS)
 #  include <math.h>
 #  if !defined(__cplusplus) && !defined(NAN) && !defined(powf) && !defined(expf) && !defined(sqrtf)
 #    define powf (float)pow // deal with old math.h
@@ -299,16 +494,94 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 #  define TSF_TAN     tan
 #  define TSF_LOG10   log10
 #  define TSF_SQRTF   sqrtf
+#  define TSF_SIN     sin
+#  define TSF_COS     cos
 #endif
 
 #ifndef TSF_NO_STDIO
 #  include <stdio.h>
 #endif
 
+#if defined(_WIN32)
+#  include <windows.h>
+#endif
+
+#ifndef TSF_NO_THREADS
+#  if defined(_WIN32)
+#    define TSF_POOL_LOCK(pool)           EnterCriticalSection(&(pool)->lock)
+#    define TSF_POOL_UNLOCK(pool)         LeaveCriticalSection(&(pool)->lock)
+#    define TSF_POOL_WAIT(pool, cond)     SleepConditionVariableCS(&(pool)->cond, &(pool)->lock, INFINITE)
+#    define TSF_POOL_WAKEALL(pool, cond)  WakeAllConditionVariable(&(pool)->cond)
+#  else
+#    include <pthread.h>
+#    define TSF_POOL_LOCK(pool)           pthread_mutex_lock(&(pool)->lock)
+#    define TSF_POOL_UNLOCK(pool)         pthread_mutex_unlock(&(pool)->lock)
+#    define TSF_POOL_WAIT(pool, cond)     pthread_cond_wait(&(pool)->cond, &(pool)->lock)
+#    define TSF_POOL_WAKEALL(pool, cond)  pthread_cond_broadcast(&(pool)->cond)
+#  endif
+#endif
+
+// The reference count of a bank shared by copies of a tsf changes on whichever thread copies or closes one,
+// TSF_ATOMIC_DEC returns the new count
+#if defined(_WIN32)
+#  define TSF_ATOMIC_LONG volatile long
+#  define TSF_ATOMIC_INC(p) InterlockedIncrement(p)
+#  define TSF_ATOMIC_DEC(p) InterlockedDecrement(p)
+#elif defined(__GNUC__)
+#  define TSF_ATOMIC_LONG volatile long
+#  define TSF_ATOMIC_INC(p) __atomic_add_fetch(p, 1, __ATOMIC_ACQ_REL)
+#  define TSF_ATOMIC_DEC(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#  include <stdatomic.h>
+#  define TSF_ATOMIC_LONG _Atomic long
+#  define TSF_ATOMIC_INC(p) atomic_fetch_add(p, 1)
+#  define TSF_ATOMIC_DEC(p) (atomic_fetch_sub(p, 1) - 1)
+#elif defined(TSF_NO_THREADS)
+#  define TSF_ATOMIC_LONG long
+#  define TSF_ATOMIC_INC(p) (++*(p))
+#  define TSF_ATOMIC_DEC(p) (--*(p))
+#else
+#  error Atomic operations are not available for this compiler, define TSF_NO_THREADS if all tsf instances are only used on one thread
+#endif
+
+// Decoded samples of compressed SoundFonts are kept in pages that can be handed back to the system
+#if defined(_WIN32)
+#  define TSF_PAGES_WIN32
+#elif defined(__unix__) || defined(__APPLE__)
+#  include <sys/mman.h>
+#  if defined(MAP_ANONYMOUS) || defined(MAP_ANON)
+#    define TSF_PAGES_MMAN
+#    ifndef MAP_ANONYMOUS
+#      define MAP_ANONYMOUS MAP_ANON
+#    endif
+#  endif
+#endif
+
+// The CPU features are detected on x86 for the floating point mode (see tsf_denormals_disable)
+// even when the SIMD kernels are left out with TSF_NO_SIMD
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#  define TSF_X86
+#  ifndef TSF_NO_SIMD
+#    define TSF_SIMD_X86
+#  endif
+#  include <immintrin.h>
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#    define TSF_TARGET_SSE2
+#    define TSF_TARGET_AVX2
+#  else
+#    define TSF_TARGET_SSE2 __attribute__((target("sse2")))
+#    define TSF_TARGET_AVX2 __attribute__((target("avx2")))
+#  endif
+#endif
+
 #define TSF_TRUE 1
 #define TSF_FALSE 0
 #define TSF_BOOL char
 #define TSF_PI 3.14159265358979323846264338327950288
+#define TSF_LN2 0.69314718055994530941723212145817657
+#define TSF_LOG2E 1.44269504088896340735992468100189214
+#define TSF_LOG2_10 3.32192809488736234787031942948939018
 #define TSF_NULL 0
 
 #ifdef __cplusplus
@@ -321,18 +594,80 @@ typedef unsigned char tsf_u8;
 typedef unsigned short tsf_u16;
 typedef signed short tsf_s16;
 typedef unsigned int tsf_u32;
+typedef unsigned long long tsf_u64;
 typedef char tsf_char20[20];
 
+// Sample data format in memory, the kernels scale 16-bit samples to -1.0 to 1.0 with the interpolation weights
+#ifdef TSF_SAMPLES_SHORT
+typedef short tsf_sample;
+#define TSF_SAMPLE_ONE (1.0f / 32767.0f)
+#define TSF_SAMPLE_FROM_SHORT(s) (s)
+#else
+typedef float tsf_sample;
+#define TSF_SAMPLE_ONE 1.0f
+#define TSF_SAMPLE_FROM_SHORT(s) ((float)((s) / 32767.0))
+#endif
+
 #define TSF_FourCCEquals(value1, value2) (value1[0] == value2[0] && value1[1] == value2[1] && value1[2] == value2[2] && value1[3] == value2[3])
 
-struct tsf
+// Active voices are linked into lists by exclusive group, by preset and key and by channel, the list heads
+// are hash slots in tsf::voiceHeads so a list can contain voices of other groups, keys or channels as well
+enum { TSF_VOICELIST_GROUP, TSF_VOICELIST_KEY, TSF_VOICELIST_CHANNEL, TSF_VOICELIST_COUNT };
+#define TSF_VOICEGROUP_SLOTS 32
+#define TSF_VOICEKEY_SLOTS 256
+#define TSF_VOICECHANNEL_SLOTS 16
+#define TSF_VOICEHEAD_GROUP(group) ((int)((group) % TSF_VOICEGROUP_SLOTS))
+#define TSF_VOICEHEAD_KEY(preset, key) (TSF_VOICEGROUP_SLOTS + (int)(((unsigned int)(preset) * 131 + (unsigned int)(key)) % TSF_VOICEKEY_SLOTS))
+#define TSF_VOICEHEAD_CHANNEL(channel) (TSF_VOICEGROUP_SLOTS + TSF_VOICEKEY_SLOTS + (int)((unsigned int)(channel) % TSF_VOICECHANNEL_SLOTS))
+#define TSF_STEAL_HEADROOM 4
+
+// Active voices that can be stolen are linked into steal lists (appended at the end) by three links: by age
+// (voices in the order they started, or the fading list of voices ended quickly in the order they were ended),
+// by release (voices released but not fading in the order they were released) and with TSF_STEAL_QUIETEST by
+// loudness (one list per TSF_QUIET_BUCKETS step of loudness, see tsf_voice_loudbucket).
+enum { TSF_STEALLINK_AGE, TSF_STEALLINK_RELEASE, TSF_STEALLINK_QUIET, TSF_STEALLINK_COUNT };
+enum { TSF_STEALLIST_AGE, TSF_STEALLIST_FADING, TSF_STEALLIST_RELEASED, TSF_STEALLIST_QUIET };
+#define TSF_QUIET_BUCKETS 64
+#define TSF_STEALLIST_COUNT (TSF_STEALLIST_QUIET + TSF_QUIET_BUCKETS)
+
+#define TSF_PRESETLOOKUP_HASH(bank, preset) ((((unsigned int)(bank) << 16 | (unsigned int)(preset)) * 2654435761u) >> 12)
+
+// The loaded SoundFont, shared by a tsf and all its copies. Nothing in it changes after loading except
+// the residency, which locks itself, and refCount, which only changes atomically (see tsf_copy).
+struct tsf_bank
 {
 	struct tsf_preset* presets;
-	float* fontSamples;
+	int* presetLookup; // open addressing hash table from bank and preset number to preset index (-1 if empty)
+	unsigned int presetLookupMask;
+	tsf_sample* fontSamples; // not allocated by the bank (points into the buffer given to tsf_load_memory_nocopy or the decoder) if fontSamplesShared is set
+	tsf_sample* loopGuards; // loop guard samples of all looping regions, see tsf_load_loopguards
+	unsigned int fontSampleCount;
+	TSF_BOOL fontSamplesShared;
+	TSF_BOOL baked; // the regions and key indices of the presets, presetLookup and loopGuards point into the image given to tsf_load_baked
+	struct tsf_residency* residency; // samples loaded on first use, null if all samples are loaded
+	int presetNum;
+	TSF_ATOMIC_LONG refCount; // number of tsf instances using the bank
+};
+
+struct tsf
+{
+	struct tsf_bank* bank;
 	struct tsf_voice* voices;
 	struct tsf_channels* channels;
 
-	int presetNum;
+	// Indices of playing voices, activeVoices is used by the playback functions and renderVoices by the
+	// render functions. startedVoices is a ring of voices started since the last render (voiceNum + 1 long).
+	// freeVoices is the stack of voices not in activeVoices, voiceHeads are the first voices of the
+	// group, key and channel lists (-1 if empty). Both are used by the playback functions.
+	// stealFirst/stealLast are the ends of the steal lists (-1 if empty), also used by the playback functions.
+	int *activeVoices, *renderVoices, *startedVoices, *freeVoices;
+	int activeVoiceNum, renderVoiceNum, startedRead, startedWrite, freeVoiceNum;
+	int voiceHeads[TSF_VOICEGROUP_SLOTS + TSF_VOICEKEY_SLOTS + TSF_VOICECHANNEL_SLOTS];
+	int stealFirst[TSF_STEALLIST_COUNT], stealLast[TSF_STEALLIST_COUNT];
+	enum TSFVoiceStealing stealing;
+	float cullGain; // audibility floor as gain factor, 0 if culling is off
+	int culledVoiceNum, underrunNum;
+
 	int voiceNum;
 	int maxVoiceNum;
 	unsigned int voicePlayIndex;
@@ -340,12 +675,46 @@ struct tsf
 	enum TSFOutputMode outputmode;
 	float outSampleRate;
 	float globalGainDB;
-	int* refCount;
+	const struct tsf_kernels* kernels;
+	enum TSFInterpolation interpolation;
+	TSF_BOOL fastMath;
+	struct tsf_render_pool* renderPool;
 };
 
+struct tsf_stream_memory { const char* buffer; unsigned int total, pos; };
+static tsf* tsf_load_stream(struct tsf_stream* stream, struct tsf_stream_memory* memory, TSF_BOOL nocopy, void* file, unsigned int fileHead);
+
 #ifndef TSF_NO_STDIO
+// Seek and tell with 64-bit offsets, a streamed SoundFont can be larger than 2 GB where long has 32 bits
+static int tsf_file_seek(FILE* f, tsf_u64 offset, int origin)
+{
+	#if defined(_WIN32)
+	return _fseeki64(f, (__int64)offset, origin);
+	#elif defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L
+	if ((off_t)offset < 0 || (tsf_u64)(off_t)offset != offset) return -1;
+	return fseeko(f, (off_t)offset, origin);
+	#else
+	if ((long)offset < 0 || (tsf_u64)(long)offset != offset) return -1;
+	return fseek(f, (long)offset, origin);
+	#endif
+}
+
+static int tsf_file_tell(FILE* f, tsf_u64* offset)
+{
+	#if defined(_WIN32)
+	__int64 res = _ftelli64(f);
+	#elif defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L
+	off_t res = ftello(f);
+	#else
+	long res = ftell(f);
+	#endif
+	if (res < 0) return 0;
+	*offset = (tsf_u64)res;
+	return 1;
+}
+
 static int tsf_stream_stdio_read(FILE* f, void* ptr, unsigned int size) { return (int)fread(ptr, 1, size, f); }
-static int tsf_stream_stdio_skip(FILE* f, unsigned int count) { return !fseek(f, count, SEEK_CUR); }
+static int tsf_stream_stdio_skip(FILE* f, unsigned int count) { return !tsf_file_seek(f, count, SEEK_CUR); }
 TSFDEF tsf* tsf_load_filename(const char* filename)
 {
 	tsf* res;
@@ -365,9 +734,25 @@ TSFDEF tsf* tsf_load_filename(const char* filename)
 	fclose(f);
 	return res;
 }
+
+TSFDEF tsf* tsf_load_filename_streaming(const char* filename, int head_samples)
+{
+	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_stdio_read, (int(*)(void*,unsigned int))&tsf_stream_stdio_skip };
+	#if __STDC_WANT_SECURE_LIB__
+	FILE* f = TSF_NULL; fopen_s(&f, filename, "rb");
+	#else
+	FILE* f = fopen(filename, "rb");
+	#endif
+	if (!f)
+	{
+		//if (e) *e = TSF_FILENOTFOUND;
+		return TSF_NULL;
+	}
+	stream.data = f;
+	return tsf_load_stream(&stream, TSF_NULL, TSF_FALSE, f, (head_samples > 0 ? (unsigned int)head_samples : 0)); // closes f unless the samples are read from it
+}
 #endif
 
-struct tsf_stream_memory { const char* buffer; unsigned int total, pos; };
 static int tsf_stream_memory_read(struct tsf_stream_memory* m, void* ptr, unsigned int size) { if (size > m->total - m->pos) size = m->total - m->pos; TSF_MEMCPY(ptr, m->buffer+m->pos, size); m->pos += size; return size; }
 static int tsf_stream_memory_skip(struct tsf_stream_memory* m, unsigned int count) { if (m->pos + count > m->total) return 0; m->pos += count; return 1; }
 TSFDEF tsf* tsf_load_memory(const void* buffer, int size)
@@ -377,7 +762,17 @@ TSFDEF tsf* tsf_load_memory(const void* buffer, int size)
 	f.buffer = (const char*)buffer;
 	f.total = size;
 	stream.data = &f;
-	return tsf_load(&stream);
+	return tsf_load_stream(&stream, &f, TSF_FALSE, TSF_NULL, 0);
+}
+
+TSFDEF tsf* tsf_load_memory_nocopy(const void* buffer, int size)
+{
+	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_memory_read, (int(*)(void*,unsigned int))&tsf_stream_memory_skip };
+	struct tsf_stream_memory f = { 0, 0, 0 };
+	f.buffer = (const char*)buffer;
+	f.total = size;
+	stream.data = &f;
+	return tsf_load_stream(&stream, &f, TSF_TRUE, TSF_NULL, 0);
 }
 
 enum { TSF_LOOPMODE_NONE, TSF_LOOPMODE_CONTINUOUS, TSF_LOOPMODE_SUSTAIN };
@@ -403,21 +798,56 @@ struct tsf_hydra_imod { tsf_u16 modSrcOper, modDestOper; tsf_s16 modAmount; tsf_
 struct tsf_hydra_igen { tsf_u16 genOper; union tsf_hydra_genamount genAmount; };
 struct tsf_hydra_shdr { tsf_char20 sampleName; tsf_u32 start, end, startLoop, endLoop, sampleRate; tsf_u8 originalPitch; tsf_s8 pitchCorrection; tsf_u16 sampleLink, sampleType; };
 
-#define TSFR(FIELD) stream->read(stream->data, &i->FIELD, sizeof(i->FIELD));
-static void tsf_hydra_read_phdr(struct tsf_hydra_phdr* i, struct tsf_stream* stream) { TSFR(presetName) TSFR(preset) TSFR(bank) TSFR(presetBagNdx) TSFR(library) TSFR(genre) TSFR(morphology) }
-static void tsf_hydra_read_pbag(struct tsf_hydra_pbag* i, struct tsf_stream* stream) { TSFR(genNdx) TSFR(modNdx) }
-static void tsf_hydra_read_pmod(struct tsf_hydra_pmod* i, struct tsf_stream* stream) { TSFR(modSrcOper) TSFR(modDestOper) TSFR(modAmount) TSFR(modAmtSrcOper) TSFR(modTransOper) }
-static void tsf_hydra_read_pgen(struct tsf_hydra_pgen* i, struct tsf_stream* stream) { TSFR(genOper) TSFR(genAmount) }
-static void tsf_hydra_read_inst(struct tsf_hydra_inst* i, struct tsf_stream* stream) { TSFR(instName) TSFR(instBagNdx) }
-static void tsf_hydra_read_ibag(struct tsf_hydra_ibag* i, struct tsf_stream* stream) { TSFR(instGenNdx) TSFR(instModNdx) }
-static void tsf_hydra_read_imod(struct tsf_hydra_imod* i, struct tsf_stream* stream) { TSFR(modSrcOper) TSFR(modDestOper) TSFR(modAmount) TSFR(modAmtSrcOper) TSFR(modTransOper) }
-static void tsf_hydra_read_igen(struct tsf_hydra_igen* i, struct tsf_stream* stream) { TSFR(genOper) TSFR(genAmount) }
-static void tsf_hydra_read_shdr(struct tsf_hydra_shdr* i, struct tsf_stream* stream) { TSFR(sampleName) TSFR(start) TSFR(end) TSFR(startLoop) TSFR(endLoop) TSFR(sampleRate) TSFR(originalPitch) TSFR(pitchCorrection) TSFR(sampleLink) TSFR(sampleType) }
-#undef TSFR
+static tsf_u32 tsf_riff_get16(const unsigned char* p) { return (tsf_u32)p[0] | ((tsf_u32)p[1] << 8); }
+static void tsf_riff_put16(unsigned char* p, tsf_u32 v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); }
+static tsf_u32 tsf_riff_get32(const unsigned char* p) { return (tsf_u32)p[0] | ((tsf_u32)p[1] << 8) | ((tsf_u32)p[2] << 16) | ((tsf_u32)p[3] << 24); }
+static void tsf_riff_put32(unsigned char* p, tsf_u32 v) { p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8); p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24); }
+static TSF_BOOL tsf_riff_id(const unsigned char* p, const char* id) { return TSF_FourCCEquals(p, id); }
+
+// Decode the records from the packed little-endian data of their pdta sub-chunk
+#define TSFR8(FIELD, AT) i->FIELD = p[AT];
+#define TSFR16(FIELD, AT) i->FIELD = (tsf_u16)tsf_riff_get16(p + AT);
+#define TSFR32(FIELD, AT) i->FIELD = tsf_riff_get32(p + AT);
+#define TSFRNAME(FIELD) TSF_MEMCPY(i->FIELD, p, sizeof(tsf_char20));
+static void tsf_hydra_read_phdr(struct tsf_hydra_phdr* i, const unsigned char* p) { TSFRNAME(presetName) TSFR16(preset, 20) TSFR16(bank, 22) TSFR16(presetBagNdx, 24) TSFR32(library, 26) TSFR32(genre, 30) TSFR32(morphology, 34) }
+static void tsf_hydra_read_pbag(struct tsf_hydra_pbag* i, const unsigned char* p) { TSFR16(genNdx, 0) TSFR16(modNdx, 2) }
+static void tsf_hydra_read_pmod(struct tsf_hydra_pmod* i, const unsigned char* p) { TSFR16(modSrcOper, 0) TSFR16(modDestOper, 2) TSFR16(modAmount, 4) TSFR16(modAmtSrcOper, 6) TSFR16(modTransOper, 8) }
+static void tsf_hydra_read_pgen(struct tsf_hydra_pgen* i, const unsigned char* p) { TSFR16(genOper, 0) TSFR16(genAmount.wordAmount, 2) }
+static void tsf_hydra_read_inst(struct tsf_hydra_inst* i, const unsigned char* p) { TSFRNAME(instName) TSFR16(instBagNdx, 20) }
+static void tsf_hydra_read_ibag(struct tsf_hydra_ibag* i, const unsigned char* p) { TSFR16(instGenNdx, 0) TSFR16(instModNdx, 2) }
+static void tsf_hydra_read_imod(struct tsf_hydra_imod* i, const unsigned char* p) { TSFR16(modSrcOper, 0) TSFR16(modDestOper, 2) TSFR16(modAmount, 4) TSFR16(modAmtSrcOper, 6) TSFR16(modTransOper, 8) }
+static void tsf_hydra_read_igen(struct tsf_hydra_igen* i, const unsigned char* p) { TSFR16(genOper, 0) TSFR16(genAmount.wordAmount, 2) }
+static void tsf_hydra_read_shdr(struct tsf_hydra_shdr* i, const unsigned char* p) { TSFRNAME(sampleName) TSFR32(start, 20) TSFR32(end, 24) TSFR32(startLoop, 28) TSFR32(endLoop, 32) TSFR32(sampleRate, 36) TSFR8(originalPitch, 40) TSFR8(pitchCorrection, 41) TSFR16(sampleLink, 42) TSFR16(sampleType, 44) }
+#undef TSFR8
+#undef TSFR16
+#undef TSFR32
+#undef TSFRNAME
+
+static TSF_BOOL tsf_hydra_chunk(struct tsf_stream* stream, struct tsf_stream_memory* memory, tsf_u32 size, const unsigned char** records, unsigned char** buffer, tsf_u32* bufferSize)
+{
+	// Get all records of a pdta sub-chunk with a single read into the buffer (grown as needed),
+	// or right where they are if the stream reads from memory
+	if (memory)
+	{
+		if (size > memory->total - memory->pos) return TSF_FALSE;
+		*records = (const unsigned char*)memory->buffer + memory->pos;
+		memory->pos += size;
+		return TSF_TRUE;
+	}
+	if (size > *bufferSize)
+	{
+		unsigned char* grown = (unsigned char*)TSF_REALLOC(*buffer, size);
+		if (!grown) return TSF_FALSE;
+		*buffer = grown;
+		*bufferSize = size;
+	}
+	*records = *buffer;
+	return (!size || stream->read(stream->data, *buffer, size) == (int)size);
+}
 
 struct tsf_riffchunk { tsf_fourcc id; tsf_u32 size; };
 struct tsf_envelope { float delay, attack, hold, decay, sustain, release, keynumToHold, keynumToDecay; };
-struct tsf_voice_envelope { float level, slope; int samplesUntilNextSegment; short segment, midiVelocity; struct tsf_envelope parameters; TSF_BOOL segmentIsExponential, isAmpEnv; };
+struct tsf_voice_envelope { float level, slope, slopeLog2; int samplesUntilNextSegment; short segment, midiVelocity; struct tsf_envelope parameters; TSF_BOOL segmentIsExponential, isAmpEnv; };
 struct tsf_voice_lowpass { double QInv, a0, a1, b1, b2, z1, z2; TSF_BOOL active; };
 struct tsf_voice_lfo { int samplesUntil; float level, delta; };
 
@@ -436,22 +866,100 @@ struct tsf_region
 	int freqModLFO, modLfoToPitch;
 	float delayVibLFO;
 	int freqVibLFO, vibLfoToPitch;
+	unsigned int loop_guard;
+	int sample; // index of the sample header
 };
 
+// The samples of a SoundFont loaded with tsf_load_memory_nocopy get loaded (converted or paged in) by
+// sample header when a region using it is played the first time, shared by all copies of a tsf.
+// The lock guards resident and residentNum as copies can play the same sample on different threads.
+struct tsf_sample_range { unsigned int start, end; TSF_BOOL resident; };
+struct tsf_residency
+{
+	const short* source; // sample data to convert, null if the samples are used in place
+	unsigned int residentNum, totalNum; // sample points
+	int rangeNum;
+	struct tsf_sample_range* ranges; // sample points played by the regions of each sample header (empty if start >= end)
+	struct tsf_decoder* decoder; // decodes the compressed sample data in blocks, null if the samples aren't compressed
+	#ifndef TSF_NO_THREADS
+	#  if defined(_WIN32)
+	CRITICAL_SECTION lock;
+	#  else
+	pthread_mutex_t lock;
+	#  endif
+	#endif
+};
+
+// Compressed sample data (a tsfc chunk in the sdta list instead of smpl, see tsf_compress_memory) starts
+// with the number of sample points, the block size and the byte offsets of the blocks (and the end of the
+// last one) after the table. Each block starts with a Rice parameter k followed by the residuals of a
+// second order predictor (2 * previous - the one before, both 0 at the block start), zigzag mapped and
+// Rice coded least significant bit first: q = residual >> k ones, a zero and the low k bits, or
+// TSF_DECODE_ESCAPE ones and 18 bits of the residual if q would be that long or longer.
+// Blocks get decoded in their place of the sample buffer, so the voices read them like uncompressed
+// samples. Blocks are pinned while voices play them, above maxResident decoded blocks the least recently
+// used unpinned ones get dropped and their memory pages are handed back to the system.
+// The render functions never wait for the decode thread, a voice that gets ahead of it (only possible
+// past TSF_DECODE_HEAD at a very high pitch) plays silence from the blocks that aren't decoded yet.
+// A SoundFont loaded with tsf_load_filename_streaming uses the same blocks, but instead of decoding them
+// the thread reads them from the smpl chunk in the file. The blocks of the head of each sample stay pinned.
+enum { TSF_BLOCK_EMPTY, TSF_BLOCK_DECODING, TSF_BLOCK_RESIDENT };
+struct tsf_decode_block { unsigned int offset; int pins, lruPrev, lruNext; unsigned char state; TSF_BOOL queued; };
+
+struct tsf_decoder
+{
+	const unsigned char* data; // compressed blocks, in the buffer given to tsf_load_memory_nocopy or dataMemory
+	unsigned char* dataMemory;
+	tsf_sample* samples; // the decoded sample buffer (fontSamples), in pageMemory after the padding
+	void* pageMemory;
+	size_t pageSize;
+	unsigned int sampleCount;
+	int blockNum, residentNum, maxResident;
+	struct tsf_decode_block* blocks; // blockNum + 1 entries, the last one only holds the end offset
+	int lruFirst, lruLast; // list of the decoded blocks that are not pinned, least recently used first
+	int *queue, queueRead, queueWrite; // ring of the blocks for the decode thread (blockNum + 1 long)
+	unsigned int headNum; // sample points after the start of a voice that are decoded before it starts (0 for streamed samples)
+	#ifndef TSF_NO_STDIO
+	FILE* file; // file to read the blocks from instead of decoding them (owned by the decoder), null if compressed
+	tsf_u64 fileOffset; // position of the smpl chunk data in the file
+	#endif
+	#ifndef TSF_NO_THREADS
+	int started, quit;
+	TSF_BOOL reading; // a thread reads from the file, which is done without holding the lock
+	#  if defined(_WIN32)
+	HANDLE thread;
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE start, done;
+	#  else
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	#  endif
+	#endif
+};
+
+#define TSF_KEYINDEX_KEYS 128
+
 struct tsf_preset
 {
 	tsf_char20 presetName;
 	tsf_u16 preset, bank;
 	struct tsf_region* regions;
 	int regionNum;
+	int* keyIndex; // TSF_KEYINDEX_KEYS + 1 offsets into the region indices that follow, by key, each key in region order
 };
 
 struct tsf_voice
 {
 	int playingPreset, playingKey, playingChannel;
+	int listHead[TSF_VOICELIST_COUNT], listPrev[TSF_VOICELIST_COUNT], listNext[TSF_VOICELIST_COUNT]; // voice list links, listHead is -1 if not linked
+	int stealList[TSF_STEALLINK_COUNT], stealPrev[TSF_STEALLINK_COUNT], stealNext[TSF_STEALLINK_COUNT]; // steal list links, stealList is -1 if not linked
+	int loudBucket; // steal list by loudness, updated by the renderer with TSF_STEAL_QUIETEST
+	TSF_BOOL inRenderList, culled, pinned; // pinned: keeps the decoded blocks of its sample, see tsf_residency_fetch
+	int underrunNum; // render blocks that started in a sample block not decoded or read yet, see tsf_render_voices_compact
 	struct tsf_region* region;
 	double pitchInputTimecents, pitchOutputFactor;
-	double sourceSamplePosition;
+	tsf_u64 sourceSamplePosition; // 32.32 fixed point, integer part indexes fontSamples
 	float  noteGainDB, panFactorLeft, panFactorRight;
 	unsigned int playIndex, loopStart, loopEnd;
 	struct tsf_voice_envelope ampenv, modenv;
@@ -478,6 +986,48 @@ static float tsf_cents2Hertz(float cents) { return 8.176f * TSF_POWF(2.0f, cents
 static float tsf_decibelsToGain(float db) { return (db > -100.f ? TSF_POWF(10.0f, db * 0.05f) : 0); }
 static float tsf_gainToDecibels(float gain) { return (gain <= .00001f ? -100.f : (float)(20.0 * TSF_LOG10(gain))); }
 
+// Approximations for the conversions done at control rate while rendering (see tsf_set_fast_math for their error)
+// 2^x multiplies 2^n (built in the exponent bits) by a table entry 2^(i/64) and a 4th order Taylor polynomial
+// of e^r with r < ln(2)/64. tan(x) for x in [0, pi/2) uses a continued fraction on [0, pi/4] and
+// tan(x) = 1/tan(pi/2 - x) above that.
+static double tsf_fastexp2_table[64];
+
+static void tsf_fastmath_init(void)
+{
+	double step = 1.0, term = 1.0;
+	int i;
+	// 2^(1/64) from the Taylor series of e^x, then the table from repeated multiplications
+	for (i = 1; i != 12; i++) { term *= TSF_LN2 / 64.0 / i; step += term; }
+	for (tsf_fastexp2_table[0] = 1.0, i = 1; i != 64; i++) tsf_fastexp2_table[i] = tsf_fastexp2_table[i - 1] * step;
+}
+
+static double tsf_fastexp2(double x)
+{
+	union { double d; tsf_u64 u; } scale;
+	double r;
+	int n;
+	if (x < -1000.0) return 0.0;
+	if (x > 1000.0) x = 1000.0;
+	n = (int)(x * 64.0 + 65536.0) - 65536; // floor(x * 64)
+	r = (x - n * (1.0 / 64.0)) * TSF_LN2;
+	scale.u = (tsf_u64)((n >> 6) + 1023) << 52;
+	return scale.d * tsf_fastexp2_table[n & 63] * (1.0 + r * (1.0 + r * (0.5 + r * (1.0 / 6.0 + r * (1.0 / 24.0)))));
+}
+
+static double tsf_fasttan(double x)
+{
+	TSF_BOOL invert = (x > TSF_PI / 4);
+	double xx, t;
+	if (invert) x = TSF_PI / 2 - x;
+	xx = x * x;
+	t = x * (135135.0 + xx * (-17325.0 + xx * (378.0 - xx))) / (135135.0 + xx * (-62370.0 + xx * (3150.0 - 28.0 * xx)));
+	return (invert ? 1.0 / t : t);
+}
+
+static double tsf_ctl_timecents2Secsd(TSF_BOOL fastMath, double timecents) { return (fastMath ? tsf_fastexp2(timecents * (1.0 / 1200.0)) : tsf_timecents2Secsd(timecents)); }
+static float tsf_ctl_cents2Hertz(TSF_BOOL fastMath, float cents) { return (fastMath ? (float)(8.176 * tsf_fastexp2(cents * (1.0 / 1200.0))) : tsf_cents2Hertz(cents)); }
+static float tsf_ctl_decibelsToGain(TSF_BOOL fastMath, float db) { return (!fastMath ? tsf_decibelsToGain(db) : (db > -100.f ? (float)tsf_fastexp2(db * (TSF_LOG2_10 * 0.05)) : 0)); }
+
 static TSF_BOOL tsf_riffchunk_read(struct tsf_riffchunk* parent, struct tsf_riffchunk* chunk, struct tsf_stream* stream)
 {
 	TSF_BOOL IsRiff, IsList;
@@ -703,70 +1253,293 @@ static void tsf_region_envtosecs(struct tsf_envelope* p, TSF_BOOL sustainIsGain)
 	else p->sustain = 1.0f - (p->sustain / 1000.0f);
 }
 
-static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int fontSampleCount)
+static void tsf_decoder_fetch(struct tsf_decoder* d, unsigned int start, unsigned int end, unsigned int headStart, unsigned int headEnd, TSF_BOOL pin);
+static void tsf_decoder_unpin(struct tsf_decoder* d, unsigned int start, unsigned int end);
+static void tsf_decoder_free(struct tsf_decoder* d);
+
+static int tsf_load_loopguards(struct tsf_bank* res, const tsf_sample* fontSamples, unsigned int fontSampleCount)
+{
+	// Collect the loop guard samples of all looping regions in a buffer of their own, this leaves
+	// the sample data untouched so it can stay in the buffer given to tsf_load_memory_nocopy.
+	// Samples that aren't converted yet are taken from the source, compressed samples get decoded for this.
+	const short* source = (res->residency ? res->residency->source : TSF_NULL);
+	struct tsf_decoder* decoder = (res->residency ? res->residency->decoder : TSF_NULL);
+	struct tsf_preset *preset, *presetEnd = res->presets + res->presetNum;
+	struct tsf_region *region, *regionEnd;
+	unsigned int guardNum = 0, guardIndex = 0;
+	tsf_sample *guard;
+	for (preset = res->presets; preset != presetEnd; preset++)
+		for (region = preset->regions, regionEnd = region + preset->regionNum; region != regionEnd; region++)
+			if (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end) guardNum++;
+	if (!guardNum) return 1;
+
+	res->loopGuards = (tsf_sample*)TSF_MALLOC(guardNum * (TSF_LOOPGUARD_BEFORE + TSF_LOOPGUARD_AFTER) * sizeof(tsf_sample));
+	if (!res->loopGuards) return 0;
+	for (preset = res->presets; preset != presetEnd; preset++)
+		for (region = preset->regions, regionEnd = region + preset->regionNum; region != regionEnd; region++)
+		{
+			unsigned int loopLength, i;
+			if (region->loop_mode == TSF_LOOPMODE_NONE || region->loop_start >= region->loop_end) continue;
+			loopLength = region->loop_end - region->loop_start + 1;
+			for (guard = res->loopGuards + guardIndex, i = 0; i != TSF_LOOPGUARD_BEFORE + TSF_LOOPGUARD_AFTER; i++)
+			{
+				// Logical position relative to the loop end, past the loop end continue at the loop start
+				int pos = (int)region->loop_end - (TSF_LOOPGUARD_BEFORE - 1) + (int)i;
+				if (pos > (int)region->loop_end) pos = (int)(region->loop_start + (pos - region->loop_end - 1) % loopLength);
+				if (pos < 0 || pos >= (int)fontSampleCount) guard[i] = (tsf_sample)0;
+				else if (source) guard[i] = TSF_SAMPLE_FROM_SHORT(source[pos]);
+				else
+				{
+					if (decoder) tsf_decoder_fetch(decoder, (unsigned int)pos, (unsigned int)pos + 1, (unsigned int)pos, (unsigned int)pos + 1, TSF_FALSE);
+					guard[i] = fontSamples[pos];
+				}
+			}
+			region->loop_guard = guardIndex;
+			guardIndex += TSF_LOOPGUARD_BEFORE + TSF_LOOPGUARD_AFTER;
+		}
+	return 1;
+}
+
+static void tsf_free_presets(struct tsf_preset* presets, int presetNum)
+{
+	int i;
+	if (!presets) return;
+	for (i = 0; i != presetNum; i++) { TSF_FREE(presets[i].regions); TSF_FREE(presets[i].keyIndex); }
+	TSF_FREE(presets);
+}
+
+static int tsf_load_keyindex(struct tsf_preset* preset)
+{
+	// Build the lookup from key to the indices of the regions playing it, in region order so
+	// note-on starts the voices in the same order as a walk over all regions
+	int key, entryNum = 0, *entries, *entry;
+	struct tsf_region *region, *regionEnd = preset->regions + preset->regionNum;
+	for (region = preset->regions; region != regionEnd; region++)
+		if (region->lokey < TSF_KEYINDEX_KEYS && region->lokey <= region->hikey)
+			entryNum += (region->hikey < TSF_KEYINDEX_KEYS ? region->hikey : TSF_KEYINDEX_KEYS - 1) - region->lokey + 1;
+	preset->keyIndex = (int*)TSF_MALLOC((TSF_KEYINDEX_KEYS + 1 + entryNum) * sizeof(int));
+	if (!preset->keyIndex) return 0;
+	entries = entry = preset->keyIndex + TSF_KEYINDEX_KEYS + 1;
+	for (key = 0; key != TSF_KEYINDEX_KEYS; key++)
+	{
+		preset->keyIndex[key] = (int)(entry - entries);
+		for (region = preset->regions; region != regionEnd; region++)
+			if (key >= region->lokey && key <= region->hikey)
+				*(entry++) = (int)(region - preset->regions);
+	}
+	preset->keyIndex[TSF_KEYINDEX_KEYS] = entryNum;
+	return 1;
+}
+
+static int tsf_load_presetlookup(struct tsf_bank* res)
+{
+	// Build the hash table for tsf_get_presetindex with at least twice as many slots as presets
+	unsigned int size = 16, slot;
+	int i;
+	while (size < (unsigned int)res->presetNum * 2) size <<= 1;
+	res->presetLookup = (int*)TSF_MALLOC(size * sizeof(int));
+	if (!res->presetLookup) return 0;
+	TSF_MEMSET(res->presetLookup, 0xFF, size * sizeof(int)); // all -1
+	res->presetLookupMask = size - 1;
+	for (i = 0; i != res->presetNum; i++)
+	{
+		const struct tsf_preset* preset = &res->presets[i];
+		for (slot = TSF_PRESETLOOKUP_HASH(preset->bank, preset->preset) & res->presetLookupMask;; slot = (slot + 1) & res->presetLookupMask)
+		{
+			// With duplicate bank and preset numbers the first preset wins like in a linear search
+			int other = res->presetLookup[slot];
+			if (other == -1) { res->presetLookup[slot] = i; break; }
+			if (res->presets[other].bank == preset->bank && res->presets[other].preset == preset->preset) break;
+		}
+	}
+	return 1;
+}
+
+static struct tsf_residency* tsf_residency_create(const short* source, int rangeNum)
+{
+	struct tsf_residency* r = (struct tsf_residency*)TSF_MALLOC(sizeof(struct tsf_residency) + rangeNum * sizeof(struct tsf_sample_range));
+	int i;
+	if (!r) return TSF_NULL;
+	r->source = source;
+	r->residentNum = r->totalNum = 0;
+	r->rangeNum = rangeNum;
+	r->ranges = (struct tsf_sample_range*)(r + 1);
+	r->decoder = TSF_NULL;
+	for (i = 0; i != rangeNum; i++) { r->ranges[i].start = 0xFFFFFFFF; r->ranges[i].end = 0; r->ranges[i].resident = TSF_FALSE; }
+	#ifndef TSF_NO_THREADS
+	#  if defined(_WIN32)
+	InitializeCriticalSection(&r->lock);
+	#  else
+	pthread_mutex_init(&r->lock, TSF_NULL);
+	#  endif
+	#endif
+	return r;
+}
+
+static void tsf_residency_add(struct tsf_residency* r, const struct tsf_region* region, unsigned int fontSampleCount)
+{
+	// Extend the range of the region's sample header by the sample points the region plays and the interpolation taps around them
+	struct tsf_sample_range* range;
+	unsigned int start = region->offset, end = region->end;
+	if (region->sample < 0 || region->sample >= r->rangeNum) return;
+	range = &r->ranges[region->sample];
+	if (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end)
+	{
+		if (region->loop_start < start) start = region->loop_start;
+		if (region->loop_end + 1 > end) end = region->loop_end + 1;
+	}
+	start = (start > TSF_INTERP_PADDING ? start - TSF_INTERP_PADDING : 0);
+	end = (end + TSF_INTERP_PADDING < fontSampleCount ? end + TSF_INTERP_PADDING : fontSampleCount);
+	if (start >= end) return;
+	if (start < range->start) range->start = start;
+	if (end > range->end) range->end = end;
+}
+
+static void tsf_residency_lock(struct tsf_residency* r)
+{
+	#ifndef TSF_NO_THREADS
+	TSF_POOL_LOCK(r);
+	#else
+	(void)r;
+	#endif
+}
+
+static void tsf_residency_unlock(struct tsf_residency* r)
+{
+	#ifndef TSF_NO_THREADS
+	TSF_POOL_UNLOCK(r);
+	#else
+	(void)r;
+	#endif
+}
+
+static TSF_BOOL tsf_residency_fetch(tsf* f, const struct tsf_region* region, TSF_BOOL pin)
+{
+	// Load the sample points of the region's sample header if they weren't used before. Compressed samples
+	// get decoded, with pin set they are kept until tsf_residency_unpin (returns TSF_TRUE if they were pinned).
+	struct tsf_residency* r = f->bank->residency;
+	struct tsf_sample_range* range;
+	unsigned int i;
+	if (region->sample < 0 || region->sample >= r->rangeNum) return TSF_FALSE;
+	range = &r->ranges[region->sample];
+	if (r->decoder)
+	{
+		// Decode the start of the region now if it gets played, the rest can follow on the decode thread
+		unsigned int headStart = (region->offset > TSF_INTERP_PADDING ? region->offset - TSF_INTERP_PADDING : 0);
+		if (range->start >= range->end) return TSF_FALSE;
+		tsf_decoder_fetch(r->decoder, range->start, range->end, headStart, (pin ? region->offset + r->decoder->headNum : headStart), pin);
+		return pin;
+	}
+	tsf_residency_lock(r);
+	if (!range->resident)
+	{
+		if (r->source)
+		{
+			for (i = range->start; i < range->end; i++) f->bank->fontSamples[i] = TSF_SAMPLE_FROM_SHORT(r->source[i]);
+		}
+		else
+		{
+			// Read a sample of each memory page so the pages are loaded now and not while rendering
+			volatile tsf_sample touch = 0;
+			for (i = range->start; i < range->end; i += TSF_PAGE_SIZE / sizeof(tsf_sample)) touch = f->bank->fontSamples[i];
+			(void)touch;
+		}
+		range->resident = TSF_TRUE;
+		if (range->start < range->end) r->residentNum += range->end - range->start;
+	}
+	tsf_residency_unlock(r);
+	return TSF_FALSE;
+}
+
+static void tsf_residency_unpin(tsf* f, const struct tsf_region* region)
+{
+	struct tsf_sample_range* range = &f->bank->residency->ranges[region->sample];
+	tsf_decoder_unpin(f->bank->residency->decoder, range->start, range->end);
+}
+
+static void tsf_residency_free(struct tsf_residency* r)
+{
+	if (!r) return;
+	tsf_decoder_free(r->decoder);
+	#ifndef TSF_NO_THREADS
+	#  if defined(_WIN32)
+	DeleteCriticalSection(&r->lock);
+	#  else
+	pthread_mutex_destroy(&r->lock);
+	#  endif
+	#endif
+	TSF_FREE(r);
+}
+
+static int* tsf_load_presetorder(const struct tsf_hydra *hydra, int presetNum)
+{
+	// Indices of the preset headers sorted by bank and preset number, equal ones in the order of the file.
+	// Bottom-up merge sort as it keeps that order, ping-ponging between the two halves of the allocation.
+	#define TSF_PRESETORDER_KEY(i) ((tsf_u32)hydra->phdrs[i].bank << 16 | hydra->phdrs[i].preset)
+	int *order = (int*)TSF_MALLOC((presetNum * 2 + 1) * sizeof(int)), *from, *to, *swap, width, i;
+	if (!order) return TSF_NULL;
+	for (i = 0; i != presetNum; i++) order[i] = i;
+	for (from = order, to = order + presetNum, width = 1; width < presetNum; width *= 2, swap = from, from = to, to = swap)
+	{
+		for (i = 0; i < presetNum; i += width * 2)
+		{
+			int a = i, aEnd = (presetNum - i > width ? i + width : presetNum), b = aEnd, bEnd = (presetNum - aEnd > width ? aEnd + width : presetNum), out = i;
+			while (a != aEnd && b != bEnd) to[out++] = (TSF_PRESETORDER_KEY(from[b]) < TSF_PRESETORDER_KEY(from[a]) ? from[b++] : from[a++]);
+			while (a != aEnd) to[out++] = from[a++];
+			while (b != bEnd) to[out++] = from[b++];
+		}
+	}
+	if (from != order) TSF_MEMCPY(order, from, presetNum * sizeof(int));
+	return order;
+	#undef TSF_PRESETORDER_KEY
+}
+
+static int tsf_load_presets(struct tsf_bank* res, struct tsf_hydra *hydra, const tsf_sample* fontSamples, unsigned int fontSampleCount)
 {
 	enum { GenInstrument = 41, GenKeyRange = 43, GenVelRange = 44, GenSampleID = 53 };
 	// Read each preset.
-	struct tsf_hydra_phdr *pphdr, *pphdrMax;
+	int *order, *instRegionNum, sortedIndex, i;
 	res->presetNum = hydra->phdrNum - 1;
 	res->presets = (struct tsf_preset*)TSF_MALLOC(res->presetNum * sizeof(struct tsf_preset));
 	if (!res->presets) return 0;
-	else { int i; for (i = 0; i != res->presetNum; i++) res->presets[i].regions = TSF_NULL; }
-	for (pphdr = hydra->phdrs, pphdrMax = pphdr + hydra->phdrNum - 1; pphdr != pphdrMax; pphdr++)
+	for (i = 0; i != res->presetNum; i++) res->presets[i].regions = TSF_NULL, res->presets[i].keyIndex = TSF_NULL;
+
+	// Zones with a sample of each instrument, the most regions it can add to a preset zone using it
+	order = tsf_load_presetorder(hydra, res->presetNum);
+	instRegionNum = (int*)TSF_MALLOC(hydra->instNum * sizeof(int));
+	if (!order || !instRegionNum) goto out_of_memory;
+	for (i = 0; i < hydra->instNum - 1; i++)
+	{
+		struct tsf_hydra_ibag *pibag, *pibagEnd; struct tsf_hydra_igen *pigen, *pigenEnd;
+		instRegionNum[i] = 0;
+		for (pibag = hydra->ibags + hydra->insts[i].instBagNdx, pibagEnd = hydra->ibags + hydra->insts[i + 1].instBagNdx; pibag != pibagEnd; pibag++)
+			for (pigen = hydra->igens + pibag->instGenNdx, pigenEnd = hydra->igens + pibag[1].instGenNdx; pigen != pigenEnd; pigen++)
+				if (pigen->genOper == GenSampleID) instRegionNum[i]++;
+	}
+
+	for (sortedIndex = 0; sortedIndex != res->presetNum; sortedIndex++)
 	{
-		int sortedIndex = 0, region_index = 0;
-		struct tsf_hydra_phdr *otherphdr;
-		struct tsf_preset* preset;
+		int region_index = 0, regionMax = 0;
+		struct tsf_hydra_phdr *pphdr = &hydra->phdrs[order[sortedIndex]];
+		struct tsf_preset* preset = &res->presets[sortedIndex];
 		struct tsf_hydra_pbag *ppbag, *ppbagEnd;
 		struct tsf_region globalRegion;
-		for (otherphdr = hydra->phdrs; otherphdr != pphdrMax; otherphdr++)
-		{
-			if (otherphdr == pphdr || otherphdr->bank > pphdr->bank) continue;
-			else if (otherphdr->bank < pphdr->bank) sortedIndex++;
-			else if (otherphdr->preset > pphdr->preset) continue;
-			else if (otherphdr->preset < pphdr->preset) sortedIndex++;
-			else if (otherphdr < pphdr) sortedIndex++;
-		}
 
-		preset = &res->presets[sortedIndex];
 		TSF_MEMCPY(preset->presetName, pphdr->presetName, sizeof(preset->presetName));
 		preset->presetName[sizeof(preset->presetName)-1] = '\0'; //should be zero terminated in source file but make sure
 		preset->bank = pphdr->bank;
 		preset->preset = pphdr->preset;
-		preset->regionNum = 0;
 
-		//count regions covered by this preset
+		//size the regions for all instrument zones of this preset, the key and velocity ranges can only leave some out
 		for (ppbag = hydra->pbags + pphdr->presetBagNdx, ppbagEnd = hydra->pbags + pphdr[1].presetBagNdx; ppbag != ppbagEnd; ppbag++)
 		{
-			unsigned char plokey = 0, phikey = 127, plovel = 0, phivel = 127;
-			struct tsf_hydra_pgen *ppgen, *ppgenEnd; struct tsf_hydra_inst *pinst; struct tsf_hydra_ibag *pibag, *pibagEnd; struct tsf_hydra_igen *pigen, *pigenEnd;
+			struct tsf_hydra_pgen *ppgen, *ppgenEnd;
 			for (ppgen = hydra->pgens + ppbag->genNdx, ppgenEnd = hydra->pgens + ppbag[1].genNdx; ppgen != ppgenEnd; ppgen++)
-			{
-				if (ppgen->genOper == GenKeyRange) { plokey = ppgen->genAmount.range.lo; phikey = ppgen->genAmount.range.hi; continue; }
-				if (ppgen->genOper == GenVelRange) { plovel = ppgen->genAmount.range.lo; phivel = ppgen->genAmount.range.hi; continue; }
-				if (ppgen->genOper != GenInstrument) continue;
-				if (ppgen->genAmount.wordAmount >= hydra->instNum) continue;
-				pinst = hydra->insts + ppgen->genAmount.wordAmount;
-				for (pibag = hydra->ibags + pinst->instBagNdx, pibagEnd = hydra->ibags + pinst[1].instBagNdx; pibag != pibagEnd; pibag++)
-				{
-					unsigned char ilokey = 0, ihikey = 127, ilovel = 0, ihivel = 127;
-					for (pigen = hydra->igens + pibag->instGenNdx, pigenEnd = hydra->igens + pibag[1].instGenNdx; pigen != pigenEnd; pigen++)
-					{
-						if (pigen->genOper == GenKeyRange) { ilokey = pigen->genAmount.range.lo; ihikey = pigen->genAmount.range.hi; continue; }
-						if (pigen->genOper == GenVelRange) { ilovel = pigen->genAmount.range.lo; ihivel = pigen->genAmount.range.hi; continue; }
-						if (pigen->genOper == GenSampleID && ihikey >= plokey && ilokey <= phikey && ihivel >= plovel && ilovel <= phivel) preset->regionNum++;
-					}
-				}
-			}
+				if (ppgen->genOper == GenInstrument && ppgen->genAmount.wordAmount < hydra->instNum - 1) regionMax += instRegionNum[ppgen->genAmount.wordAmount];
 		}
 
-		preset->regions = (struct tsf_region*)TSF_MALLOC(preset->regionNum * sizeof(struct tsf_region));
-		if (!preset->regions)
-		{
-			int i; for (i = 0; i != res->presetNum; i++) TSF_FREE(res->presets[i].regions);
-			TSF_FREE(res->presets);
-			return 0;
-		}
+		preset->regions = (struct tsf_region*)TSF_MALLOC((regionMax ? regionMax : 1) * sizeof(struct tsf_region));
+		if (!preset->regions) goto out_of_memory;
 		tsf_region_clear(&globalRegion, TSF_TRUE);
 
 		// Zones.
@@ -784,7 +1557,7 @@ static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int font
 				{
 					struct tsf_region instRegion;
 					tsf_u16 whichInst = ppgen->genAmount.wordAmount;
-					if (whichInst >= hydra->instNum) continue;
+					if (whichInst >= hydra->instNum - 1) continue; // the last one only ends the zones of the one before
 
 					tsf_region_clear(&instRegion, TSF_FALSE);
 					pinst = &hydra->insts[whichInst];
@@ -830,6 +1603,8 @@ static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int font
 								zoneRegion.sample_rate = pshdr->sampleRate;
 								if (zoneRegion.end && zoneRegion.end < fontSampleCount) zoneRegion.end++;
 								else zoneRegion.end = fontSampleCount;
+								zoneRegion.sample = pigen->genAmount.wordAmount;
+								if (res->residency) tsf_residency_add(res->residency, &zoneRegion, fontSampleCount);
 
 								preset->regions[region_index] = zoneRegion;
 								region_index++;
@@ -857,17 +1632,43 @@ static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int font
 			if (ppbag == hydra->pbags + pphdr->presetBagNdx && !hadGenInstrument)
 				globalRegion = presetRegion;
 		}
+
+		preset->regionNum = region_index;
+		if (region_index < regionMax)
+		{
+			// Give back what the key and velocity ranges left out
+			struct tsf_region* shrunk = (struct tsf_region*)TSF_REALLOC(preset->regions, (region_index ? region_index : 1) * sizeof(struct tsf_region));
+			if (shrunk) preset->regions = shrunk;
+		}
+		if (!tsf_load_keyindex(preset)) goto out_of_memory;
 	}
-	return 1;
+	TSF_FREE(order);
+	TSF_FREE(instRegionNum);
+	return (tsf_load_loopguards(res, fontSamples, fontSampleCount) && tsf_load_presetlookup(res));
+
+	out_of_memory: // what was loaded gets freed with the bank
+	TSF_FREE(order);
+	TSF_FREE(instRegionNum);
+	return 0;
 }
 
-static int tsf_load_samples(float** fontSamples, unsigned int* fontSampleCount, struct tsf_riffchunk *chunkSmpl, struct tsf_stream* stream)
+static int tsf_load_samples(tsf_sample** fontSamples, unsigned int* fontSampleCount, struct tsf_riffchunk *chunkSmpl, struct tsf_stream* stream)
 {
-	// Read sample data into float format buffer.
-	float* out; unsigned int samplesLeft, samplesToRead, samplesToConvert;
+	// Read sample data into the sample buffer, padded with silence on both ends for the interpolation taps.
+	tsf_sample* out; unsigned int samplesLeft;
+	#ifndef TSF_SAMPLES_SHORT
+	unsigned int samplesToRead, samplesToConvert;
+	#endif
 	samplesLeft = *fontSampleCount = chunkSmpl->size / sizeof(short);
-	out = *fontSamples = (float*)TSF_MALLOC(samplesLeft * sizeof(float));
+	out = (tsf_sample*)TSF_MALLOC((samplesLeft + TSF_INTERP_PADDING * 2) * sizeof(tsf_sample));
 	if (!out) return 0;
+	TSF_MEMSET(out, 0, TSF_INTERP_PADDING * sizeof(tsf_sample));
+	TSF_MEMSET(out + TSF_INTERP_PADDING + samplesLeft, 0, TSF_INTERP_PADDING * sizeof(tsf_sample));
+	out = *fontSamples = out + TSF_INTERP_PADDING;
+	#ifdef TSF_SAMPLES_SHORT
+	// If we ever need to compile for big-endian platforms, we'll need to byte-swap here.
+	stream->read(stream->data, out, samplesLeft * sizeof(short));
+	#else
 	for (; samplesLeft; samplesLeft -= samplesToRead)
 	{
 		short sampleBuffer[1024], *in = sampleBuffer;;
@@ -879,8 +1680,42 @@ static int tsf_load_samples(float** fontSamples, unsigned int* fontSampleCount,
 			// If we ever need to compile for big-endian platforms, we'll need to byte-swap here.
 			*out++ = (float)(*in++ / 32767.0);
 	}
+	#endif
+	return 1;
+}
+
+#ifndef TSF_SAMPLES_SHORT
+static int tsf_load_samples_lazy(tsf_sample** fontSamples, unsigned int* fontSampleCount, const short** source, struct tsf_riffchunk *chunkSmpl, struct tsf_stream_memory* m)
+{
+	// Only allocate the float buffer and leave converting the samples to tsf_residency_fetch,
+	// untouched memory of a large allocation usually isn't backed by physical memory until it is used.
+	tsf_sample* out; unsigned int count = chunkSmpl->size / sizeof(short);
+	if (chunkSmpl->size > m->total - m->pos || ((size_t)(m->buffer + m->pos) & 1)) return 0;
+	out = (tsf_sample*)TSF_MALLOC((count + TSF_INTERP_PADDING * 2) * sizeof(tsf_sample));
+	if (!out) return 0;
+	TSF_MEMSET(out, 0, TSF_INTERP_PADDING * sizeof(tsf_sample));
+	TSF_MEMSET(out + TSF_INTERP_PADDING + count, 0, TSF_INTERP_PADDING * sizeof(tsf_sample));
+	*fontSamples = out + TSF_INTERP_PADDING;
+	*fontSampleCount = count;
+	*source = (const short*)(m->buffer + m->pos);
+	m->pos += chunkSmpl->size;
+	return 1;
+}
+#else
+static int tsf_load_samples_nocopy(tsf_sample** fontSamples, unsigned int* fontSampleCount, struct tsf_riffchunk *chunkSmpl, struct tsf_stream_memory* m)
+{
+	// Use the sample data in place if the interpolation taps around it stay inside of the buffer.
+	// The taps before the first sample read the chunk header instead of silence, this only
+	// matters with cubic or sinc interpolation for a sample placed at the very start of the chunk.
+	unsigned int padding = TSF_INTERP_PADDING * sizeof(short);
+	if (m->pos < padding || chunkSmpl->size > m->total - m->pos || padding > m->total - m->pos - chunkSmpl->size || ((size_t)(m->buffer + m->pos) & 1)) return 0;
+	// If we ever need to compile for big-endian platforms, this can't be used.
+	*fontSamples = (tsf_sample*)(m->buffer + m->pos);
+	*fontSampleCount = chunkSmpl->size / sizeof(short);
+	m->pos += chunkSmpl->size;
 	return 1;
 }
+#endif
 
 static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, short active_segment, float outSampleRate)
 {
@@ -935,6 +1770,7 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, short a
 					// I don't truly understand this; just following what LinuxSampler does.
 					float mysterySlope = -9.226f / e->samplesUntilNextSegment;
 					e->slope = TSF_EXPF(mysterySlope);
+					e->slopeLog2 = mysterySlope * (float)TSF_LOG2E;
 					e->segmentIsExponential = TSF_TRUE;
 					if (e->parameters.sustain > 0.0f)
 					{
@@ -970,6 +1806,7 @@ static void tsf_voice_envelope_nextsegment(struct tsf_voice_envelope* e, short a
 				// I don't truly understand this; just following what LinuxSampler does.
 				float mysterySlope = -9.226f / e->samplesUntilNextSegment;
 				e->slope = TSF_EXPF(mysterySlope);
+				e->slopeLog2 = mysterySlope * (float)TSF_LOG2E;
 				e->segmentIsExponential = TSF_TRUE;
 			}
 			else
@@ -1005,21 +1842,21 @@ static void tsf_voice_envelope_setup(struct tsf_voice_envelope* e, struct tsf_en
 	tsf_voice_envelope_nextsegment(e, TSF_SEGMENT_NONE, outSampleRate);
 }
 
-static void tsf_voice_envelope_process(struct tsf_voice_envelope* e, int numSamples, float outSampleRate)
+static void tsf_voice_envelope_process(struct tsf_voice_envelope* e, int numSamples, float outSampleRate, TSF_BOOL fastMath)
 {
 	if (e->slope)
 	{
-		if (e->segmentIsExponential) e->level *= TSF_POWF(e->slope, (float)numSamples);
+		if (e->segmentIsExponential) e->level *= (fastMath ? (float)tsf_fastexp2(e->slopeLog2 * numSamples) : TSF_POWF(e->slope, (float)numSamples));
 		else e->level += (e->slope * numSamples);
 	}
 	if ((e->samplesUntilNextSegment -= numSamples) <= 0)
 		tsf_voice_envelope_nextsegment(e, e->segment, outSampleRate);
 }
 
-static void tsf_voice_lowpass_setup(struct tsf_voice_lowpass* e, float Fc)
+static void tsf_voice_lowpass_setup(struct tsf_voice_lowpass* e, float Fc, TSF_BOOL fastMath)
 {
 	// Lowpass filter from http://www.earlevel.com/main/2012/11/26/biquad-c-source-code/
-	double K = TSF_TAN(TSF_PI * Fc), KK = K * K;
+	double K = (fastMath ? tsf_fasttan(TSF_PI * Fc) : TSF_TAN(TSF_PI * Fc)), KK = K * K;
 	double norm = 1 / (1 + K * e->QInv + KK);
 	e->a0 = KK * norm;
 	e->a1 = 2 * e->a0;
@@ -1052,35 +1889,239 @@ static void tsf_voice_kill(struct tsf_voice* v)
 	v->playingPreset = -1;
 }
 
-static void tsf_voice_end(tsf* f, struct tsf_voice* v)
+static int tsf_voice_grow(tsf* f, int newVoiceNum)
 {
-	// if maxVoiceNum is set, assume that voice rendering and note queuing are on separate threads
-	// so to minimize the chance that voice rendering would advance the segment at the same time
-	// we just do it twice here and hope that it sticks
-	int repeats = (f->maxVoiceNum ? 2 : 1);
-	while (repeats--)
+	// Grow the voice array and the voice index lists, new voices are stopped and put on the free stack
+	struct tsf_voice* newVoices;
+	int *newLists = (int*)TSF_MALLOC((newVoiceNum * 4 + 1) * sizeof(int)), *newStarted, *newFree, i;
+	if (!newLists) return 0;
+	newVoices = (struct tsf_voice*)TSF_REALLOC(f->voices, newVoiceNum * sizeof(struct tsf_voice));
+	if (!newVoices) { TSF_FREE(newLists); return 0; }
+	f->voices = newVoices;
+	if (f->activeVoiceNum) TSF_MEMCPY(newLists, f->activeVoices, f->activeVoiceNum * sizeof(int));
+	if (f->renderVoiceNum) TSF_MEMCPY(newLists + newVoiceNum, f->renderVoices, f->renderVoiceNum * sizeof(int));
+	newFree = newLists + newVoiceNum * 2;
+	if (f->freeVoiceNum) TSF_MEMCPY(newFree, f->freeVoices, f->freeVoiceNum * sizeof(int));
+	for (i = newVoiceNum; i-- != f->voiceNum;)
 	{
-		tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
-		tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
-		if (v->region->loop_mode == TSF_LOOPMODE_SUSTAIN)
-		{
-			// Continue playing, but stop looping.
-			v->loopEnd = v->loopStart;
-		}
+		f->voices[i].playingPreset = -1;
+		f->voices[i].inRenderList = f->voices[i].pinned = TSF_FALSE;
+		f->voices[i].stealList[TSF_STEALLINK_AGE] = f->voices[i].stealList[TSF_STEALLINK_RELEASE] = f->voices[i].stealList[TSF_STEALLINK_QUIET] = -1;
+		f->voices[i].underrunNum = 0;
+		newFree[f->freeVoiceNum++] = i;
+	}
+	for (newStarted = newLists + newVoiceNum * 3, i = 0; f->startedRead != f->startedWrite; i++)
+	{
+		newStarted[i] = f->startedVoices[f->startedRead];
+		f->startedRead = (f->startedRead == f->voiceNum ? 0 : f->startedRead + 1);
 	}
+	TSF_FREE(f->activeVoices);
+	f->activeVoices = newLists;
+	f->renderVoices = newLists + newVoiceNum;
+	f->freeVoices = newFree;
+	f->startedVoices = newStarted;
+	f->startedRead = 0;
+	f->startedWrite = i;
+	f->voiceNum = newVoiceNum;
+	return 1;
 }
 
-static void tsf_voice_endquick(tsf* f, struct tsf_voice* v)
+static int tsf_voice_loudbucket(float gain)
 {
-	// if maxVoiceNum is set, assume that voice rendering and note queuing are on separate threads
-	// so to minimize the chance that voice rendering would advance the segment at the same time
-	// we just do it twice here and hope that it sticks
-	int repeats = (f->maxVoiceNum ? 2 : 1);
-	while (repeats--)
-	{
-		v->ampenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+	// Steal list by loudness of a voice in 3 dB steps (the exponent and highest mantissa bit of the float
+	// gain) from 2^-28 (about -168 dB) up to 2^4, quieter and louder voices are in the first and last list
+	union { float f; tsf_u32 u; } bits;
+	int bucket;
+	bits.f = gain;
+	bucket = (int)(bits.u >> 22) - ((127 - 28) << 1);
+	return (bucket < 0 ? 0 : (bucket >= TSF_QUIET_BUCKETS ? TSF_QUIET_BUCKETS - 1 : bucket));
+}
+
+static void tsf_voice_steal_link(tsf* f, struct tsf_voice* v, int link, int list)
+{
+	// Append a voice to the end of a steal list by one of its links
+	int index = (int)(v - f->voices);
+	v->stealList[link] = list;
+	v->stealPrev[link] = f->stealLast[list];
+	v->stealNext[link] = -1;
+	if (f->stealLast[list] != -1) f->voices[f->stealLast[list]].stealNext[link] = index;
+	else f->stealFirst[list] = index;
+	f->stealLast[list] = index;
+}
+
+static void tsf_voice_steal_unlink(tsf* f, struct tsf_voice* v, int link)
+{
+	int list = v->stealList[link];
+	if (list == -1) return;
+	if (v->stealPrev[link] != -1) f->voices[v->stealPrev[link]].stealNext[link] = v->stealNext[link];
+	else f->stealFirst[list] = v->stealNext[link];
+	if (v->stealNext[link] != -1) f->voices[v->stealNext[link]].stealPrev[link] = v->stealPrev[link];
+	else f->stealLast[list] = v->stealPrev[link];
+	v->stealList[link] = -1;
+}
+
+static void tsf_voice_quiet_rebuild(tsf* f)
+{
+	// Link the voices that aren't fading into the loudness lists after the stealing mode changed
+	int i;
+	for (i = 0; i != f->activeVoiceNum; i++)
+	{
+		struct tsf_voice* v = &f->voices[f->activeVoices[i]];
+		tsf_voice_steal_unlink(f, v, TSF_STEALLINK_QUIET);
+		if (f->stealing != TSF_STEAL_QUIETEST || v->stealList[TSF_STEALLINK_AGE] != TSF_STEALLIST_AGE) continue;
+		v->loudBucket = tsf_voice_loudbucket(tsf_decibelsToGain(v->noteGainDB) * (v->ampenv.segment < TSF_SEGMENT_DECAY ? 1.0f : v->ampenv.level));
+		tsf_voice_steal_link(f, v, TSF_STEALLINK_QUIET, TSF_STEALLIST_QUIET + v->loudBucket);
+	}
+}
+
+static TSF_BOOL tsf_voice_fading(struct tsf_voice* v)
+{
+	// Voices that were ended quickly (or have no release time) will be done after TSF_FASTRELEASETIME
+	return (v->ampenv.segment >= TSF_SEGMENT_RELEASE && v->ampenv.parameters.release <= 0);
+}
+
+static void tsf_voice_released(tsf* f, struct tsf_voice* v)
+{
+	// Append a voice that was just ended to the release list, or take it off the lists it can be stolen
+	// from and append it to the fading list if it fades out quickly
+	if (v->stealList[TSF_STEALLINK_AGE] == TSF_STEALLIST_FADING) return;
+	if (tsf_voice_fading(v))
+	{
+		tsf_voice_steal_unlink(f, v, TSF_STEALLINK_AGE);
+		tsf_voice_steal_unlink(f, v, TSF_STEALLINK_RELEASE);
+		tsf_voice_steal_unlink(f, v, TSF_STEALLINK_QUIET);
+		tsf_voice_steal_link(f, v, TSF_STEALLINK_AGE, TSF_STEALLIST_FADING);
+	}
+	else if (v->stealList[TSF_STEALLINK_RELEASE] == -1) tsf_voice_steal_link(f, v, TSF_STEALLINK_RELEASE, TSF_STEALLIST_RELEASED);
+}
+
+static struct tsf_voice* tsf_voice_steal_first(tsf* f, int link, int list, unsigned int playIndex)
+{
+	// First voice of a steal list that isn't playing the note being started (playIndex), voices of that
+	// note were linked last so this only skips voices of the note that were relinked after them
+	int i;
+	for (i = f->stealFirst[list]; i != -1 && f->voices[i].playIndex == playIndex; i = f->voices[i].stealNext[link]) {}
+	return (i != -1 ? &f->voices[i] : TSF_NULL);
+}
+
+static struct tsf_voice* tsf_voice_steal_victim(tsf* f, unsigned int playIndex)
+{
+	// Pick the active voice to steal with the voice stealing mode from the heads of the steal lists, voices that
+	// are fading out already aren't in them. Returns null if there is no such voice.
+	struct tsf_voice* v;
+	int bucket;
+	if (f->stealing == TSF_STEAL_QUIETEST)
+	{
+		for (bucket = 0; bucket != TSF_QUIET_BUCKETS; bucket++)
+			if ((v = tsf_voice_steal_first(f, TSF_STEALLINK_QUIET, TSF_STEALLIST_QUIET + bucket, playIndex)) != TSF_NULL) return v;
+		return TSF_NULL;
+	}
+	if (f->stealing == TSF_STEAL_RELEASED && (v = tsf_voice_steal_first(f, TSF_STEALLINK_RELEASE, TSF_STEALLIST_RELEASED, playIndex)) != TSF_NULL) return v;
+	return tsf_voice_steal_first(f, TSF_STEALLINK_AGE, TSF_STEALLIST_AGE, playIndex);
+}
+
+static void tsf_voice_link(tsf* f, struct tsf_voice* v, int list, int head)
+{
+	// Insert a voice at the front of a voice list (or mark it as not linked if head is -1)
+	int index = (int)(v - f->voices);
+	v->listHead[list] = head;
+	if (head == -1) return;
+	v->listPrev[list] = -1;
+	v->listNext[list] = f->voiceHeads[head];
+	if (f->voiceHeads[head] != -1) f->voices[f->voiceHeads[head]].listPrev[list] = index;
+	f->voiceHeads[head] = index;
+}
+
+static void tsf_voice_unlink(tsf* f, struct tsf_voice* v, int list)
+{
+	if (v->listHead[list] == -1) return;
+	if (v->listPrev[list] != -1) f->voices[v->listPrev[list]].listNext[list] = v->listNext[list];
+	else f->voiceHeads[v->listHead[list]] = v->listNext[list];
+	if (v->listNext[list] != -1) f->voices[v->listNext[list]].listPrev[list] = v->listPrev[list];
+	v->listHead[list] = -1;
+}
+
+static void tsf_voice_start(tsf* f, struct tsf_voice* v)
+{
+	// Add a voice taken from the free stack and set up for playing to the active list and hand it to the renderer
+	int index = (int)(v - f->voices);
+	f->activeVoices[f->activeVoiceNum++] = index;
+	tsf_voice_steal_link(f, v, TSF_STEALLINK_AGE, TSF_STEALLIST_AGE);
+	if (f->stealing == TSF_STEAL_QUIETEST)
+	{
+		// Until the renderer updates it the voice counts with the peak of its envelope
+		v->loudBucket = tsf_voice_loudbucket(tsf_decibelsToGain(v->noteGainDB));
+		tsf_voice_steal_link(f, v, TSF_STEALLINK_QUIET, TSF_STEALLIST_QUIET + v->loudBucket);
+	}
+	tsf_voice_link(f, v, TSF_VOICELIST_GROUP, (v->region->group ? TSF_VOICEHEAD_GROUP(v->region->group) : -1));
+	tsf_voice_link(f, v, TSF_VOICELIST_KEY, TSF_VOICEHEAD_KEY(v->playingPreset, v->playingKey));
+	tsf_voice_link(f, v, TSF_VOICELIST_CHANNEL, (v->playingChannel != -1 ? TSF_VOICEHEAD_CHANNEL(v->playingChannel) : -1));
+	f->startedVoices[f->startedWrite] = index;
+	f->startedWrite = (f->startedWrite == f->voiceNum ? 0 : f->startedWrite + 1);
+}
+
+static void tsf_active_voices_prune(tsf* f)
+{
+	// Move voices that were killed by the renderer from the active list to the free stack,
+	// and move the others to the loudness list the renderer last put them in
+	int *i = f->activeVoices, *iEnd = i + f->activeVoiceNum, *iOut = i;
+	for (; i != iEnd; i++)
+	{
+		struct tsf_voice* v = &f->voices[*i];
+		if (v->playingPreset != -1)
+		{
+			int list = v->stealList[TSF_STEALLINK_QUIET];
+			if (list != -1 && list != TSF_STEALLIST_QUIET + v->loudBucket)
+			{
+				tsf_voice_steal_unlink(f, v, TSF_STEALLINK_QUIET);
+				tsf_voice_steal_link(f, v, TSF_STEALLINK_QUIET, TSF_STEALLIST_QUIET + v->loudBucket);
+			}
+			*iOut++ = *i;
+			continue;
+		}
+		tsf_voice_unlink(f, v, TSF_VOICELIST_GROUP);
+		tsf_voice_unlink(f, v, TSF_VOICELIST_KEY);
+		tsf_voice_unlink(f, v, TSF_VOICELIST_CHANNEL);
+		tsf_voice_steal_unlink(f, v, TSF_STEALLINK_AGE);
+		tsf_voice_steal_unlink(f, v, TSF_STEALLINK_RELEASE);
+		tsf_voice_steal_unlink(f, v, TSF_STEALLINK_QUIET);
+		if (v->pinned) { tsf_residency_unpin(f, v->region); v->pinned = TSF_FALSE; }
+		f->freeVoices[f->freeVoiceNum++] = *i;
+	}
+	f->activeVoiceNum = (int)(iOut - f->activeVoices);
+}
+
+static void tsf_voice_end(tsf* f, struct tsf_voice* v)
+{
+	// if maxVoiceNum is set, assume that voice rendering and note queuing are on separate threads
+	// so to minimize the chance that voice rendering would advance the segment at the same time
+	// we just do it twice here and hope that it sticks
+	int repeats = (f->maxVoiceNum ? 2 : 1);
+	while (repeats--)
+	{
+		tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+		tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
+		if (v->region->loop_mode == TSF_LOOPMODE_SUSTAIN)
+		{
+			// Continue playing, but stop looping.
+			v->loopEnd = v->loopStart;
+		}
+	}
+	tsf_voice_released(f, v);
+}
+
+static void tsf_voice_endquick(tsf* f, struct tsf_voice* v)
+{
+	// if maxVoiceNum is set, assume that voice rendering and note queuing are on separate threads
+	// so to minimize the chance that voice rendering would advance the segment at the same time
+	// we just do it twice here and hope that it sticks
+	int repeats = (f->maxVoiceNum ? 2 : 1);
+	while (repeats--)
+	{
+		v->ampenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->ampenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
 		v->modenv.parameters.release = 0.0f; tsf_voice_envelope_nextsegment(&v->modenv, TSF_SEGMENT_SUSTAIN, f->outSampleRate);
 	}
+	tsf_voice_released(f, v);
 }
 
 static void tsf_voice_calcpitchratio(struct tsf_voice* v, float pitchShift, float outSampleRate)
@@ -1092,12 +2133,747 @@ static void tsf_voice_calcpitchratio(struct tsf_voice* v, float pitchShift, floa
 	v->pitchOutputFactor = v->region->sample_rate / (tsf_timecents2Secsd(v->region->pitch_keycenter * 100.0) * outSampleRate);
 }
 
-static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outputBuffer, int numSamples)
+// Voices that play a whole effect block with linear interpolation and without
+// reaching the loop wrap get collected in a voice bank. The bank keeps the hot
+// playback and low-pass filter state of up to 8 voices in lanes (structure of arrays)
+// so the SIMD kernels can render them in lockstep, one voice per vector lane.
+#define TSF_VOICEBANK_LANES 8
+
+struct tsf_voice_bank
+{
+	// 32.32 fixed point position and step split into integer and fraction parts
+	tsf_u32 index[TSF_VOICEBANK_LANES], fraction[TSF_VOICEBANK_LANES], stepInt[TSF_VOICEBANK_LANES], stepFrac[TSF_VOICEBANK_LANES];
+	float gainLeft[TSF_VOICEBANK_LANES], gainRight[TSF_VOICEBANK_LANES];
+	// Low-pass filter coefficients and state, lanes without active filter pass the signal through unchanged
+	double a0[TSF_VOICEBANK_LANES], a1[TSF_VOICEBANK_LANES], b1[TSF_VOICEBANK_LANES], b2[TSF_VOICEBANK_LANES], z1[TSF_VOICEBANK_LANES], z2[TSF_VOICEBANK_LANES];
+	struct tsf_voice_lowpass* lowpass[TSF_VOICEBANK_LANES]; // filter state of the voice to update, null if not active
+	int laneNum;
+	TSF_BOOL mixed;
+	// All banked voices of the current effect block are summed here before they get mixed into the output
+	float mixLeft[TSF_RENDER_EFFECTSAMPLEBLOCK], mixRight[TSF_RENDER_EFFECTSAMPLEBLOCK];
+};
+
+// Render kernels, the per-sample part of tsf_voice_render split into stages:
+// interpolate source samples of a span without loop wrap into a block buffer,
+// then (after the optional low-pass filter) mix that block into the output.
+// renderBank renders all lanes of a voice bank into its mix buffers.
+// reduce adds inNum buffers (inStride floats apart) to the output, in order.
+struct tsf_kernels
+{
+	void (*interpolate[TSF_INTERP_SINC + 1])(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count);
+	void (*mixInterleaved)(float* out, const float* in, int count, float gainLeft, float gainRight);
+	void (*mixUnweaved)(float* outL, float* outR, const float* in, int count, float gainLeft, float gainRight);
+	void (*mixMono)(float* out, const float* in, int count, float gain);
+	void (*renderBank)(struct tsf_voice_bank* bank, const tsf_sample* input, int count);
+	void (*reduce)(float* out, const float* in, int inStride, int inNum, int count);
+};
+
+// Positions are 32.32 fixed point, the top 24 bits of the fraction are the interpolation weight
+// (scaled by TSF_SAMPLE_ONE, as are the cubic and sinc coefficients)
+#define TSF_FRACTION_TO_ALPHA(frac) ((float)((frac) >> 8) * (TSF_SAMPLE_ONE / 16777216.0f))
+
+// Cubic and sinc coefficient tables are indexed by the top bits of the fraction
+#define TSF_INTERP_PHASEBITS 10
+#define TSF_INTERP_PHASES (1 << TSF_INTERP_PHASEBITS)
+#define TSF_INTERP_PHASE(frac) ((frac) >> (32 - TSF_INTERP_PHASEBITS))
+
+// Number of source samples each interpolation mode reads after the playback position
+static const unsigned char tsf_interp_taps_after[TSF_INTERP_SINC + 1] = { 1, 1, 2, 4 };
+
+static float tsf_interp_cubic[TSF_INTERP_PHASES][4];
+static float tsf_interp_sinc[TSF_INTERP_PHASES][8];
+
+static void tsf_interp_tables_init(void)
+{
+	int i, k;
+	for (i = 0; i != TSF_INTERP_PHASES; i++)
+	{
+		double t = (double)i / TSF_INTERP_PHASES, sum = 0;
+		float* c = tsf_interp_cubic[i];
+		c[0] = (float)(((-0.5 * t + 1.0) * t - 0.5) * t * TSF_SAMPLE_ONE);
+		c[1] = (float)(((1.5 * t - 2.5) * t * t + 1.0) * TSF_SAMPLE_ONE);
+		c[2] = (float)(((-1.5 * t + 2.0) * t + 0.5) * t * TSF_SAMPLE_ONE);
+		c[3] = (float)((0.5 * t - 0.5) * t * t * TSF_SAMPLE_ONE);
+
+		// taps at offsets -3 to +4, sinc weighted by a Blackman window over [-4, 4] and normalized to unity gain
+		for (k = 0; k != 8; k++)
+		{
+			double x = (k - 3) - t, sinc = (x == 0 ? 1.0 : TSF_SIN(TSF_PI * x) / (TSF_PI * x));
+			double window = 0.42 + 0.5 * TSF_COS(TSF_PI * x / 4.0) + 0.08 * TSF_COS(TSF_PI * x / 2.0);
+			tsf_interp_sinc[i][k] = (float)(sinc * window);
+			sum += sinc * window;
+		}
+		for (k = 0; k != 8; k++) tsf_interp_sinc[i][k] = (float)(tsf_interp_sinc[i][k] / sum * TSF_SAMPLE_ONE);
+	}
+}
+
+static void tsf_interpolate_nearest_scalar(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count)
+{
+	for (; count; count--, pos += step)
+		*out++ = input[(tsf_u32)(pos >> 32) + ((tsf_u32)pos >> 31)] * TSF_SAMPLE_ONE;
+}
+
+static void tsf_interpolate_cubic_scalar(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count)
+{
+	for (; count; count--, pos += step)
+	{
+		const tsf_sample* in = input + (tsf_u32)(pos >> 32);
+		const float* c = tsf_interp_cubic[TSF_INTERP_PHASE((tsf_u32)pos)];
+		*out++ = in[-1] * c[0] + in[0] * c[1] + in[1] * c[2] + in[2] * c[3];
+	}
+}
+
+static void tsf_interpolate_sinc_scalar(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count)
+{
+	for (; count; count--, pos += step)
+	{
+		const tsf_sample* in = input + (tsf_u32)(pos >> 32);
+		const float* c = tsf_interp_sinc[TSF_INTERP_PHASE((tsf_u32)pos)];
+		*out++ = in[-3] * c[0] + in[-2] * c[1] + in[-1] * c[2] + in[0] * c[3] + in[1] * c[4] + in[2] * c[5] + in[3] * c[6] + in[4] * c[7];
+	}
+}
+
+static void tsf_interpolate_scalar(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count)
+{
+	for (; count; count--, pos += step)
+	{
+		const tsf_sample* in = input + (tsf_u32)(pos >> 32);
+		float alpha = TSF_FRACTION_TO_ALPHA((tsf_u32)pos);
+		*out++ = in[0] * (TSF_SAMPLE_ONE - alpha) + in[1] * alpha;
+	}
+}
+
+static void tsf_mix_interleaved_scalar(float* out, const float* in, int count, float gainLeft, float gainRight)
+{
+	for (; count; count--, in++) { *out++ += *in * gainLeft; *out++ += *in * gainRight; }
+}
+
+static void tsf_mix_unweaved_scalar(float* outL, float* outR, const float* in, int count, float gainLeft, float gainRight)
+{
+	for (; count; count--, in++) { *outL++ += *in * gainLeft; *outR++ += *in * gainRight; }
+}
+
+static void tsf_mix_mono_scalar(float* out, const float* in, int count, float gain)
+{
+	for (; count; count--) *out++ += *in++ * gain;
+}
+
+static void tsf_render_bank_lanes(struct tsf_voice_bank* bank, const tsf_sample* input, int lane, int count,
+	void (*interpolate)(float*, const tsf_sample*, tsf_u64, tsf_u64, int), void (*mix)(float*, float*, const float*, int, float, float))
+{
+	// Render the lanes starting at lane one voice at a time
+	float blockBuffer[TSF_RENDER_EFFECTSAMPLEBLOCK];
+	for (; lane < bank->laneNum; lane++)
+	{
+		interpolate(blockBuffer, input, ((tsf_u64)bank->index[lane] << 32) | bank->fraction[lane], ((tsf_u64)bank->stepInt[lane] << 32) | bank->stepFrac[lane], count);
+		if (bank->lowpass[lane])
+		{
+			float *val = blockBuffer, *valEnd = blockBuffer + count;
+			for (; val != valEnd; val++) *val = tsf_voice_lowpass_process(bank->lowpass[lane], *val);
+		}
+		mix(bank->mixLeft, bank->mixRight, blockBuffer, count, bank->gainLeft[lane], bank->gainRight[lane]);
+	}
+}
+
+static void tsf_render_bank_scalar(struct tsf_voice_bank* bank, const tsf_sample* input, int count)
+{
+	tsf_render_bank_lanes(bank, input, 0, count, tsf_interpolate_scalar, tsf_mix_unweaved_scalar);
+}
+
+static void tsf_reduce_scalar(float* out, const float* in, int inStride, int inNum, int count)
+{
+	int i, k;
+	for (i = 0; i != count; i++)
+	{
+		float sum = out[i];
+		for (k = 0; k != inNum; k++) sum += in[k * inStride + i];
+		out[i] = sum;
+	}
+}
+
+static const struct tsf_kernels tsf_kernels_scalar =
+{
+	{ tsf_interpolate_nearest_scalar, tsf_interpolate_scalar, tsf_interpolate_cubic_scalar, tsf_interpolate_sinc_scalar },
+	tsf_mix_interleaved_scalar, tsf_mix_unweaved_scalar, tsf_mix_mono_scalar, tsf_render_bank_scalar, tsf_reduce_scalar
+};
+
+#ifdef TSF_SIMD_X86
+TSF_TARGET_SSE2 static __m128 tsf_load_sse2(const tsf_sample* in)
+{
+	// Load 4 consecutive samples as floats
+	#ifdef TSF_SAMPLES_SHORT
+	__m128i val = _mm_loadl_epi64((const __m128i*)in);
+	return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(val, val), 16));
+	#else
+	return _mm_loadu_ps(in);
+	#endif
+}
+
+TSF_TARGET_SSE2 static __m128 tsf_gather_sse2(const tsf_sample* input, const int* ip)
+{
+	// Load the samples at 4 indices as floats
+	#ifdef TSF_SAMPLES_SHORT
+	return _mm_cvtepi32_ps(_mm_set_epi32(input[ip[3]], input[ip[2]], input[ip[1]], input[ip[0]]));
+	#else
+	return _mm_set_ps(input[ip[3]], input[ip[2]], input[ip[1]], input[ip[0]]);
+	#endif
+}
+
+TSF_TARGET_SSE2 static void tsf_interpolate_sse2(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count)
+{
+	// Each lane keeps its own integer index and 32 bit fraction, advanced by 4 steps with carry
+	const __m128i signBit = _mm_set1_epi32((int)0x80000000), stepFrac = _mm_set1_epi32((int)(tsf_u32)(step * 4)), stepInt = _mm_set1_epi32((int)((step * 4) >> 32));
+	const __m128 one = _mm_set1_ps(TSF_SAMPLE_ONE), alphaScale = _mm_set1_ps(TSF_SAMPLE_ONE / 16777216.0f);
+	__m128i idx = _mm_set_epi32((int)((pos + step * 3) >> 32), (int)((pos + step * 2) >> 32), (int)((pos + step) >> 32), (int)(pos >> 32));
+	__m128i frac = _mm_set_epi32((int)(tsf_u32)(pos + step * 3), (int)(tsf_u32)(pos + step * 2), (int)(tsf_u32)(pos + step), (int)(tsf_u32)pos);
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		int ip[4];
+		__m128 alpha = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(frac, 8)), alphaScale), x0, x1;
+		__m128i newFrac = _mm_add_epi32(frac, stepFrac);
+		_mm_storeu_si128((__m128i*)ip, idx);
+		x0 = tsf_gather_sse2(input, ip);
+		x1 = tsf_gather_sse2(input + 1, ip);
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(x0, _mm_sub_ps(one, alpha)), _mm_mul_ps(x1, alpha)));
+
+		// unsigned newFrac < frac means the fraction overflowed, the compare mask is -1 so subtracting it adds the carry
+		idx = _mm_sub_epi32(_mm_add_epi32(idx, stepInt), _mm_cmpgt_epi32(_mm_xor_si128(frac, signBit), _mm_xor_si128(newFrac, signBit)));
+		frac = newFrac;
+	}
+	if (i != count) tsf_interpolate_scalar(out + i, input, pos + step * i, step, count - i);
+}
+
+TSF_TARGET_SSE2 static void tsf_interpolate_cubic_sse2(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count)
+{
+	for (; count; count--, pos += step)
+	{
+		const tsf_sample* in = input + (tsf_u32)(pos >> 32);
+		__m128 sum = _mm_mul_ps(tsf_load_sse2(in - 1), _mm_loadu_ps(tsf_interp_cubic[TSF_INTERP_PHASE((tsf_u32)pos)]));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		_mm_store_ss(out++, _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1)));
+	}
+}
+
+TSF_TARGET_SSE2 static void tsf_interpolate_sinc_sse2(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count)
+{
+	for (; count; count--, pos += step)
+	{
+		const tsf_sample* in = input + (tsf_u32)(pos >> 32);
+		const float* c = tsf_interp_sinc[TSF_INTERP_PHASE((tsf_u32)pos)];
+		__m128 sum = _mm_add_ps(_mm_mul_ps(tsf_load_sse2(in - 3), _mm_loadu_ps(c)), _mm_mul_ps(tsf_load_sse2(in + 1), _mm_loadu_ps(c + 4)));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		_mm_store_ss(out++, _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1)));
+	}
+}
+
+TSF_TARGET_SSE2 static void tsf_mix_interleaved_sse2(float* out, const float* in, int count, float gainLeft, float gainRight)
+{
+	const __m128 gain = _mm_set_ps(gainRight, gainLeft, gainRight, gainLeft);
+	int i = 0;
+	for (; i + 4 <= count; i += 4, out += 8)
+	{
+		__m128 val = _mm_loadu_ps(in + i);
+		_mm_storeu_ps(out,     _mm_add_ps(_mm_loadu_ps(out),     _mm_mul_ps(_mm_unpacklo_ps(val, val), gain)));
+		_mm_storeu_ps(out + 4, _mm_add_ps(_mm_loadu_ps(out + 4), _mm_mul_ps(_mm_unpackhi_ps(val, val), gain)));
+	}
+	tsf_mix_interleaved_scalar(out, in + i, count - i, gainLeft, gainRight);
+}
+
+TSF_TARGET_SSE2 static void tsf_mix_unweaved_sse2(float* outL, float* outR, const float* in, int count, float gainLeft, float gainRight)
+{
+	const __m128 gainL = _mm_set1_ps(gainLeft), gainR = _mm_set1_ps(gainRight);
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 val = _mm_loadu_ps(in + i);
+		_mm_storeu_ps(outL + i, _mm_add_ps(_mm_loadu_ps(outL + i), _mm_mul_ps(val, gainL)));
+		_mm_storeu_ps(outR + i, _mm_add_ps(_mm_loadu_ps(outR + i), _mm_mul_ps(val, gainR)));
+	}
+	tsf_mix_unweaved_scalar(outL + i, outR + i, in + i, count - i, gainLeft, gainRight);
+}
+
+TSF_TARGET_SSE2 static void tsf_mix_mono_sse2(float* out, const float* in, int count, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain);
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g)));
+	tsf_mix_mono_scalar(out + i, in + i, count - i, gain);
+}
+
+TSF_TARGET_SSE2 static void tsf_render_bank4_sse2(struct tsf_voice_bank* bank, const tsf_sample* input, int lane, int count)
+{
+	// Interpolate 4 output samples for 4 voices (one per lane), then transpose so the voices can be summed per output sample
+	const __m128i signBit = _mm_set1_epi32((int)0x80000000);
+	const __m128i stepInt = _mm_loadu_si128((const __m128i*)(bank->stepInt + lane)), stepFrac = _mm_loadu_si128((const __m128i*)(bank->stepFrac + lane));
+	const __m128 one = _mm_set1_ps(TSF_SAMPLE_ONE), alphaScale = _mm_set1_ps(TSF_SAMPLE_ONE / 16777216.0f);
+	const __m128 gainL = _mm_loadu_ps(bank->gainLeft + lane), gainR = _mm_loadu_ps(bank->gainRight + lane);
+	__m128i idx = _mm_loadu_si128((const __m128i*)(bank->index + lane)), frac = _mm_loadu_si128((const __m128i*)(bank->fraction + lane));
+	// The low-pass filter runs in double precision like tsf_voice_lowpass_process, lanes 0-1 in lo and 2-3 in hi
+	const __m128d a0lo = _mm_loadu_pd(bank->a0 + lane), a0hi = _mm_loadu_pd(bank->a0 + lane + 2), a1lo = _mm_loadu_pd(bank->a1 + lane), a1hi = _mm_loadu_pd(bank->a1 + lane + 2);
+	const __m128d b1lo = _mm_loadu_pd(bank->b1 + lane), b1hi = _mm_loadu_pd(bank->b1 + lane + 2), b2lo = _mm_loadu_pd(bank->b2 + lane), b2hi = _mm_loadu_pd(bank->b2 + lane + 2);
+	__m128d z1lo = _mm_loadu_pd(bank->z1 + lane), z1hi = _mm_loadu_pd(bank->z1 + lane + 2), z2lo = _mm_loadu_pd(bank->z2 + lane), z2hi = _mm_loadu_pd(bank->z2 + lane + 2);
+	TSF_BOOL lowpass = (bank->lowpass[lane] || bank->lowpass[lane + 1] || bank->lowpass[lane + 2] || bank->lowpass[lane + 3]);
+	int i, t;
+	for (i = 0; i < count; i += 4)
+	{
+		__m128 l0, l1, l2, l3, r0, r1, r2, r3, l[4], r[4];
+		for (t = 0; t != 4; t++)
+		{
+			int ip[4];
+			__m128 alpha, x0, x1, val;
+			__m128i newFrac;
+			if (i + t == count) { for (; t != 4; t++) l[t] = r[t] = _mm_setzero_ps(); break; }
+			alpha = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(frac, 8)), alphaScale);
+			newFrac = _mm_add_epi32(frac, stepFrac);
+			_mm_storeu_si128((__m128i*)ip, idx);
+			x0 = tsf_gather_sse2(input, ip);
+			x1 = tsf_gather_sse2(input + 1, ip);
+			val = _mm_add_ps(_mm_mul_ps(x0, _mm_sub_ps(one, alpha)), _mm_mul_ps(x1, alpha));
+			if (lowpass)
+			{
+				__m128d inLo = _mm_cvtps_pd(val), inHi = _mm_cvtps_pd(_mm_movehl_ps(val, val));
+				__m128d outLo = _mm_add_pd(_mm_mul_pd(inLo, a0lo), z1lo), outHi = _mm_add_pd(_mm_mul_pd(inHi, a0hi), z1hi);
+				z1lo = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(inLo, a1lo), z2lo), _mm_mul_pd(b1lo, outLo));
+				z1hi = _mm_sub_pd(_mm_add_pd(_mm_mul_pd(inHi, a1hi), z2hi), _mm_mul_pd(b1hi, outHi));
+				z2lo = _mm_sub_pd(_mm_mul_pd(inLo, a0lo), _mm_mul_pd(b2lo, outLo));
+				z2hi = _mm_sub_pd(_mm_mul_pd(inHi, a0hi), _mm_mul_pd(b2hi, outHi));
+				val = _mm_movelh_ps(_mm_cvtpd_ps(outLo), _mm_cvtpd_ps(outHi));
+			}
+			l[t] = _mm_mul_ps(val, gainL);
+			r[t] = _mm_mul_ps(val, gainR);
+			idx = _mm_sub_epi32(_mm_add_epi32(idx, stepInt), _mm_cmpgt_epi32(_mm_xor_si128(frac, signBit), _mm_xor_si128(newFrac, signBit)));
+			frac = newFrac;
+		}
+		l0 = l[0], l1 = l[1], l2 = l[2], l3 = l[3], r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3];
+		_MM_TRANSPOSE4_PS(l0, l1, l2, l3);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		l0 = _mm_add_ps(_mm_add_ps(l0, l1), _mm_add_ps(l2, l3));
+		r0 = _mm_add_ps(_mm_add_ps(r0, r1), _mm_add_ps(r2, r3));
+		if (i + 4 <= count)
+		{
+			_mm_storeu_ps(bank->mixLeft + i,  _mm_add_ps(_mm_loadu_ps(bank->mixLeft + i),  l0));
+			_mm_storeu_ps(bank->mixRight + i, _mm_add_ps(_mm_loadu_ps(bank->mixRight + i), r0));
+		}
+		else
+		{
+			float sumL[4], sumR[4];
+			_mm_storeu_ps(sumL, l0);
+			_mm_storeu_ps(sumR, r0);
+			for (t = 0; i + t != count; t++) { bank->mixLeft[i + t] += sumL[t]; bank->mixRight[i + t] += sumR[t]; }
+		}
+	}
+	if (lowpass)
+	{
+		double z1[4], z2[4];
+		_mm_storeu_pd(z1, z1lo), _mm_storeu_pd(z1 + 2, z1hi), _mm_storeu_pd(z2, z2lo), _mm_storeu_pd(z2 + 2, z2hi);
+		for (t = 0; t != 4; t++) if (bank->lowpass[lane + t]) { bank->lowpass[lane + t]->z1 = z1[t]; bank->lowpass[lane + t]->z2 = z2[t]; }
+	}
+}
+
+TSF_TARGET_SSE2 static void tsf_render_bank_sse2(struct tsf_voice_bank* bank, const tsf_sample* input, int count)
+{
+	int lane = 0;
+	for (; lane + 4 <= bank->laneNum; lane += 4) tsf_render_bank4_sse2(bank, input, lane, count);
+	tsf_render_bank_lanes(bank, input, lane, count, tsf_interpolate_sse2, tsf_mix_unweaved_sse2);
+}
+
+TSF_TARGET_SSE2 static void tsf_reduce_sse2(float* out, const float* in, int inStride, int inNum, int count)
+{
+	int i = 0, k;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 sum = _mm_loadu_ps(out + i);
+		for (k = 0; k != inNum; k++) sum = _mm_add_ps(sum, _mm_load_ps(in + k * inStride + i));
+		_mm_storeu_ps(out + i, sum);
+	}
+	tsf_reduce_scalar(out + i, in + i, inStride, inNum, count - i);
+}
+
+TSF_TARGET_AVX2 static void tsf_gather_avx2(const tsf_sample* input, __m256i idx, __m256* x0, __m256* x1)
+{
+	// Load the samples at 8 indices and the samples following them as floats
+	#ifdef TSF_SAMPLES_SHORT
+	// A 32-bit gather at 16-bit granularity reads each sample together with the next one
+	__m256i pair = _mm256_i32gather_epi32((const int*)input, idx, 2);
+	*x0 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(pair, 16), 16));
+	*x1 = _mm256_cvtepi32_ps(_mm256_srai_epi32(pair, 16));
+	#else
+	*x0 = _mm256_i32gather_ps(input, idx, 4);
+	*x1 = _mm256_i32gather_ps(input + 1, idx, 4);
+	#endif
+}
+
+TSF_TARGET_AVX2 static void tsf_interpolate_avx2(float* out, const tsf_sample* input, tsf_u64 pos, tsf_u64 step, int count)
+{
+	// Each lane keeps its own integer index and 32 bit fraction, advanced by 8 steps with carry
+	const __m256i signBit = _mm256_set1_epi32((int)0x80000000), stepFrac = _mm256_set1_epi32((int)(tsf_u32)(step * 8)), stepInt = _mm256_set1_epi32((int)((step * 8) >> 32));
+	const __m256 one = _mm256_set1_ps(TSF_SAMPLE_ONE), alphaScale = _mm256_set1_ps(TSF_SAMPLE_ONE / 16777216.0f);
+	int ip[8], fp[8], i;
+	__m256i idx, frac;
+	for (i = 0; i != 8; i++) { tsf_u64 p = pos + step * i; ip[i] = (int)(p >> 32); fp[i] = (int)(tsf_u32)p; }
+	idx = _mm256_loadu_si256((const __m256i*)ip), frac = _mm256_loadu_si256((const __m256i*)fp);
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		__m256 alpha = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(frac, 8)), alphaScale), x0, x1;
+		__m256i newFrac = _mm256_add_epi32(frac, stepFrac);
+		tsf_gather_avx2(input, idx, &x0, &x1);
+		_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(x0, _mm256_sub_ps(one, alpha)), _mm256_mul_ps(x1, alpha)));
+
+		// unsigned newFrac < frac means the fraction overflowed, the compare mask is -1 so subtracting it adds the carry
+		idx = _mm256_sub_epi32(_mm256_add_epi32(idx, stepInt), _mm256_cmpgt_epi32(_mm256_xor_si256(frac, signBit), _mm256_xor_si256(newFrac, signBit)));
+		frac = newFrac;
+	}
+	if (i != count) tsf_interpolate_scalar(out + i, input, pos + step * i, step, count - i);
+}
+
+TSF_TARGET_AVX2 static void tsf_mix_interleaved_avx2(float* out, const float* in, int count, float gainLeft, float gainRight)
+{
+	const __m256 gain = _mm256_set_ps(gainRight, gainLeft, gainRight, gainLeft, gainRight, gainLeft, gainRight, gainLeft);
+	int i = 0;
+	for (; i + 8 <= count; i += 8, out += 16)
+	{
+		// unpack works per 128-bit lane, so lo holds samples 0,1,4,5 and hi holds 2,3,6,7 (each duplicated)
+		__m256 val = _mm256_loadu_ps(in + i), lo = _mm256_unpacklo_ps(val, val), hi = _mm256_unpackhi_ps(val, val);
+		_mm256_storeu_ps(out,     _mm256_add_ps(_mm256_loadu_ps(out),     _mm256_mul_ps(_mm256_permute2f128_ps(lo, hi, 0x20), gain)));
+		_mm256_storeu_ps(out + 8, _mm256_add_ps(_mm256_loadu_ps(out + 8), _mm256_mul_ps(_mm256_permute2f128_ps(lo, hi, 0x31), gain)));
+	}
+	tsf_mix_interleaved_scalar(out, in + i, count - i, gainLeft, gainRight);
+}
+
+TSF_TARGET_AVX2 static void tsf_mix_unweaved_avx2(float* outL, float* outR, const float* in, int count, float gainLeft, float gainRight)
+{
+	const __m256 gainL = _mm256_set1_ps(gainLeft), gainR = _mm256_set1_ps(gainRight);
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 val = _mm256_loadu_ps(in + i);
+		_mm256_storeu_ps(outL + i, _mm256_add_ps(_mm256_loadu_ps(outL + i), _mm256_mul_ps(val, gainL)));
+		_mm256_storeu_ps(outR + i, _mm256_add_ps(_mm256_loadu_ps(outR + i), _mm256_mul_ps(val, gainR)));
+	}
+	tsf_mix_unweaved_scalar(outL + i, outR + i, in + i, count - i, gainLeft, gainRight);
+}
+
+TSF_TARGET_AVX2 static void tsf_mix_mono_avx2(float* out, const float* in, int count, float gain)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(_mm256_loadu_ps(in + i), g)));
+	tsf_mix_mono_scalar(out + i, in + i, count - i, gain);
+}
+
+TSF_TARGET_AVX2 static __m256 tsf_sum_lanes4_avx2(const __m256* v)
+{
+	// Transpose 4 samples of 4 lanes in each 128-bit half and sum the lanes, giving 4 samples per half
+	__m256 t0 = _mm256_unpacklo_ps(v[0], v[1]), t1 = _mm256_unpackhi_ps(v[0], v[1]);
+	__m256 t2 = _mm256_unpacklo_ps(v[2], v[3]), t3 = _mm256_unpackhi_ps(v[2], v[3]);
+	return _mm256_add_ps(_mm256_add_ps(_mm256_shuffle_ps(t0, t2, 0x44), _mm256_shuffle_ps(t0, t2, 0xEE)),
+	                     _mm256_add_ps(_mm256_shuffle_ps(t1, t3, 0x44), _mm256_shuffle_ps(t1, t3, 0xEE)));
+}
+
+TSF_TARGET_AVX2 static void tsf_render_bank8_avx2(struct tsf_voice_bank* bank, const tsf_sample* input, int lane, int count)
+{
+	// Interpolate 8 output samples for 8 voices (one per lane) with gathers, then sum the voices per output sample
+	const __m256i signBit = _mm256_set1_epi32((int)0x80000000);
+	const __m256i stepInt = _mm256_loadu_si256((const __m256i*)(bank->stepInt + lane)), stepFrac = _mm256_loadu_si256((const __m256i*)(bank->stepFrac + lane));
+	const __m256 one = _mm256_set1_ps(TSF_SAMPLE_ONE), alphaScale = _mm256_set1_ps(TSF_SAMPLE_ONE / 16777216.0f);
+	const __m256 gainL = _mm256_loadu_ps(bank->gainLeft + lane), gainR = _mm256_loadu_ps(bank->gainRight + lane);
+	__m256i idx = _mm256_loadu_si256((const __m256i*)(bank->index + lane)), frac = _mm256_loadu_si256((const __m256i*)(bank->fraction + lane));
+	// The low-pass filter runs in double precision like tsf_voice_lowpass_process, lanes 0-3 in lo and 4-7 in hi
+	const __m256d a0lo = _mm256_loadu_pd(bank->a0 + lane), a0hi = _mm256_loadu_pd(bank->a0 + lane + 4), a1lo = _mm256_loadu_pd(bank->a1 + lane), a1hi = _mm256_loadu_pd(bank->a1 + lane + 4);
+	const __m256d b1lo = _mm256_loadu_pd(bank->b1 + lane), b1hi = _mm256_loadu_pd(bank->b1 + lane + 4), b2lo = _mm256_loadu_pd(bank->b2 + lane), b2hi = _mm256_loadu_pd(bank->b2 + lane + 4);
+	__m256d z1lo = _mm256_loadu_pd(bank->z1 + lane), z1hi = _mm256_loadu_pd(bank->z1 + lane + 4), z2lo = _mm256_loadu_pd(bank->z2 + lane), z2hi = _mm256_loadu_pd(bank->z2 + lane + 4);
+	TSF_BOOL lowpass = TSF_FALSE;
+	int i, t;
+	for (t = 0; t != 8; t++) if (bank->lowpass[lane + t]) lowpass = TSF_TRUE;
+	for (i = 0; i < count; i += 8)
+	{
+		__m256 l[8], r[8], sumL, sumR, lo, hi;
+		for (t = 0; t != 8; t++)
+		{
+			__m256 alpha, x0, x1, val;
+			__m256i newFrac;
+			if (i + t == count) { for (; t != 8; t++) l[t] = r[t] = _mm256_setzero_ps(); break; }
+			alpha = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(frac, 8)), alphaScale);
+			tsf_gather_avx2(input, idx, &x0, &x1);
+			newFrac = _mm256_add_epi32(frac, stepFrac);
+			val = _mm256_add_ps(_mm256_mul_ps(x0, _mm256_sub_ps(one, alpha)), _mm256_mul_ps(x1, alpha));
+			if (lowpass)
+			{
+				__m256d inLo = _mm256_cvtps_pd(_mm256_castps256_ps128(val)), inHi = _mm256_cvtps_pd(_mm256_extractf128_ps(val, 1));
+				__m256d outLo = _mm256_add_pd(_mm256_mul_pd(inLo, a0lo), z1lo), outHi = _mm256_add_pd(_mm256_mul_pd(inHi, a0hi), z1hi);
+				z1lo = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(inLo, a1lo), z2lo), _mm256_mul_pd(b1lo, outLo));
+				z1hi = _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(inHi, a1hi), z2hi), _mm256_mul_pd(b1hi, outHi));
+				z2lo = _mm256_sub_pd(_mm256_mul_pd(inLo, a0lo), _mm256_mul_pd(b2lo, outLo));
+				z2hi = _mm256_sub_pd(_mm256_mul_pd(inHi, a0hi), _mm256_mul_pd(b2hi, outHi));
+				val = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(outLo)), _mm256_cvtpd_ps(outHi), 1);
+			}
+			l[t] = _mm256_mul_ps(val, gainL);
+			r[t] = _mm256_mul_ps(val, gainR);
+			idx = _mm256_sub_epi32(_mm256_add_epi32(idx, stepInt), _mm256_cmpgt_epi32(_mm256_xor_si256(frac, signBit), _mm256_xor_si256(newFrac, signBit)));
+			frac = newFrac;
+		}
+
+		// lo holds lanes 0-3 and hi lanes 4-7 of samples 0 to 7
+		lo = tsf_sum_lanes4_avx2(l), hi = tsf_sum_lanes4_avx2(l + 4);
+		sumL = _mm256_add_ps(_mm256_permute2f128_ps(lo, hi, 0x20), _mm256_permute2f128_ps(lo, hi, 0x31));
+		lo = tsf_sum_lanes4_avx2(r), hi = tsf_sum_lanes4_avx2(r + 4);
+		sumR = _mm256_add_ps(_mm256_permute2f128_ps(lo, hi, 0x20), _mm256_permute2f128_ps(lo, hi, 0x31));
+		if (i + 8 <= count)
+		{
+			_mm256_storeu_ps(bank->mixLeft + i,  _mm256_add_ps(_mm256_loadu_ps(bank->mixLeft + i),  sumL));
+			_mm256_storeu_ps(bank->mixRight + i, _mm256_add_ps(_mm256_loadu_ps(bank->mixRight + i), sumR));
+		}
+		else
+		{
+			float tailL[8], tailR[8];
+			_mm256_storeu_ps(tailL, sumL);
+			_mm256_storeu_ps(tailR, sumR);
+			for (t = 0; i + t != count; t++) { bank->mixLeft[i + t] += tailL[t]; bank->mixRight[i + t] += tailR[t]; }
+		}
+	}
+	if (lowpass)
+	{
+		double z1[8], z2[8];
+		_mm256_storeu_pd(z1, z1lo), _mm256_storeu_pd(z1 + 4, z1hi), _mm256_storeu_pd(z2, z2lo), _mm256_storeu_pd(z2 + 4, z2hi);
+		for (t = 0; t != 8; t++) if (bank->lowpass[lane + t]) { bank->lowpass[lane + t]->z1 = z1[t]; bank->lowpass[lane + t]->z2 = z2[t]; }
+	}
+}
+
+TSF_TARGET_AVX2 static void tsf_render_bank_avx2(struct tsf_voice_bank* bank, const tsf_sample* input, int count)
+{
+	int lane = 0;
+	for (; lane + 8 <= bank->laneNum; lane += 8) tsf_render_bank8_avx2(bank, input, lane, count);
+	if (lane + 4 <= bank->laneNum) { tsf_render_bank4_sse2(bank, input, lane, count); lane += 4; }
+	tsf_render_bank_lanes(bank, input, lane, count, tsf_interpolate_avx2, tsf_mix_unweaved_avx2);
+}
+
+TSF_TARGET_AVX2 static void tsf_reduce_avx2(float* out, const float* in, int inStride, int inNum, int count)
+{
+	int i = 0, k;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 sum = _mm256_loadu_ps(out + i);
+		for (k = 0; k != inNum; k++) sum = _mm256_add_ps(sum, _mm256_load_ps(in + k * inStride + i));
+		_mm256_storeu_ps(out + i, sum);
+	}
+	tsf_reduce_scalar(out + i, in + i, inStride, inNum, count - i);
+}
+
+static const struct tsf_kernels tsf_kernels_sse2 =
+{
+	{ tsf_interpolate_nearest_scalar, tsf_interpolate_sse2, tsf_interpolate_cubic_sse2, tsf_interpolate_sinc_sse2 },
+	tsf_mix_interleaved_sse2, tsf_mix_unweaved_sse2, tsf_mix_mono_sse2, tsf_render_bank_sse2, tsf_reduce_sse2
+};
+
+static const struct tsf_kernels tsf_kernels_avx2 =
+{
+	{ tsf_interpolate_nearest_scalar, tsf_interpolate_avx2, tsf_interpolate_cubic_sse2, tsf_interpolate_sinc_sse2 },
+	tsf_mix_interleaved_avx2, tsf_mix_unweaved_avx2, tsf_mix_mono_avx2, tsf_render_bank_avx2, tsf_reduce_avx2
+};
+#endif
+
+#ifdef TSF_X86
+static int tsf_cpu_features(void)
+{
+	// Returns 2 if AVX2 can be used, 1 for SSE2, 0 otherwise
+	#if defined(_MSC_VER)
+	int info[4], res = 0;
+	__cpuid(info, 0);
+	if (info[0] < 1) return 0;
+	__cpuid(info, 1);
+	if (info[3] & (1 << 26)) res = 1;
+	if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6)
+	{
+		// OS saves the AVX registers, check the AVX2 bit in the extended features
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) res = 2;
+	}
+	return res;
+	#else
+	__builtin_cpu_init();
+	return (__builtin_cpu_supports("avx2") ? 2 : (__builtin_cpu_supports("sse2") ? 1 : 0));
+	#endif
+}
+
+static int tsf_features; // set by tsf_statics_init
+#endif
+
+static const struct tsf_kernels* tsf_select_kernels(void)
+{
+	#ifdef TSF_SIMD_X86
+	if (tsf_features == 2) return &tsf_kernels_avx2;
+	if (tsf_features == 1) return &tsf_kernels_sse2;
+	#endif
+	return &tsf_kernels_scalar;
+}
+
+// The tables and the CPU features shared by all instances are set up once, by the first tsf_create
+// of the process, so creating and configuring instances on several threads at once doesn't race
+static void tsf_statics_build(void)
+{
+	tsf_fastmath_init();
+	tsf_interp_tables_init();
+	#ifdef TSF_X86
+	tsf_features = tsf_cpu_features();
+	#endif
+}
+
+#if defined(TSF_NO_THREADS)
+static void tsf_statics_init(void)
+{
+	static TSF_BOOL initialized = TSF_FALSE;
+	if (!initialized) { tsf_statics_build(); initialized = TSF_TRUE; }
+}
+#elif defined(_WIN32)
+static BOOL CALLBACK tsf_statics_once(PINIT_ONCE once, PVOID param, PVOID* context)
+{
+	(void)once; (void)param; (void)context;
+	tsf_statics_build();
+	return TRUE;
+}
+
+static void tsf_statics_init(void)
+{
+	static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+	InitOnceExecuteOnce(&once, tsf_statics_once, TSF_NULL, TSF_NULL);
+}
+#else
+static void tsf_statics_init(void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, tsf_statics_build);
+}
+#endif
+
+// Fading release tails and the filter state ringing out on silence end up as denormal numbers
+// which are very slow to calculate with, so they get flushed to zero while rendering.
+// This doesn't depend on the kernels, the scalar ones use SSE2 math as well on x86-64.
+// Returns the previous floating point mode for tsf_denormals_restore.
+#ifdef TSF_X86
+TSF_TARGET_SSE2
+#endif
+static unsigned int tsf_denormals_disable(void)
+{
+	#if defined(TSF_NO_FLUSH_DENORMALS)
+	return 0;
+	#elif defined(TSF_X86)
+	unsigned int mode;
+	#if !defined(_M_X64) && !defined(__x86_64__)
+	if (!tsf_features) return 0; // no SSE2, MXCSR might not exist
+	#endif
+	mode = _mm_getcsr();
+	_mm_setcsr(mode | 0x8040); // flush to zero (FTZ) and denormals are zero (DAZ)
+	return mode;
+	#elif defined(__aarch64__) && defined(__GNUC__)
+	unsigned long long mode;
+	__asm__ __volatile__("mrs %0, fpcr" : "=r"(mode));
+	__asm__ __volatile__("msr fpcr, %0" : : "r"(mode | (1ull << 24))); // flush to zero (FZ)
+	return (unsigned int)mode;
+	#else
+	return 0;
+	#endif
+}
+
+#ifdef TSF_X86
+TSF_TARGET_SSE2
+#endif
+static void tsf_denormals_restore(unsigned int mode)
+{
+	#if defined(TSF_NO_FLUSH_DENORMALS)
+	(void)mode;
+	#elif defined(TSF_X86)
+	if (mode) _mm_setcsr(mode);
+	#elif defined(__aarch64__) && defined(__GNUC__)
+	__asm__ __volatile__("msr fpcr, %0" : : "r"((unsigned long long)mode));
+	#else
+	(void)mode;
+	#endif
+}
+
+static int tsf_voice_spanlength(tsf_u64 pos, tsf_u64 step, tsf_u64 limit, int maxSamples)
+{
+	// Number of samples that can be interpolated starting at pos before reaching limit
+	tsf_u64 n;
+	if (pos >= limit) return 0;
+	n = (limit - pos + step - 1) / step;
+	return (n >= (tsf_u64)maxSamples ? maxSamples : (int)n);
+}
+
+static void tsf_voice_bank_flush(tsf* f, struct tsf_voice_bank* bank, int count)
+{
+	if (!bank->laneNum) return;
+	if (!bank->mixed)
+	{
+		TSF_MEMSET(bank->mixLeft, 0, count * sizeof(float));
+		TSF_MEMSET(bank->mixRight, 0, count * sizeof(float));
+		bank->mixed = TSF_TRUE;
+	}
+	f->kernels->renderBank(bank, f->bank->fontSamples, count);
+	bank->laneNum = 0;
+}
+
+static void tsf_voice_bank_add(tsf* f, struct tsf_voice_bank* bank, struct tsf_voice_lowpass* lowpass, tsf_u64 pos, tsf_u64 step, int count, float gainLeft, float gainRight)
+{
+	int lane = bank->laneNum++;
+	bank->index[lane] = (tsf_u32)(pos >> 32);
+	bank->fraction[lane] = (tsf_u32)pos;
+	bank->stepInt[lane] = (tsf_u32)(step >> 32);
+	bank->stepFrac[lane] = (tsf_u32)step;
+	bank->gainLeft[lane] = gainLeft;
+	bank->gainRight[lane] = gainRight;
+	if (lowpass->active)
+	{
+		bank->a0[lane] = lowpass->a0, bank->a1[lane] = lowpass->a1, bank->b1[lane] = lowpass->b1, bank->b2[lane] = lowpass->b2;
+		bank->z1[lane] = lowpass->z1, bank->z2[lane] = lowpass->z2;
+		bank->lowpass[lane] = lowpass;
+	}
+	else
+	{
+		// With these coefficients the filter outputs its input and both state values stay zero
+		bank->a0[lane] = bank->b2[lane] = 1.0, bank->a1[lane] = bank->b1[lane] = bank->z1[lane] = bank->z2[lane] = 0.0;
+		bank->lowpass[lane] = TSF_NULL;
+	}
+	if (bank->laneNum == TSF_VOICEBANK_LANES) tsf_voice_bank_flush(f, bank, count);
+}
+
+static void tsf_voice_bank_mix(tsf* f, struct tsf_voice_bank* bank, float* outL, float* outR, int count)
+{
+	// Render the remaining lanes and mix everything the bank collected during this effect block into the output
+	int i;
+	tsf_voice_bank_flush(f, bank, count);
+	if (!bank->mixed) return;
+	switch (f->outputmode)
+	{
+		case TSF_STEREO_INTERLEAVED:
+			for (i = 0; i != count; i++) { *outL++ += bank->mixLeft[i]; *outL++ += bank->mixRight[i]; }
+			break;
+
+		case TSF_STEREO_UNWEAVED:
+			f->kernels->mixMono(outL, bank->mixLeft, count, 1.0f);
+			f->kernels->mixMono(outR, bank->mixRight, count, 1.0f);
+			break;
+
+		case TSF_MONO:
+			f->kernels->mixMono(outL, bank->mixLeft, count, 1.0f);
+			break;
+	}
+	bank->mixed = TSF_FALSE;
+}
+
+// Render numSamples of the voice into outL (and outR for TSF_STEREO_UNWEAVED).
+// If bank is set, numSamples must not exceed TSF_RENDER_EFFECTSAMPLEBLOCK and the
+// voice can leave the block to the bank instead of rendering it directly.
+static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outL, float* outR, int numSamples, struct tsf_voice_bank* bank)
 {
 	struct tsf_region* region = v->region;
-	float* input = f->fontSamples;
-	float* outL = outputBuffer;
-	float* outR = (f->outputmode == TSF_STEREO_UNWEAVED ? outL + numSamples : TSF_NULL);
+	const struct tsf_kernels* kernels = f->kernels;
+	enum TSFInterpolation interpolation = f->interpolation;
+	const tsf_sample* input = f->bank->fontSamples, *guardInput = f->bank->loopGuards;
+	const struct tsf_decode_block* decodeBlocks = (f->bank->residency && f->bank->residency->decoder ? f->bank->residency->decoder->blocks : TSF_NULL);
+	float blockBuffer[TSF_RENDER_EFFECTSAMPLEBLOCK];
 
 	// Cache some values, to give them at least some chance of ending up in registers.
 	TSF_BOOL updateModEnv = (region->modEnvToPitch || region->modEnvToFilterFc);
@@ -1105,8 +2881,12 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outputBuffer, i
 	TSF_BOOL updateVibLFO = (v->viblfo.delta && (region->vibLfoToPitch));
 	TSF_BOOL isLooping    = (v->loopStart < v->loopEnd);
 	unsigned int tmpLoopStart = v->loopStart, tmpLoopEnd = v->loopEnd;
-	double tmpSampleEndDbl = (double)region->end, tmpLoopEndDbl = (double)tmpLoopEnd + 1.0;
-	double tmpSourceSamplePosition = v->sourceSamplePosition;
+	tsf_u64 tmpSampleEnd = (tsf_u64)region->end << 32, tmpLoopEndWrap = ((tsf_u64)tmpLoopEnd + 1) << 32, tmpLoopLength = ((tsf_u64)(tmpLoopEnd - tmpLoopStart) + 1) << 32;
+	unsigned int tmpWrapStart = (tmpLoopEnd + 1 > tsf_interp_taps_after[interpolation] ? tmpLoopEnd + 1 - tsf_interp_taps_after[interpolation] : 0);
+	tsf_u64 tmpSpanLimit = (isLooping && tmpWrapStart < region->end ? (tsf_u64)tmpWrapStart << 32 : tmpSampleEnd);
+	tsf_u64 tmpWrapLimit = (tmpLoopEndWrap < tmpSampleEnd ? tmpLoopEndWrap : tmpSampleEnd);
+	tsf_u64 tmpGuardOffset = ((tsf_u64)region->loop_guard - (tsf_u64)(tmpLoopEnd - (TSF_LOOPGUARD_BEFORE - 1))) << 32;
+	tsf_u64 tmpSourceSamplePosition = v->sourceSamplePosition, pitchStep;
 	struct tsf_voice_lowpass tmpLowpass = v->lowpass;
 
 	TSF_BOOL dynamicLowpass = (region->modLfoToFilterFc || region->modEnvToFilterFc);
@@ -1117,130 +2897,1322 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outputBuffer, i
 	float tmpModLfoToPitch, tmpVibLfoToPitch, tmpModEnvToPitch;
 
 	TSF_BOOL dynamicGain = (region->modLfoToVolume != 0);
-	float noteGain = 0, tmpModLfoToVolume;
+	float noteGain = 0, tmpModLfoToVolume, tmpCullGain = f->cullGain, cullNoteGain = 0;
+	TSF_BOOL fastMath = f->fastMath, trackLoudness = (f->stealing == TSF_STEAL_QUIETEST);
+
+	if (dynamicLowpass) tmpInitialFilterFc = (float)region->initialFilterFc, tmpModLfoToFilterFc = (float)region->modLfoToFilterFc, tmpModEnvToFilterFc = (float)region->modEnvToFilterFc;
+	else tmpInitialFilterFc = 0, tmpModLfoToFilterFc = 0, tmpModEnvToFilterFc = 0;
+
+	if (dynamicPitchRatio) pitchRatio = 0, tmpModLfoToPitch = (float)region->modLfoToPitch, tmpVibLfoToPitch = (float)region->vibLfoToPitch, tmpModEnvToPitch = (float)region->modEnvToPitch;
+	else pitchRatio = tsf_ctl_timecents2Secsd(fastMath, v->pitchInputTimecents) * v->pitchOutputFactor, tmpModLfoToPitch = 0, tmpVibLfoToPitch = 0, tmpModEnvToPitch = 0;
+
+	if (dynamicGain) tmpModLfoToVolume = (float)region->modLfoToVolume * 0.1f;
+	else noteGain = tsf_ctl_decibelsToGain(fastMath, v->noteGainDB), tmpModLfoToVolume = 0;
+
+	// The loudest the note gets, with the modulation LFO at its peak.
+	if (tmpCullGain) cullNoteGain = (dynamicGain ? tsf_ctl_decibelsToGain(fastMath, v->noteGainDB + (tmpModLfoToVolume < 0 ? -tmpModLfoToVolume : tmpModLfoToVolume)) : noteGain);
+
+	while (numSamples)
+	{
+		float gainMono;
+		int blockSamples = (numSamples > TSF_RENDER_EFFECTSAMPLEBLOCK ? TSF_RENDER_EFFECTSAMPLEBLOCK : numSamples), renderSamples;
+		numSamples -= blockSamples;
+
+		if (dynamicLowpass)
+		{
+			float fres = tmpInitialFilterFc + v->modlfo.level * tmpModLfoToFilterFc + v->modenv.level * tmpModEnvToFilterFc;
+			float lowpassFc = (fres <= 13500 ? tsf_ctl_cents2Hertz(fastMath, fres) / tmpSampleRate : 1.0f);
+			tmpLowpass.active = (lowpassFc < 0.499f);
+			if (tmpLowpass.active) tsf_voice_lowpass_setup(&tmpLowpass, lowpassFc, fastMath);
+		}
+
+		if (dynamicPitchRatio)
+			pitchRatio = tsf_ctl_timecents2Secsd(fastMath, v->pitchInputTimecents + (v->modlfo.level * tmpModLfoToPitch + v->viblfo.level * tmpVibLfoToPitch + v->modenv.level * tmpModEnvToPitch)) * v->pitchOutputFactor;
+
+		if (dynamicGain)
+			noteGain = tsf_ctl_decibelsToGain(fastMath, v->noteGainDB + (v->modlfo.level * tmpModLfoToVolume));
+
+		gainMono = noteGain * v->ampenv.level;
+		if (trackLoudness) v->loudBucket = tsf_voice_loudbucket(v->ampenv.segment < TSF_SEGMENT_DECAY ? noteGain : gainMono); // picked up by tsf_active_voices_prune
+		pitchStep = (tsf_u64)(pitchRatio * 4294967296.0);
+		if (!pitchStep) pitchStep = 1; // a sample rate of 0 in the sample header, the span lengths divide by the step
+
+		// From decay on the envelope level only goes down, end the voice once it fell below the audibility floor.
+		if (v->ampenv.segment >= TSF_SEGMENT_DECAY && v->ampenv.level * cullNoteGain < tmpCullGain)
+		{
+			v->culled = TSF_TRUE;
+			tsf_voice_kill(v);
+			return;
+		}
+
+		// Update EG.
+		tsf_voice_envelope_process(&v->ampenv, blockSamples, tmpSampleRate, fastMath);
+		if (updateModEnv) tsf_voice_envelope_process(&v->modenv, blockSamples, tmpSampleRate, fastMath);
+
+		// Update LFOs.
+		if (updateModLFO) tsf_voice_lfo_process(&v->modlfo, blockSamples);
+		if (updateVibLFO) tsf_voice_lfo_process(&v->viblfo, blockSamples);
+
+		// Count blocks that start where the samples aren't decoded or read yet (racy read of the state by design, it plays silence either way)
+		if (decodeBlocks && decodeBlocks[(unsigned int)(tmpSourceSamplePosition >> 32) / TSF_DECODE_BLOCK].state != TSF_BLOCK_RESIDENT) v->underrunNum++;
+
+		if (bank && interpolation == TSF_INTERP_LINEAR && tsf_voice_spanlength(tmpSourceSamplePosition, pitchStep, tmpSpanLimit, blockSamples) == blockSamples)
+		{
+			// The whole block is a single span, render it in lockstep with other voices in the bank.
+			// The bank continues the filter state in v->lowpass when it renders the lane, so it is stored first.
+			v->lowpass = tmpLowpass;
+			if (f->outputmode == TSF_MONO) tsf_voice_bank_add(f, bank, &v->lowpass, tmpSourceSamplePosition, pitchStep, blockSamples, gainMono, 0.0f);
+			else tsf_voice_bank_add(f, bank, &v->lowpass, tmpSourceSamplePosition, pitchStep, blockSamples, gainMono * v->panFactorLeft, gainMono * v->panFactorRight);
+			tmpSourceSamplePosition += pitchStep * blockSamples;
+			if (tmpSourceSamplePosition >= tmpLoopEndWrap && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+			v->sourceSamplePosition = tmpSourceSamplePosition;
+			if (tmpSourceSamplePosition >= tmpSampleEnd || v->ampenv.segment == TSF_SEGMENT_DONE) tsf_voice_kill(v);
+			return;
+		}
+		else
+		{
+			// Interpolate source samples in spans with a precomputed length up to the next loop wrap or the sample end.
+			for (renderSamples = 0; renderSamples != blockSamples && tmpSourceSamplePosition < tmpSampleEnd;)
+			{
+				int span;
+				if (tmpSourceSamplePosition < tmpSpanLimit)
+				{
+					span = tsf_voice_spanlength(tmpSourceSamplePosition, pitchStep, tmpSpanLimit, blockSamples - renderSamples);
+					kernels->interpolate[interpolation](blockBuffer + renderSamples, input, tmpSourceSamplePosition, pitchStep, span);
+				}
+				else
+				{
+					// Close to the loop end the taps are read from the loop guard which continues at the loop start
+					// (the unsigned offset wraps around to index the separate loop guard buffer).
+					span = tsf_voice_spanlength(tmpSourceSamplePosition, pitchStep, tmpWrapLimit, blockSamples - renderSamples);
+					kernels->interpolate[interpolation](blockBuffer + renderSamples, guardInput, tmpSourceSamplePosition + tmpGuardOffset, pitchStep, span);
+				}
+				tmpSourceSamplePosition += pitchStep * span;
+				renderSamples += span;
+				if (tmpSourceSamplePosition >= tmpLoopEndWrap && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+			}
+
+			// Low-pass filter.
+			if (tmpLowpass.active)
+			{
+				float *val = blockBuffer, *valEnd = blockBuffer + renderSamples;
+				for (; val != valEnd; val++) *val = tsf_voice_lowpass_process(&tmpLowpass, *val);
+			}
+
+			switch (f->outputmode)
+			{
+				case TSF_STEREO_INTERLEAVED:
+					kernels->mixInterleaved(outL, blockBuffer, renderSamples, gainMono * v->panFactorLeft, gainMono * v->panFactorRight);
+					outL += renderSamples * 2;
+					break;
+
+				case TSF_STEREO_UNWEAVED:
+					kernels->mixUnweaved(outL, outR, blockBuffer, renderSamples, gainMono * v->panFactorLeft, gainMono * v->panFactorRight);
+					outL += renderSamples, outR += renderSamples;
+					break;
+
+				case TSF_MONO:
+					kernels->mixMono(outL, blockBuffer, renderSamples, gainMono);
+					outL += renderSamples;
+					break;
+			}
+		}
+
+		if (tmpSourceSamplePosition >= tmpSampleEnd || v->ampenv.segment == TSF_SEGMENT_DONE)
+		{
+			tsf_voice_kill(v);
+			return;
+		}
+	}
+
+	v->sourceSamplePosition = tmpSourceSamplePosition;
+	if (tmpLowpass.active || dynamicLowpass) v->lowpass = tmpLowpass;
+}
+
+static void tsf_render_voices(tsf* f, const int* voices, int voiceNum, float* buffer, int samples)
+{
+	// Render the voices in the index list and mix them into the buffer
+	struct tsf_voice_bank bank;
+	float* bufferR = (f->outputmode == TSF_STEREO_UNWEAVED ? buffer + samples : TSF_NULL);
+	int blockOffset, i;
+	if (f->interpolation != TSF_INTERP_LINEAR)
+	{
+		// The bank only renders linear interpolation, render each voice in full
+		for (i = 0; i != voiceNum; i++)
+		{
+			struct tsf_voice* v = &f->voices[voices[i]];
+			if (v->playingPreset != -1) tsf_voice_render(f, v, buffer, bufferR, samples, TSF_NULL);
+		}
+		return;
+	}
+
+	// Render one effect block at a time so the voice bank can render the voices of a block in lockstep
+	bank.laneNum = 0;
+	bank.mixed = TSF_FALSE;
+	for (blockOffset = 0; blockOffset < samples; blockOffset += TSF_RENDER_EFFECTSAMPLEBLOCK)
+	{
+		int blockSamples = (samples - blockOffset > TSF_RENDER_EFFECTSAMPLEBLOCK ? TSF_RENDER_EFFECTSAMPLEBLOCK : samples - blockOffset);
+		float* outL = buffer + (f->outputmode == TSF_STEREO_INTERLEAVED ? blockOffset * 2 : blockOffset);
+		float* outR = (bufferR ? bufferR + blockOffset : TSF_NULL);
+		for (i = 0; i != voiceNum; i++)
+		{
+			struct tsf_voice* v = &f->voices[voices[i]];
+			if (v->playingPreset != -1) tsf_voice_render(f, v, outL, outR, blockSamples, &bank);
+		}
+		tsf_voice_bank_mix(f, &bank, outL, outR, blockSamples);
+	}
+}
+
+// The render pool splits the render list into slices of up to TSF_VOICEBANK_LANES voices
+// (fewer than TSF_RENDER_MAXSLICES slices with many voices). How voices are sliced only depends
+// on the playing voices, so the sum of the slices is the same for any number of threads.
+// The slice buffers are allocated with the pool for TSF_RENDER_POOLSAMPLES stereo samples, longer
+// renders are done in parts of that length (a multiple of TSF_RENDER_EFFECTSAMPLEBLOCK).
+#define TSF_RENDER_MAXTHREADS 16
+#define TSF_RENDER_MAXSLICES 32
+#define TSF_RENDER_POOLSAMPLES 1024
+#define TSF_RENDER_SLICESTRIDE (TSF_RENDER_POOLSAMPLES * 2)
+
+#ifndef TSF_NO_THREADS
+#  if defined(_WIN32)
+#    define TSF_THREAD_RESULT DWORD WINAPI
+#  else
+#    define TSF_THREAD_RESULT void*
+#  endif
+struct tsf_render_worker
+{
+	struct tsf_render_pool* pool;
+	int index;
+	#if defined(_WIN32)
+	HANDLE thread;
+	#else
+	pthread_t thread;
+	#endif
+};
+#endif
+
+struct tsf_render_pool
+{
+	tsf* f;
+	float *sliceMemory, *slices; // TSF_RENDER_MAXSLICES buffers of TSF_RENDER_SLICESTRIDE floats, slices is sliceMemory aligned to 64 bytes
+	int threadNum, sliceNum, sliceVoices, samples;
+	#ifndef TSF_NO_THREADS
+	int workerNum, generation, pending, quit;
+	struct tsf_render_worker workers[TSF_RENDER_MAXTHREADS - 1];
+	#  if defined(_WIN32)
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE start, done;
+	#  else
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	#  endif
+	#endif
+};
+
+static void tsf_render_voices_sync(tsf* f)
+{
+	// Add the voices started since the last render to the render list
+	for (; f->startedRead != f->startedWrite; f->startedRead = (f->startedRead == f->voiceNum ? 0 : f->startedRead + 1))
+	{
+		struct tsf_voice* v = &f->voices[f->startedVoices[f->startedRead]];
+		if (v->inRenderList) continue;
+		v->inRenderList = TSF_TRUE;
+		f->renderVoices[f->renderVoiceNum++] = f->startedVoices[f->startedRead];
+	}
+}
+
+static void tsf_render_voices_compact(tsf* f)
+{
+	// Remove voices that were killed while rendering from the render list and collect their underruns
+	int *i = f->renderVoices, *iEnd = i + f->renderVoiceNum, *iOut = i;
+	for (; i != iEnd; i++)
+	{
+		f->underrunNum += f->voices[*i].underrunNum;
+		f->voices[*i].underrunNum = 0;
+		if (f->voices[*i].playingPreset != -1) *iOut++ = *i;
+		else
+		{
+			if (f->voices[*i].culled) f->culledVoiceNum++;
+			f->voices[*i].inRenderList = TSF_FALSE;
+		}
+	}
+	f->renderVoiceNum = (int)(iOut - f->renderVoices);
+}
+
+static void tsf_render_pool_work(struct tsf_render_pool* pool, int index)
+{
+	// Thread index renders every threadNum-th slice into its own buffer
+	int slice;
+	for (slice = index; slice < pool->sliceNum; slice += pool->threadNum)
+	{
+		float* out = pool->slices + slice * TSF_RENDER_SLICESTRIDE;
+		int first = slice * pool->sliceVoices, voiceNum = pool->f->renderVoiceNum;
+		int num = (voiceNum - first < pool->sliceVoices ? voiceNum - first : pool->sliceVoices);
+		TSF_MEMSET(out, 0, (pool->f->outputmode == TSF_MONO ? 1 : 2) * pool->samples * sizeof(float));
+		tsf_render_voices(pool->f, pool->f->renderVoices + first, num, out, pool->samples);
+	}
+}
+
+#ifndef TSF_NO_THREADS
+static TSF_THREAD_RESULT tsf_render_pool_thread(void* data)
+{
+	struct tsf_render_worker* w = (struct tsf_render_worker*)data;
+	struct tsf_render_pool* pool = w->pool;
+	int generation = 0, quit;
+	tsf_denormals_disable(); // the thread only renders, its mode doesn't need to be restored
+	for (;;)
+	{
+		TSF_POOL_LOCK(pool);
+		while (pool->generation == generation && !pool->quit) TSF_POOL_WAIT(pool, start);
+		generation = pool->generation;
+		quit = pool->quit;
+		TSF_POOL_UNLOCK(pool);
+		if (quit) return 0;
+
+		tsf_render_pool_work(pool, w->index);
+
+		TSF_POOL_LOCK(pool);
+		if (!--pool->pending) TSF_POOL_WAKEALL(pool, done);
+		TSF_POOL_UNLOCK(pool);
+	}
+}
+#endif
+
+static void tsf_render_pool_free(struct tsf_render_pool* pool)
+{
+	if (!pool) return;
+	#ifndef TSF_NO_THREADS
+	{
+		int i;
+		TSF_POOL_LOCK(pool);
+		pool->quit = 1;
+		TSF_POOL_WAKEALL(pool, start);
+		TSF_POOL_UNLOCK(pool);
+		for (i = 0; i != pool->workerNum; i++)
+		{
+			#if defined(_WIN32)
+			WaitForSingleObject(pool->workers[i].thread, INFINITE);
+			CloseHandle(pool->workers[i].thread);
+			#else
+			pthread_join(pool->workers[i].thread, TSF_NULL);
+			#endif
+		}
+		#if defined(_WIN32)
+		DeleteCriticalSection(&pool->lock);
+		#else
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->start);
+		pthread_cond_destroy(&pool->done);
+		#endif
+	}
+	#endif
+	TSF_FREE(pool->sliceMemory);
+	TSF_FREE(pool);
+}
+
+static struct tsf_render_pool* tsf_render_pool_create(int threads)
+{
+	struct tsf_render_pool* pool = (struct tsf_render_pool*)TSF_MALLOC(sizeof(struct tsf_render_pool));
+	if (!pool) return TSF_NULL;
+	TSF_MEMSET(pool, 0, sizeof(struct tsf_render_pool));
+	pool->sliceMemory = (float*)TSF_MALLOC(TSF_RENDER_MAXSLICES * TSF_RENDER_SLICESTRIDE * sizeof(float) + 64);
+	if (!pool->sliceMemory) { TSF_FREE(pool); return TSF_NULL; }
+	pool->slices = (float*)(((size_t)pool->sliceMemory + 63) & ~(size_t)63);
+	pool->threadNum = threads;
+	#ifndef TSF_NO_THREADS
+	#  if defined(_WIN32)
+	InitializeCriticalSection(&pool->lock);
+	InitializeConditionVariable(&pool->start);
+	InitializeConditionVariable(&pool->done);
+	#  else
+	pthread_mutex_init(&pool->lock, TSF_NULL);
+	pthread_cond_init(&pool->start, TSF_NULL);
+	pthread_cond_init(&pool->done, TSF_NULL);
+	#  endif
+	for (; pool->workerNum != threads - 1; pool->workerNum++)
+	{
+		struct tsf_render_worker* w = &pool->workers[pool->workerNum];
+		w->pool = pool;
+		w->index = pool->workerNum + 1;
+		#if defined(_WIN32)
+		w->thread = CreateThread(TSF_NULL, 0, (LPTHREAD_START_ROUTINE)tsf_render_pool_thread, w, 0, TSF_NULL);
+		if (!w->thread) { tsf_render_pool_free(pool); return TSF_NULL; }
+		#else
+		if (pthread_create(&w->thread, TSF_NULL, tsf_render_pool_thread, w)) { tsf_render_pool_free(pool); return TSF_NULL; }
+		#endif
+	}
+	#endif
+	return pool;
+}
+
+static void tsf_render_pool_run(tsf* f, struct tsf_render_pool* pool, float* buffer, int samples)
+{
+	// Render the voices in parts of up to TSF_RENDER_POOLSAMPLES into the slices, each part gets summed
+	// into the buffer before the next one. Nothing is allocated here, this runs on the audio thread.
+	int voiceNum = f->renderVoiceNum, offset, i;
+	if (!voiceNum) return;
+
+	pool->sliceNum = (voiceNum + TSF_VOICEBANK_LANES - 1) / TSF_VOICEBANK_LANES;
+	if (pool->sliceNum > TSF_RENDER_MAXSLICES) pool->sliceNum = TSF_RENDER_MAXSLICES;
+	pool->sliceVoices = (voiceNum + pool->sliceNum - 1) / pool->sliceNum;
+	pool->sliceNum = (voiceNum + pool->sliceVoices - 1) / pool->sliceVoices;
+	pool->f = f;
+
+	for (offset = 0; offset < samples; offset += TSF_RENDER_POOLSAMPLES)
+	{
+		pool->samples = (samples - offset > TSF_RENDER_POOLSAMPLES ? TSF_RENDER_POOLSAMPLES : samples - offset);
+		#ifndef TSF_NO_THREADS
+		if (pool->workerNum)
+		{
+			TSF_POOL_LOCK(pool);
+			pool->pending = pool->workerNum;
+			pool->generation++;
+			TSF_POOL_WAKEALL(pool, start);
+			TSF_POOL_UNLOCK(pool);
+			tsf_render_pool_work(pool, 0);
+			TSF_POOL_LOCK(pool);
+			while (pool->pending) TSF_POOL_WAIT(pool, done);
+			TSF_POOL_UNLOCK(pool);
+		}
+		else
+		#endif
+		{
+			for (i = 0; i != pool->threadNum; i++) tsf_render_pool_work(pool, i);
+		}
+		if (f->outputmode == TSF_STEREO_UNWEAVED)
+		{
+			// The right channel of a part follows its left channel in the slices, the vector kernels
+			// need it on a 32 byte boundary and the scalar one sums the same way
+			void (*reduceRight)(float*, const float*, int, int, int) = (pool->samples & 7 ? tsf_reduce_scalar : f->kernels->reduce);
+			f->kernels->reduce(buffer + offset, pool->slices, TSF_RENDER_SLICESTRIDE, pool->sliceNum, pool->samples);
+			reduceRight(buffer + samples + offset, pool->slices + pool->samples, TSF_RENDER_SLICESTRIDE, pool->sliceNum, pool->samples);
+		}
+		else
+		{
+			int channels = (f->outputmode == TSF_MONO ? 1 : 2);
+			f->kernels->reduce(buffer + offset * channels, pool->slices, TSF_RENDER_SLICESTRIDE, pool->sliceNum, pool->samples * channels);
+		}
+	}
+}
+
+static void* tsf_pages_alloc(size_t size)
+{
+	// Zeroed memory that only gets backed by physical memory when it is written
+	#if defined(TSF_PAGES_WIN32)
+	return VirtualAlloc(TSF_NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	#elif defined(TSF_PAGES_MMAN)
+	void* p = mmap(TSF_NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED ? TSF_NULL : p);
+	#else
+	void* p = TSF_MALLOC(size);
+	if (p) TSF_MEMSET(p, 0, size);
+	return p;
+	#endif
+}
+
+static void tsf_pages_discard(void* p, size_t size)
+{
+	// Hand the whole pages in the range back to the system and zero the rest, so the range reads as zero
+	// afterwards like the fresh pages of tsf_pages_alloc (voices that get ahead of the decoder play silence)
+	char *begin = (char*)(((size_t)p + TSF_PAGE_SIZE - 1) & ~(size_t)(TSF_PAGE_SIZE - 1));
+	char *end = (char*)(((size_t)p + size) & ~(size_t)(TSF_PAGE_SIZE - 1));
+	if (begin >= end) { TSF_MEMSET(p, 0, size); return; }
+	TSF_MEMSET(p, 0, begin - (char*)p);
+	TSF_MEMSET(end, 0, (char*)p + size - end);
+	#if defined(TSF_PAGES_WIN32)
+	// MEM_RESET would keep the old contents until the system reuses the memory, decommitting releases the
+	// pages and committing them again right away gets zero pages on first access. Only pages of blocks no
+	// voice has pinned are discarded, and the commit charge released by the decommit covers the recommit.
+	VirtualFree(begin, end - begin, MEM_DECOMMIT);
+	VirtualAlloc(begin, end - begin, MEM_COMMIT, PAGE_READWRITE);
+	#elif defined(TSF_PAGES_MMAN) && defined(MADV_DONTNEED)
+	madvise(begin, end - begin, MADV_DONTNEED);
+	#else
+	TSF_MEMSET(begin, 0, end - begin);
+	#endif
+}
+
+static void tsf_pages_free(void* p, size_t size)
+{
+	#if defined(TSF_PAGES_WIN32)
+	(void)size;
+	VirtualFree(p, 0, MEM_RELEASE);
+	#elif defined(TSF_PAGES_MMAN)
+	munmap(p, size);
+	#else
+	(void)size;
+	TSF_FREE(p);
+	#endif
+}
+
+static void tsf_decode_block(const unsigned char* in, const unsigned char* inEnd, tsf_sample* out, int count)
+{
+	// Reading past the end of the block (only with broken data) gives zero bits
+	tsf_u64 bits = 0;
+	int bitNum = 0, p1 = 0, p2 = 0, x, i;
+	unsigned int k = (in != inEnd ? *in++ : 0), q, u;
+	if (k > 15) k = 15;
+	for (i = 0; i != count; i++)
+	{
+		for (; bitNum <= 56; bitNum += 8) bits |= (tsf_u64)(in != inEnd ? *in++ : 0) << bitNum;
+		for (q = 0; q != TSF_DECODE_ESCAPE && (bits & 1); q++) bits >>= 1;
+		if (q == TSF_DECODE_ESCAPE) { u = (unsigned int)bits & 0x3FFFF; bits >>= 18; bitNum -= TSF_DECODE_ESCAPE + 18; }
+		else { u = (q << k) | ((unsigned int)(bits >> 1) & ((1u << k) - 1)); bits >>= 1 + k; bitNum -= (int)(q + 1 + k); }
+		x = 2 * p1 - p2 + (int)((u >> 1) ^ (0u - (u & 1)));
+		if (x < -32768) x = -32768; else if (x > 32767) x = 32767;
+		p2 = p1; p1 = x;
+		out[i] = TSF_SAMPLE_FROM_SHORT((short)x);
+	}
+}
+
+static unsigned char* tsf_encode_block(const short* in, int count, unsigned char* out)
+{
+	// Code a block as read by tsf_decode_block, returns the end of the written data
+	tsf_u64 bits = 0, sum = 0;
+	int bitNum = 0, p1, p2, e, i;
+	unsigned int k, q, u;
+	for (p1 = p2 = 0, i = 0; i != count; p2 = p1, p1 = in[i++])
+		e = in[i] - (2 * p1 - p2), sum += (e < 0 ? ~((unsigned int)e << 1) : (unsigned int)e << 1);
+	for (k = 0; k != 15 && ((tsf_u64)count << (k + 1)) <= sum; k++) {} // about log2 of the mean residual
+	*out++ = (unsigned char)k;
+	for (p1 = p2 = 0, i = 0; i != count; p2 = p1, p1 = in[i++])
+	{
+		e = in[i] - (2 * p1 - p2);
+		u = (e < 0 ? ~((unsigned int)e << 1) : (unsigned int)e << 1);
+		q = u >> k;
+		if (q >= TSF_DECODE_ESCAPE)
+		{
+			bits |= (((tsf_u64)1 << TSF_DECODE_ESCAPE) - 1) << bitNum; bitNum += TSF_DECODE_ESCAPE;
+			bits |= (tsf_u64)u << bitNum; bitNum += 18;
+		}
+		else
+		{
+			bits |= (((tsf_u64)1 << q) - 1) << bitNum; bitNum += (int)q + 1;
+			bits |= (tsf_u64)(u & ((1u << k) - 1)) << bitNum; bitNum += (int)k;
+		}
+		for (; bitNum >= 8; bitNum -= 8, bits >>= 8) *out++ = (unsigned char)bits;
+	}
+	if (bitNum) *out++ = (unsigned char)bits;
+	return out;
+}
+
+static void tsf_decoder_lock(struct tsf_decoder* d)
+{
+	#ifndef TSF_NO_THREADS
+	TSF_POOL_LOCK(d);
+	#else
+	(void)d;
+	#endif
+}
+
+static void tsf_decoder_unlock(struct tsf_decoder* d)
+{
+	#ifndef TSF_NO_THREADS
+	TSF_POOL_UNLOCK(d);
+	#else
+	(void)d;
+	#endif
+}
+
+static void tsf_decoder_lru_remove(struct tsf_decoder* d, int block)
+{
+	struct tsf_decode_block* b = &d->blocks[block];
+	if (b->lruPrev != -1) d->blocks[b->lruPrev].lruNext = b->lruNext; else d->lruFirst = b->lruNext;
+	if (b->lruNext != -1) d->blocks[b->lruNext].lruPrev = b->lruPrev; else d->lruLast = b->lruPrev;
+	b->lruPrev = b->lruNext = -1;
+}
+
+static void tsf_decoder_lru_append(struct tsf_decoder* d, int block)
+{
+	struct tsf_decode_block* b = &d->blocks[block];
+	b->lruPrev = d->lruLast;
+	b->lruNext = -1;
+	if (d->lruLast != -1) d->blocks[d->lruLast].lruNext = block; else d->lruFirst = block;
+	d->lruLast = block;
+}
+
+static void tsf_decoder_trim(struct tsf_decoder* d, int keep)
+{
+	// Drop the least recently used blocks above the cache size except keep, called with the lock held
+	while (d->residentNum > d->maxResident && d->lruFirst != -1 && d->lruFirst != keep)
+	{
+		int block = d->lruFirst;
+		unsigned int start = (unsigned int)block * TSF_DECODE_BLOCK;
+		unsigned int count = (d->sampleCount - start < TSF_DECODE_BLOCK ? d->sampleCount - start : TSF_DECODE_BLOCK);
+		tsf_decoder_lru_remove(d, block);
+		d->blocks[block].state = TSF_BLOCK_EMPTY;
+		d->residentNum--;
+		tsf_pages_discard(d->samples + start, count * sizeof(tsf_sample));
+	}
+}
+
+#ifndef TSF_NO_STDIO
+static void tsf_decoder_read(struct tsf_decoder* d, tsf_sample* out, unsigned int start, unsigned int count)
+{
+	// Read sample points from the smpl chunk in the file, the ones that can't be read are silent.
+	// Called with the lock held, which is released while seeking and reading so other threads can
+	// fetch resident blocks in the meantime, only one thread at a time uses the file.
+	// If we ever need to compile for big-endian platforms, we'll need to byte-swap here.
+	short buffer[TSF_DECODE_BLOCK];
+	size_t i, n = 0;
+	#ifndef TSF_NO_THREADS
+	while (d->reading) TSF_POOL_WAIT(d, done);
+	d->reading = TSF_TRUE;
+	#endif
+	tsf_decoder_unlock(d);
+	if (!tsf_file_seek(d->file, d->fileOffset + (tsf_u64)start * sizeof(short), SEEK_SET)) n = fread(buffer, sizeof(short), count, d->file);
+	for (i = 0; i != n; i++) out[i] = TSF_SAMPLE_FROM_SHORT(buffer[i]);
+	for (; i != count; i++) out[i] = (tsf_sample)0;
+	tsf_decoder_lock(d);
+	#ifndef TSF_NO_THREADS
+	d->reading = TSF_FALSE;
+	TSF_POOL_WAKEALL(d, done);
+	#endif
+}
+#endif
+
+static void tsf_decoder_decode(struct tsf_decoder* d, int block)
+{
+	// Decode an empty block, called with the lock held which is released while decoding
+	struct tsf_decode_block* b = &d->blocks[block];
+	unsigned int start = (unsigned int)block * TSF_DECODE_BLOCK;
+	unsigned int count = (d->sampleCount - start < TSF_DECODE_BLOCK ? d->sampleCount - start : TSF_DECODE_BLOCK);
+	b->state = TSF_BLOCK_DECODING;
+	#ifndef TSF_NO_STDIO
+	if (d->file) tsf_decoder_read(d, d->samples + start, start, count);
+	else
+	#endif
+	{
+		tsf_decoder_unlock(d);
+		tsf_decode_block(d->data + b->offset, d->data + b[1].offset, d->samples + start, (int)count);
+		tsf_decoder_lock(d);
+	}
+	b->state = TSF_BLOCK_RESIDENT;
+	d->residentNum++;
+	if (!b->pins) tsf_decoder_lru_append(d, block);
+	tsf_decoder_trim(d, block);
+	#ifndef TSF_NO_THREADS
+	TSF_POOL_WAKEALL(d, done);
+	#endif
+}
+
+static void tsf_decoder_queue(struct tsf_decoder* d, int block)
+{
+	// Hand an empty block to the decode thread (or decode it right away without one), called with the lock held
+	#ifndef TSF_NO_THREADS
+	if (d->started)
+	{
+		if (d->blocks[block].queued) return;
+		d->blocks[block].queued = TSF_TRUE;
+		d->queue[d->queueWrite] = block;
+		d->queueWrite = (d->queueWrite == d->blockNum ? 0 : d->queueWrite + 1);
+		TSF_POOL_WAKEALL(d, start);
+		return;
+	}
+	#endif
+	tsf_decoder_decode(d, block);
+}
+
+static void tsf_decoder_fetch(struct tsf_decoder* d, unsigned int start, unsigned int end, unsigned int headStart, unsigned int headEnd, TSF_BOOL pin)
+{
+	// Get the sample points from start to end decoded, the ones from headStart to headEnd before returning
+	// and the others on the decode thread. With pin set the blocks are kept until tsf_decoder_unpin.
+	int block, last, headFirst, headLast;
+	if (headStart < start) headStart = start;
+	if (headEnd > end) headEnd = end;
+	headFirst = (int)(headStart / TSF_DECODE_BLOCK);
+	headLast = (headStart < headEnd ? (int)((headEnd - 1) / TSF_DECODE_BLOCK) : headFirst - 1);
+	last = (int)((end - 1) / TSF_DECODE_BLOCK);
+	tsf_decoder_lock(d);
+	for (block = (int)(start / TSF_DECODE_BLOCK); block <= last; block++)
+	{
+		struct tsf_decode_block* b = &d->blocks[block];
+		if (pin) { if (!b->pins++ && b->state == TSF_BLOCK_RESIDENT) tsf_decoder_lru_remove(d, block); }
+		else if (!b->pins && b->state == TSF_BLOCK_RESIDENT) { tsf_decoder_lru_remove(d, block); tsf_decoder_lru_append(d, block); }
+		if (block >= headFirst && block <= headLast)
+		{
+			#ifndef TSF_NO_THREADS
+			while (b->state == TSF_BLOCK_DECODING) TSF_POOL_WAIT(d, done);
+			#endif
+			if (b->state == TSF_BLOCK_EMPTY) tsf_decoder_decode(d, block);
+		}
+		else if (b->state == TSF_BLOCK_EMPTY) tsf_decoder_queue(d, block);
+	}
+	tsf_decoder_unlock(d);
+}
+
+static void tsf_decoder_unpin(struct tsf_decoder* d, unsigned int start, unsigned int end)
+{
+	int block, last = (int)((end - 1) / TSF_DECODE_BLOCK);
+	tsf_decoder_lock(d);
+	for (block = (int)(start / TSF_DECODE_BLOCK); block <= last; block++)
+		if (!--d->blocks[block].pins && d->blocks[block].state == TSF_BLOCK_RESIDENT) tsf_decoder_lru_append(d, block);
+	tsf_decoder_trim(d, -1);
+	tsf_decoder_unlock(d);
+}
+
+static unsigned int tsf_decoder_resident(struct tsf_decoder* d)
+{
+	unsigned int res;
+	tsf_decoder_lock(d);
+	res = (unsigned int)d->residentNum * TSF_DECODE_BLOCK;
+	tsf_decoder_unlock(d);
+	return (res < d->sampleCount ? res : d->sampleCount);
+}
+
+#ifndef TSF_NO_THREADS
+static TSF_THREAD_RESULT tsf_decoder_thread(void* data)
+{
+	struct tsf_decoder* d = (struct tsf_decoder*)data;
+	TSF_POOL_LOCK(d);
+	for (;;)
+	{
+		int block;
+		while (d->queueRead == d->queueWrite && !d->quit) TSF_POOL_WAIT(d, start);
+		if (d->quit) break;
+		block = d->queue[d->queueRead];
+		d->queueRead = (d->queueRead == d->blockNum ? 0 : d->queueRead + 1);
+		d->blocks[block].queued = TSF_FALSE;
+		if (d->blocks[block].state == TSF_BLOCK_EMPTY) tsf_decoder_decode(d, block);
+	}
+	TSF_POOL_UNLOCK(d);
+	return 0;
+}
+#endif
+
+static void tsf_decoder_free(struct tsf_decoder* d)
+{
+	if (!d) return;
+	#ifndef TSF_NO_THREADS
+	if (d->started)
+	{
+		TSF_POOL_LOCK(d);
+		d->quit = 1;
+		TSF_POOL_WAKEALL(d, start);
+		TSF_POOL_UNLOCK(d);
+		#if defined(_WIN32)
+		WaitForSingleObject(d->thread, INFINITE);
+		CloseHandle(d->thread);
+		#else
+		pthread_join(d->thread, TSF_NULL);
+		#endif
+	}
+	#  if defined(_WIN32)
+	DeleteCriticalSection(&d->lock);
+	#  else
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->start);
+	pthread_cond_destroy(&d->done);
+	#  endif
+	#endif
+	#ifndef TSF_NO_STDIO
+	if (d->file) fclose(d->file);
+	#endif
+	if (d->pageMemory) tsf_pages_free(d->pageMemory, d->pageSize);
+	TSF_FREE(d->blocks);
+	TSF_FREE(d->queue);
+	TSF_FREE(d->dataMemory);
+	TSF_FREE(d);
+}
+
+static struct tsf_decoder* tsf_decoder_create(unsigned int sampleCount)
+{
+	struct tsf_decoder* d;
+	tsf_u64 pageSize = ((tsf_u64)sampleCount + TSF_INTERP_PADDING * 2) * sizeof(tsf_sample);
+	int i;
+	// The block count and the padded sample positions have to fit in 32 bits, the pages in size_t
+	if (sampleCount > 0xFFFFFFFFu - TSF_DECODE_BLOCK - TSF_INTERP_PADDING * 2 || pageSize > (size_t)-1) return TSF_NULL;
+	d = (struct tsf_decoder*)TSF_MALLOC(sizeof(struct tsf_decoder));
+	if (!d) return TSF_NULL;
+	TSF_MEMSET(d, 0, sizeof(struct tsf_decoder));
+	#ifndef TSF_NO_THREADS
+	#  if defined(_WIN32)
+	InitializeCriticalSection(&d->lock);
+	InitializeConditionVariable(&d->start);
+	InitializeConditionVariable(&d->done);
+	#  else
+	pthread_mutex_init(&d->lock, TSF_NULL);
+	pthread_cond_init(&d->start, TSF_NULL);
+	pthread_cond_init(&d->done, TSF_NULL);
+	#  endif
+	#endif
+	d->sampleCount = sampleCount;
+	d->blockNum = (int)(((tsf_u64)sampleCount + TSF_DECODE_BLOCK - 1) / TSF_DECODE_BLOCK);
+	d->maxResident = TSF_DECODE_CACHE / (int)(TSF_DECODE_BLOCK * sizeof(tsf_sample));
+	d->headNum = TSF_DECODE_HEAD;
+	d->lruFirst = d->lruLast = -1;
+	d->blocks = (struct tsf_decode_block*)TSF_MALLOC((d->blockNum + 1) * sizeof(struct tsf_decode_block));
+	d->queue = (int*)TSF_MALLOC((d->blockNum + 1) * sizeof(int));
+	d->pageSize = (size_t)pageSize;
+	d->pageMemory = tsf_pages_alloc(d->pageSize);
+	if (!d->blocks || !d->queue || !d->pageMemory) { tsf_decoder_free(d); return TSF_NULL; }
+	d->samples = (tsf_sample*)d->pageMemory + TSF_INTERP_PADDING;
+	for (i = 0; i <= d->blockNum; i++)
+	{
+		d->blocks[i].pins = 0;
+		d->blocks[i].lruPrev = d->blocks[i].lruNext = -1;
+		d->blocks[i].state = (i == d->blockNum ? TSF_BLOCK_RESIDENT : TSF_BLOCK_EMPTY); // the end is never played
+		d->blocks[i].queued = TSF_FALSE;
+	}
+	#ifndef TSF_NO_THREADS
+	// Without the thread the blocks that would be queued get decoded right away
+	#  if defined(_WIN32)
+	d->thread = CreateThread(TSF_NULL, 0, (LPTHREAD_START_ROUTINE)tsf_decoder_thread, d, 0, TSF_NULL);
+	d->started = (d->thread != TSF_NULL);
+	#  else
+	d->started = !pthread_create(&d->thread, TSF_NULL, tsf_decoder_thread, d);
+	#  endif
+	#endif
+	return d;
+}
+
+static int tsf_load_samples_compressed(tsf_sample** fontSamples, unsigned int* fontSampleCount, struct tsf_decoder** decoder, struct tsf_riffchunk *chunk, struct tsf_stream* stream, struct tsf_stream_memory* nocopy)
+{
+	// Read the block table of a tsfc chunk and the compressed blocks (used in place when loading with
+	// tsf_load_memory_nocopy), the samples get decoded when they are played
+	struct tsf_decoder* d;
+	tsf_u32 header[2], tableSize, dataSize, *offsets;
+	int i;
+	if (chunk->size < sizeof(header) || stream->read(stream->data, header, sizeof(header)) != (int)sizeof(header)) return 0;
+	if (header[1] != TSF_DECODE_BLOCK || !header[0] || ((tsf_u64)header[0] + TSF_DECODE_BLOCK - 1) / TSF_DECODE_BLOCK >= (chunk->size - sizeof(header)) / sizeof(tsf_u32)) return 0;
+	d = tsf_decoder_create(header[0]);
+	if (!d) return 0;
+	// If we ever need to compile for big-endian platforms, we'll need to byte-swap here.
+	offsets = (tsf_u32*)d->queue; // the queue is still empty, read the block table into it
+	tableSize = (d->blockNum + 1) * sizeof(tsf_u32);
+	dataSize = chunk->size - sizeof(header) - tableSize;
+	if (stream->read(stream->data, offsets, tableSize) != (int)tableSize) goto fail;
+	for (i = 0; i <= d->blockNum; i++)
+	{
+		if (offsets[i] > dataSize || (i && offsets[i] < offsets[i - 1])) goto fail;
+		d->blocks[i].offset = offsets[i];
+	}
+	if (nocopy)
+	{
+		d->data = (const unsigned char*)nocopy->buffer + nocopy->pos;
+		if (!stream->skip(stream->data, dataSize)) goto fail;
+	}
+	else
+	{
+		d->dataMemory = (unsigned char*)TSF_MALLOC(dataSize ? dataSize : 1);
+		if (!d->dataMemory || stream->read(stream->data, d->dataMemory, dataSize) != (int)dataSize) goto fail;
+		d->data = d->dataMemory;
+	}
+	*fontSamples = d->samples;
+	*fontSampleCount = header[0];
+	*decoder = d;
+	return 1;
+	fail:
+	tsf_decoder_free(d);
+	return 0;
+}
 
-	if (dynamicLowpass) tmpInitialFilterFc = (float)region->initialFilterFc, tmpModLfoToFilterFc = (float)region->modLfoToFilterFc, tmpModEnvToFilterFc = (float)region->modEnvToFilterFc;
-	else tmpInitialFilterFc = 0, tmpModLfoToFilterFc = 0, tmpModEnvToFilterFc = 0;
+#ifndef TSF_NO_STDIO
+static int tsf_load_samples_streaming(tsf_sample** fontSamples, unsigned int* fontSampleCount, struct tsf_decoder** decoder, struct tsf_riffchunk *chunk, struct tsf_stream* stream, FILE* file)
+{
+	// Only note where the smpl chunk is in the file, the samples get read when they are played
+	struct tsf_decoder* d;
+	tsf_u64 offset;
+	if (!tsf_file_tell(file, &offset) || !(d = tsf_decoder_create(chunk->size / sizeof(short)))) return 0;
+	if (!stream->skip(stream->data, chunk->size)) { tsf_decoder_free(d); return 0; }
+	d->file = file;
+	d->fileOffset = offset;
+	d->headNum = 0;
+	*fontSamples = d->samples;
+	*fontSampleCount = d->sampleCount;
+	*decoder = d;
+	return 1;
+}
 
-	if (dynamicPitchRatio) pitchRatio = 0, tmpModLfoToPitch = (float)region->modLfoToPitch, tmpVibLfoToPitch = (float)region->vibLfoToPitch, tmpModEnvToPitch = (float)region->modEnvToPitch;
-	else pitchRatio = tsf_timecents2Secsd(v->pitchInputTimecents) * v->pitchOutputFactor, tmpModLfoToPitch = 0, tmpVibLfoToPitch = 0, tmpModEnvToPitch = 0;
+static void tsf_load_samples_streaming_heads(struct tsf_residency* r, unsigned int headNum)
+{
+	// Read the head of each sample header and keep it, so voices can start without waiting for the file
+	int i;
+	for (i = 0; i != r->rangeNum; i++)
+	{
+		unsigned int start = r->ranges[i].start, end = r->ranges[i].end;
+		if (start >= end || !headNum) continue;
+		if (end - start > headNum) end = start + headNum;
+		tsf_decoder_fetch(r->decoder, start, end, start, end, TSF_TRUE);
+	}
+}
+#endif
 
-	if (dynamicGain) tmpModLfoToVolume = (float)region->modLfoToVolume * 0.1f;
-	else noteGain = tsf_decibelsToGain(v->noteGainDB), tmpModLfoToVolume = 0;
 
-	while (numSamples)
+TSFDEF void* tsf_compress_memory(const void* buffer, int size, int* compressed_size)
+{
+	// Copy all chunks and replace the smpl chunk (and the sm24 chunk with the extra 8 bits) of the sdta list by a tsfc chunk
+	const unsigned char *in = (const unsigned char*)buffer, *inEnd, *chunk, *sub, *subEnd, *smpl = TSF_NULL;
+	unsigned char *res, *out, *list, *tsfc, *table, *data;
+	tsf_u32 chunkSize, subSize, smplSize = 0, sampleCount, blockNum, block, i;
+	short samples[TSF_DECODE_BLOCK];
+	if (size < 12 || !tsf_riff_id(in, "RIFF") || !tsf_riff_id(in + 8, "sfbk")) return TSF_NULL;
+	inEnd = in + 8 + (tsf_riff_get32(in + 4) < (tsf_u32)size - 8 ? tsf_riff_get32(in + 4) : (tsf_u32)size - 8);
+	for (chunk = in + 12; inEnd - chunk >= 8; chunk += 8 + chunkSize)
 	{
-		float gainMono, gainLeft, gainRight;
-		int blockSamples = (numSamples > TSF_RENDER_EFFECTSAMPLEBLOCK ? TSF_RENDER_EFFECTSAMPLEBLOCK : numSamples);
-		numSamples -= blockSamples;
+		chunkSize = tsf_riff_get32(chunk + 4);
+		if (chunkSize > (tsf_u32)(inEnd - chunk - 8)) return TSF_NULL;
+		if (!tsf_riff_id(chunk, "LIST") || chunkSize < 4 || !tsf_riff_id(chunk + 8, "sdta")) continue;
+		for (sub = chunk + 12, subEnd = chunk + 8 + chunkSize; subEnd - sub >= 8; sub += 8 + subSize)
+		{
+			subSize = tsf_riff_get32(sub + 4);
+			if (subSize > (tsf_u32)(subEnd - sub - 8)) return TSF_NULL;
+			if (tsf_riff_id(sub, "smpl") && !smpl) { smpl = sub + 8; smplSize = subSize; }
+		}
+	}
+	sampleCount = smplSize / sizeof(short);
+	if (!sampleCount) return TSF_NULL;
+	blockNum = (sampleCount + TSF_DECODE_BLOCK - 1) / TSF_DECODE_BLOCK;
 
-		if (dynamicLowpass)
+	// Each sample point takes at most TSF_DECODE_ESCAPE + 18 bits
+	res = (unsigned char*)TSF_MALLOC(size + 16 + (blockNum + 1) * 4 + blockNum * (1 + (TSF_DECODE_BLOCK * (TSF_DECODE_ESCAPE + 18) + 7) / 8) + 1);
+	if (!res) return TSF_NULL;
+	TSF_MEMCPY(res, in, 12);
+	for (out = res + 12, chunk = in + 12; inEnd - chunk >= 8; chunk += 8 + chunkSize)
+	{
+		chunkSize = tsf_riff_get32(chunk + 4);
+		if (!tsf_riff_id(chunk, "LIST") || chunkSize < 4 || !tsf_riff_id(chunk + 8, "sdta"))
 		{
-			float fres = tmpInitialFilterFc + v->modlfo.level * tmpModLfoToFilterFc + v->modenv.level * tmpModEnvToFilterFc;
-			float lowpassFc = (fres <= 13500 ? tsf_cents2Hertz(fres) / tmpSampleRate : 1.0f);
-			tmpLowpass.active = (lowpassFc < 0.499f);
-			if (tmpLowpass.active) tsf_voice_lowpass_setup(&tmpLowpass, lowpassFc);
+			TSF_MEMCPY(out, chunk, 8 + chunkSize);
+			out += 8 + chunkSize;
+			continue;
+		}
+		list = out;
+		TSF_MEMCPY(out, chunk, 12);
+		out += 12;
+		for (sub = chunk + 12, subEnd = chunk + 8 + chunkSize; subEnd - sub >= 8; sub += 8 + subSize)
+		{
+			subSize = tsf_riff_get32(sub + 4);
+			if (tsf_riff_id(sub, "sm24")) continue;
+			if (sub + 8 != smpl)
+			{
+				TSF_MEMCPY(out, sub, 8 + subSize);
+				out += 8 + subSize;
+				continue;
+			}
+			tsfc = out;
+			TSF_MEMCPY(tsfc, "tsfc", 4);
+			tsf_riff_put32(tsfc + 8, sampleCount);
+			tsf_riff_put32(tsfc + 12, TSF_DECODE_BLOCK);
+			table = tsfc + 16;
+			data = out = table + (blockNum + 1) * 4;
+			for (block = 0; block != blockNum; block++)
+			{
+				tsf_u32 first = block * TSF_DECODE_BLOCK, count = (sampleCount - first < TSF_DECODE_BLOCK ? sampleCount - first : TSF_DECODE_BLOCK);
+				for (i = 0; i != count; i++) samples[i] = (short)(smpl[(first + i) * 2] | (smpl[(first + i) * 2 + 1] << 8));
+				tsf_riff_put32(table + block * 4, (tsf_u32)(out - data));
+				out = tsf_encode_block(samples, (int)count, out);
+			}
+			tsf_riff_put32(table + blockNum * 4, (tsf_u32)(out - data));
+			if ((out - tsfc) & 1) *out++ = 0; // keep the chunk size even
+			tsf_riff_put32(tsfc + 4, (tsf_u32)(out - tsfc - 8));
 		}
+		tsf_riff_put32(list + 4, (tsf_u32)(out - list - 8));
+	}
+	tsf_riff_put32(res + 4, (tsf_u32)(out - res - 8));
+	*compressed_size = (int)(out - res);
+	return TSF_REALLOC(res, out - res);
+}
 
-		if (dynamicPitchRatio)
-			pitchRatio = tsf_timecents2Secsd(v->pitchInputTimecents + (v->modlfo.level * tmpModLfoToPitch + v->viblfo.level * tmpVibLfoToPitch + v->modenv.level * tmpModEnvToPitch)) * v->pitchOutputFactor;
 
-		if (dynamicGain)
-			noteGain = tsf_decibelsToGain(v->noteGainDB + (v->modlfo.level * tmpModLfoToVolume));
+// The pdta sub-chunks in the order of the file, each level of headers (presets and instruments) is followed
+// by its bags, modulators and generators
+enum { TSF_STRIP_PHDR, TSF_STRIP_PBAG, TSF_STRIP_PMOD, TSF_STRIP_PGEN, TSF_STRIP_INST, TSF_STRIP_IBAG, TSF_STRIP_IMOD, TSF_STRIP_IGEN, TSF_STRIP_SHDR, TSF_STRIP_CHUNKS };
+static const char tsf_strip_names[] = "phdrpbagpmodpgeninstibagimodigenshdr";
+static const unsigned char tsf_strip_sizes[TSF_STRIP_CHUNKS] = { 38, 4, 10, 4, 22, 4, 10, 4, 46 };
+#define TSF_STRIP_RECORD(s, chunk, i) ((s)->records[chunk] + (size_t)(i) * tsf_strip_sizes[chunk])
 
-		gainMono = noteGain * v->ampenv.level;
+struct tsf_strip
+{
+	const unsigned char* records[TSF_STRIP_CHUNKS];
+	tsf_u32 num[TSF_STRIP_CHUNKS], keptNum[TSF_STRIP_CHUNKS]; // records including the terminal one
+	int* kept[TSF_STRIP_CHUNKS]; // 0 for the headers and bags to keep and then their new index, -1 if left out
+	tsf_u32 *sampleStart, *sampleEnd; // sample points copied of each kept sample header
+};
 
-		// Update EG.
-		tsf_voice_envelope_process(&v->ampenv, blockSamples, tmpSampleRate);
-		if (updateModEnv) tsf_voice_envelope_process(&v->modenv, blockSamples, tmpSampleRate);
+static TSF_BOOL tsf_strip_list(const struct tsf_strip* s, int chunk, tsf_u32 i, int field, int listChunk, tsf_u32* first, tsf_u32* end)
+{
+	// Get the range of records in listChunk that record i refers to (with the next record), false if broken
+	*first = tsf_riff_get16(TSF_STRIP_RECORD(s, chunk, i) + field);
+	*end = tsf_riff_get16(TSF_STRIP_RECORD(s, chunk, i + 1) + field);
+	if (*first <= *end && *end < s->num[listChunk]) return TSF_TRUE;
+	*first = *end = 0;
+	return TSF_FALSE;
+}
 
-		// Update LFOs.
-		if (updateModLFO) tsf_voice_lfo_process(&v->modlfo, blockSamples);
-		if (updateVibLFO) tsf_voice_lfo_process(&v->viblfo, blockSamples);
+static TSF_BOOL tsf_strip_plays(const unsigned char* izone, const unsigned char* pzone, const struct tsf_strip_range* ranges, const int* rangePhdrs, int rangeNum, int phdr)
+{
+	// Does the region made of an instrument zone in a preset zone play in one of the ranges kept of the preset
+	int lokey = (izone[0] > pzone[0] ? izone[0] : pzone[0]), hikey = (izone[1] < pzone[1] ? izone[1] : pzone[1]);
+	int lovel = (izone[2] > pzone[2] ? izone[2] : pzone[2]), hivel = (izone[3] < pzone[3] ? izone[3] : pzone[3]);
+	int i;
+	for (i = 0; i != rangeNum; i++)
+		if (rangePhdrs[i] == phdr && lokey <= ranges[i].hikey && hikey >= ranges[i].lokey && lovel <= ranges[i].hivel && hivel >= ranges[i].lovel)
+			return TSF_TRUE;
+	return TSF_FALSE;
+}
 
-		switch (f->outputmode)
+static void tsf_strip_reach(struct tsf_strip* s, int phdr, const struct tsf_strip_range* ranges, const int* rangePhdrs, int rangeNum)
+{
+	// Mark the zones, instruments and samples of a preset that play in its ranges, following the zones
+	// the same way tsf_load_presets turns them into regions
+	enum { GenInstrument = 41, GenKeyRange = 43, GenVelRange = 44, GenSampleID = 53 };
+	unsigned char pglobal[4] = { 0, 127, 0, 127 };
+	tsf_u32 pbag, pbagFirst, pbagEnd, pgen, pgenEnd, ibag, ibagFirst, ibagEnd, igen, igenEnd;
+	tsf_strip_list(s, TSF_STRIP_PHDR, (tsf_u32)phdr, 24, TSF_STRIP_PBAG, &pbagFirst, &pbagEnd);
+	for (pbag = pbagFirst; pbag != pbagEnd; pbag++)
+	{
+		unsigned char pzone[4];
+		TSF_BOOL hadInstrument = TSF_FALSE;
+		TSF_MEMCPY(pzone, pglobal, sizeof(pzone));
+		tsf_strip_list(s, TSF_STRIP_PBAG, pbag, 0, TSF_STRIP_PGEN, &pgen, &pgenEnd);
+		for (; pgen != pgenEnd; pgen++)
 		{
-			case TSF_STEREO_INTERLEAVED:
-				gainLeft = gainMono * v->panFactorLeft, gainRight = gainMono * v->panFactorRight;
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
+			const unsigned char* g = TSF_STRIP_RECORD(s, TSF_STRIP_PGEN, pgen);
+			unsigned char iglobal[4] = { 0, 127, 0, 127 };
+			tsf_u32 oper = tsf_riff_get16(g), inst = tsf_riff_get16(g + 2);
+			if (oper == GenKeyRange) { pzone[0] = g[2]; pzone[1] = g[3]; continue; }
+			if (oper == GenVelRange) { pzone[2] = g[2]; pzone[3] = g[3]; continue; }
+			if (oper != GenInstrument || inst >= s->num[TSF_STRIP_INST] - 1) continue;
+			hadInstrument = TSF_TRUE;
+			tsf_strip_list(s, TSF_STRIP_INST, inst, 20, TSF_STRIP_IBAG, &ibagFirst, &ibagEnd);
+			for (ibag = ibagFirst; ibag != ibagEnd; ibag++)
+			{
+				unsigned char izone[4];
+				TSF_BOOL hadSample = TSF_FALSE;
+				TSF_MEMCPY(izone, iglobal, sizeof(izone));
+				tsf_strip_list(s, TSF_STRIP_IBAG, ibag, 0, TSF_STRIP_IGEN, &igen, &igenEnd);
+				for (; igen != igenEnd; igen++)
 				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
-
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
-
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
-
-					*outL++ += val * gainLeft;
-					*outL++ += val * gainRight;
-
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
+					const unsigned char* h = TSF_STRIP_RECORD(s, TSF_STRIP_IGEN, igen);
+					tsf_u32 ioper = tsf_riff_get16(h), sample = tsf_riff_get16(h + 2);
+					if (ioper == GenKeyRange) { izone[0] = h[2]; izone[1] = h[3]; continue; }
+					if (ioper == GenVelRange) { izone[2] = h[2]; izone[3] = h[3]; continue; }
+					if (ioper != GenSampleID) continue;
+					if (izone[1] < pzone[0] || izone[0] > pzone[1] || izone[3] < pzone[2] || izone[2] > pzone[3]) continue;
+					hadSample = TSF_TRUE;
+					if (sample >= s->num[TSF_STRIP_SHDR] - 1 || !tsf_strip_plays(izone, pzone, ranges, rangePhdrs, rangeNum, phdr)) continue;
+					s->kept[TSF_STRIP_PBAG][pbag] = s->kept[TSF_STRIP_INST][inst] = s->kept[TSF_STRIP_IBAG][ibag] = s->kept[TSF_STRIP_SHDR][sample] = 0;
 				}
-				break;
-
-			case TSF_STEREO_UNWEAVED:
-				gainLeft = gainMono * v->panFactorLeft, gainRight = gainMono * v->panFactorRight;
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
-				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
-
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
-
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
-
-					*outL++ += val * gainLeft;
-					*outR++ += val * gainRight;
+				if (ibag == ibagFirst && !hadSample) TSF_MEMCPY(iglobal, izone, sizeof(iglobal));
+			}
+		}
+		if (pbag == pbagFirst && !hadInstrument)
+		{
+			TSF_MEMCPY(pglobal, pzone, sizeof(pglobal));
+			s->kept[TSF_STRIP_PBAG][pbag] = 0; // global zone
+		}
+	}
+}
 
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
-				}
-				break;
+static void tsf_strip_count(struct tsf_strip* s, int hdr, int bagField)
+{
+	// Number the kept headers and bags of a level and count its records in the stripped SoundFont
+	tsf_u32 i, bag, bagEnd, first, end;
+	for (i = 0; i != 4; i++) s->keptNum[hdr + i] = 1;
+	for (i = 0; i + 1 < s->num[hdr]; i++)
+	{
+		if (s->kept[hdr][i] < 0) continue;
+		s->kept[hdr][i] = (int)s->keptNum[hdr]++ - 1;
+		tsf_strip_list(s, hdr, i, bagField, hdr + 1, &bag, &bagEnd);
+		for (; bag != bagEnd; bag++)
+		{
+			if (s->kept[hdr + 1][bag] < 0) continue;
+			s->kept[hdr + 1][bag] = (int)s->keptNum[hdr + 1]++ - 1;
+			if (tsf_strip_list(s, hdr + 1, bag, 2, hdr + 2, &first, &end)) s->keptNum[hdr + 2] += end - first;
+			if (tsf_strip_list(s, hdr + 1, bag, 0, hdr + 3, &first, &end)) s->keptNum[hdr + 3] += end - first;
+		}
+	}
+}
 
-			case TSF_MONO:
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
+static unsigned char* tsf_strip_write(const struct tsf_strip* s, int hdr, int bagField, tsf_u32 refOper, int refChunk, unsigned char* out)
+{
+	// Write the 4 sub-chunks of a level with the kept records, the headers and generators get the new indices
+	unsigned char *hdrs = out + 8, *bags = hdrs + s->keptNum[hdr] * tsf_strip_sizes[hdr] + 8;
+	unsigned char *mods = bags + s->keptNum[hdr + 1] * tsf_strip_sizes[hdr + 1] + 8;
+	unsigned char *gens = mods + s->keptNum[hdr + 2] * tsf_strip_sizes[hdr + 2] + 8;
+	tsf_u32 i, bag, bagEnd, j, jEnd, bagNum = 0, modNum = 0, genNum = 0;
+	for (i = 0; i != 4; i++)
+	{
+		TSF_MEMCPY(out, tsf_strip_names + (hdr + i) * 4, 4);
+		tsf_riff_put32(out + 4, s->keptNum[hdr + i] * tsf_strip_sizes[hdr + i]);
+		out += 8 + s->keptNum[hdr + i] * tsf_strip_sizes[hdr + i];
+	}
+	for (i = 0; i + 1 < s->num[hdr]; i++)
+	{
+		if (s->kept[hdr][i] < 0) continue;
+		TSF_MEMCPY(hdrs, TSF_STRIP_RECORD(s, hdr, i), tsf_strip_sizes[hdr]);
+		tsf_riff_put16(hdrs + bagField, bagNum);
+		hdrs += tsf_strip_sizes[hdr];
+		tsf_strip_list(s, hdr, i, bagField, hdr + 1, &bag, &bagEnd);
+		for (; bag != bagEnd; bag++)
+		{
+			if (s->kept[hdr + 1][bag] < 0) continue;
+			tsf_riff_put16(bags, genNum);
+			tsf_riff_put16(bags + 2, modNum);
+			bags += 4;
+			bagNum++;
+			if (tsf_strip_list(s, hdr + 1, bag, 2, hdr + 2, &j, &jEnd))
+				for (; j != jEnd; j++, modNum++, mods += 10) TSF_MEMCPY(mods, TSF_STRIP_RECORD(s, hdr + 2, j), 10);
+			if (tsf_strip_list(s, hdr + 1, bag, 0, hdr + 3, &j, &jEnd))
+				for (; j != jEnd; j++, genNum++, gens += 4)
 				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
+					tsf_u32 ref;
+					TSF_MEMCPY(gens, TSF_STRIP_RECORD(s, hdr + 3, j), 4);
+					if (tsf_riff_get16(gens) != refOper) continue;
+					ref = tsf_riff_get16(gens + 2);
+					tsf_riff_put16(gens + 2, (ref + 1 < s->num[refChunk] && s->kept[refChunk][ref] >= 0 ? (tsf_u32)s->kept[refChunk][ref] : 0xFFFF));
+				}
+		}
+	}
+	// Terminal records
+	TSF_MEMCPY(hdrs, TSF_STRIP_RECORD(s, hdr, s->num[hdr] - 1), tsf_strip_sizes[hdr]);
+	tsf_riff_put16(hdrs + bagField, bagNum);
+	tsf_riff_put16(bags, genNum);
+	tsf_riff_put16(bags + 2, modNum);
+	TSF_MEMSET(mods, 0, 10);
+	TSF_MEMSET(gens, 0, 4);
+	return out;
+}
 
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
+TSFDEF void* tsf_strip_memory(const void* buffer, int size, const struct tsf_strip_range* ranges, int range_count, int* stripped_size)
+{
+	// Load the SoundFont for its regions, mark the zones reached by the ranges in the raw pdta records
+	// and copy what is kept with the sample data each kept sample header uses (plus the silence after it)
+	enum { SampleGap = 46 };
+	const unsigned char *in = (const unsigned char*)buffer, *inEnd, *chunk, *sub, *subEnd, *smpl = TSF_NULL;
+	unsigned char *res = TSF_NULL, *out;
+	tsf_u32 chunkSize, subSize, smplNum = 0, otherSize = 0, pdtaSize, sampleNum, i;
+	struct tsf_strip s;
+	int *rangePhdrs = TSF_NULL, r, c;
+	tsf* f = TSF_NULL;
+
+	TSF_MEMSET(&s, 0, sizeof(s));
+	if (size < 12 || !tsf_riff_id(in, "RIFF") || !tsf_riff_id(in + 8, "sfbk")) return TSF_NULL;
+	inEnd = in + 8 + (tsf_riff_get32(in + 4) < (tsf_u32)size - 8 ? tsf_riff_get32(in + 4) : (tsf_u32)size - 8);
+	for (chunk = in + 12; inEnd - chunk >= 8; chunk += 8 + chunkSize)
+	{
+		chunkSize = tsf_riff_get32(chunk + 4);
+		if (chunkSize > (tsf_u32)(inEnd - chunk - 8)) return TSF_NULL;
+		if (!tsf_riff_id(chunk, "LIST") || chunkSize < 4 || (!tsf_riff_id(chunk + 8, "sdta") && !tsf_riff_id(chunk + 8, "pdta"))) { otherSize += 8 + chunkSize; continue; }
+		for (sub = chunk + 12, subEnd = chunk + 8 + chunkSize; subEnd - sub >= 8; sub += 8 + subSize)
+		{
+			subSize = tsf_riff_get32(sub + 4);
+			if (subSize > (tsf_u32)(subEnd - sub - 8)) return TSF_NULL;
+			if (tsf_riff_id(sub, "smpl") && !smpl) { smpl = sub + 8; smplNum = subSize / sizeof(short); }
+			for (c = 0; c != TSF_STRIP_CHUNKS; c++)
+				if (tsf_riff_id(sub, tsf_strip_names + c * 4) && !s.records[c] && subSize && !(subSize % tsf_strip_sizes[c]))
+					s.records[c] = sub + 8, s.num[c] = subSize / tsf_strip_sizes[c];
+		}
+	}
+	for (c = 0; c != TSF_STRIP_CHUNKS; c++) if (!s.records[c]) return TSF_NULL;
+	if (!smpl || s.num[TSF_STRIP_PHDR] > 0x10000 || s.num[TSF_STRIP_INST] > 0x10000 || s.num[TSF_STRIP_SHDR] > 0x10000) return TSF_NULL;
 
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
+	f = tsf_load_memory_nocopy(buffer, size);
+	rangePhdrs = (int*)TSF_MALLOC((range_count > 0 ? range_count : 1) * sizeof(int));
+	for (c = 0; c != TSF_STRIP_CHUNKS; c++)
+	{
+		s.kept[c] = (int*)TSF_MALLOC(s.num[c] * sizeof(int));
+		if (s.kept[c]) TSF_MEMSET(s.kept[c], 0xFF, s.num[c] * sizeof(int)); // all -1
+		else goto done;
+	}
+	s.sampleStart = (tsf_u32*)TSF_MALLOC(s.num[TSF_STRIP_SHDR] * sizeof(tsf_u32));
+	s.sampleEnd = (tsf_u32*)TSF_MALLOC(s.num[TSF_STRIP_SHDR] * sizeof(tsf_u32));
+	if (!f || !rangePhdrs || !s.sampleStart || !s.sampleEnd) goto done;
 
-					*outL++ += val * gainMono;
+	// Find the preset header of each range, presets with the same bank and number are in the order of the headers
+	for (r = 0; r != range_count; r++)
+	{
+		int index = ranges[r].preset_index, same = 0, j;
+		if (index < 0 || index >= f->bank->presetNum) goto done;
+		for (j = 0; j != index; j++) if (f->bank->presets[j].bank == f->bank->presets[index].bank && f->bank->presets[j].preset == f->bank->presets[index].preset) same++;
+		for (rangePhdrs[r] = 0; rangePhdrs[r] + 1 < (int)s.num[TSF_STRIP_PHDR]; rangePhdrs[r]++)
+		{
+			const unsigned char* phdr = TSF_STRIP_RECORD(&s, TSF_STRIP_PHDR, rangePhdrs[r]);
+			if (tsf_riff_get16(phdr + 22) == f->bank->presets[index].bank && tsf_riff_get16(phdr + 20) == f->bank->presets[index].preset && !same--) break;
+		}
+		s.kept[TSF_STRIP_PHDR][rangePhdrs[r]] = 0;
+	}
+	for (i = 0; i + 1 < s.num[TSF_STRIP_PHDR]; i++)
+		if (!s.kept[TSF_STRIP_PHDR][i]) tsf_strip_reach(&s, (int)i, ranges, rangePhdrs, range_count);
+	for (i = 0; i + 1 < s.num[TSF_STRIP_INST]; i++)
+	{
+		// Keep the first zone of an instrument even if it isn't reached, tsf_load_presets can take it as the global zone
+		tsf_u32 ibag, ibagEnd, igen, igenEnd;
+		if (s.kept[TSF_STRIP_INST][i] < 0 || !tsf_strip_list(&s, TSF_STRIP_INST, i, 20, TSF_STRIP_IBAG, &ibag, &ibagEnd) || ibag == ibagEnd) continue;
+		s.kept[TSF_STRIP_IBAG][ibag] = 0;
+		tsf_strip_list(&s, TSF_STRIP_IBAG, ibag, 0, TSF_STRIP_IGEN, &igen, &igenEnd);
+		for (; igen != igenEnd; igen++)
+		{
+			const unsigned char* g = TSF_STRIP_RECORD(&s, TSF_STRIP_IGEN, igen);
+			if (tsf_riff_get16(g) == 53 && tsf_riff_get16(g + 2) + 1 < s.num[TSF_STRIP_SHDR]) s.kept[TSF_STRIP_SHDR][tsf_riff_get16(g + 2)] = 0;
+		}
+	}
 
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
-				}
-				break;
+	// The sample points of each kept sample header and the ones its regions play, with room for the interpolation taps
+	for (i = 0; i + 1 < s.num[TSF_STRIP_SHDR]; i++)
+	{
+		const unsigned char* shdr = TSF_STRIP_RECORD(&s, TSF_STRIP_SHDR, i);
+		s.sampleStart[i] = tsf_riff_get32(shdr + 20);
+		s.sampleEnd[i] = tsf_riff_get32(shdr + 24);
+		if (s.sampleEnd[i] < s.sampleStart[i]) s.sampleEnd[i] = s.sampleStart[i];
+	}
+	for (r = 0; r != range_count; r++)
+	{
+		const struct tsf_preset* preset = &f->bank->presets[ranges[r].preset_index];
+		const struct tsf_region* region;
+		for (region = preset->regions; region != preset->regions + preset->regionNum; region++)
+		{
+			tsf_u32 start = region->offset, end = region->end;
+			if (region->sample < 0 || region->sample + 1 >= (int)s.num[TSF_STRIP_SHDR] || s.kept[TSF_STRIP_SHDR][region->sample] < 0) continue;
+			if (region->lokey > ranges[r].hikey || region->hikey < ranges[r].lokey || region->lovel > ranges[r].hivel || region->hivel < ranges[r].lovel) continue;
+			if (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end)
+			{
+				if (region->loop_start < start) start = region->loop_start;
+				if (region->loop_end + 1 > end) end = region->loop_end + 1;
+			}
+			if (start < s.sampleStart[region->sample]) s.sampleStart[region->sample] = start;
+			if (end > s.sampleEnd[region->sample]) s.sampleEnd[region->sample] = end;
 		}
+	}
+	for (i = 0, sampleNum = 0; i + 1 < s.num[TSF_STRIP_SHDR]; i++)
+	{
+		if (s.kept[TSF_STRIP_SHDR][i] < 0) continue;
+		s.sampleStart[i] = (s.sampleStart[i] > TSF_INTERP_PADDING ? s.sampleStart[i] - TSF_INTERP_PADDING : 0);
+		s.sampleEnd[i] = (s.sampleEnd[i] + TSF_INTERP_PADDING < smplNum ? s.sampleEnd[i] + TSF_INTERP_PADDING : smplNum);
+		if (s.sampleStart[i] > s.sampleEnd[i]) s.sampleStart[i] = s.sampleEnd[i];
+		sampleNum += s.sampleEnd[i] - s.sampleStart[i] + SampleGap;
+	}
 
-		if (tmpSourceSamplePosition >= tmpSampleEndDbl || v->ampenv.segment == TSF_SEGMENT_DONE)
+	tsf_strip_count(&s, TSF_STRIP_PHDR, 24);
+	tsf_strip_count(&s, TSF_STRIP_INST, 20);
+	for (i = 0, s.keptNum[TSF_STRIP_SHDR] = 1; i + 1 < s.num[TSF_STRIP_SHDR]; i++)
+		if (s.kept[TSF_STRIP_SHDR][i] >= 0) s.kept[TSF_STRIP_SHDR][i] = (int)s.keptNum[TSF_STRIP_SHDR]++ - 1;
+	for (c = 0, pdtaSize = 12; c != TSF_STRIP_CHUNKS; c++) pdtaSize += 8 + s.keptNum[c] * tsf_strip_sizes[c];
+	*stripped_size = (int)(12 + otherSize + 20 + sampleNum * sizeof(short) + pdtaSize);
+	res = (unsigned char*)TSF_MALLOC(*stripped_size);
+	if (!res) goto done;
+
+	TSF_MEMCPY(res, in, 12);
+	tsf_riff_put32(res + 4, (tsf_u32)*stripped_size - 8);
+	for (out = res + 12, chunk = in + 12; inEnd - chunk >= 8; chunk += 8 + chunkSize)
+	{
+		chunkSize = tsf_riff_get32(chunk + 4);
+		if (!tsf_riff_id(chunk, "LIST") || chunkSize < 4 || (!tsf_riff_id(chunk + 8, "sdta") && !tsf_riff_id(chunk + 8, "pdta")))
 		{
-			tsf_voice_kill(v);
-			return;
+			TSF_MEMCPY(out, chunk, 8 + chunkSize);
+			out += 8 + chunkSize;
+		}
+		else if (tsf_riff_id(chunk + 8, "sdta"))
+		{
+			// Only the smpl chunk, the 24-bit extension isn't used
+			TSF_MEMCPY(out, "LIST", 4);
+			tsf_riff_put32(out + 4, 12 + sampleNum * sizeof(short));
+			TSF_MEMCPY(out + 8, "sdtasmpl", 8);
+			tsf_riff_put32(out + 16, sampleNum * sizeof(short));
+			for (out += 20, i = 0; i + 1 < s.num[TSF_STRIP_SHDR]; i++)
+			{
+				if (s.kept[TSF_STRIP_SHDR][i] < 0) continue;
+				TSF_MEMCPY(out, smpl + s.sampleStart[i] * sizeof(short), (s.sampleEnd[i] - s.sampleStart[i]) * sizeof(short));
+				out += (s.sampleEnd[i] - s.sampleStart[i]) * sizeof(short);
+				TSF_MEMSET(out, 0, SampleGap * sizeof(short));
+				out += SampleGap * sizeof(short);
+			}
+		}
+		else
+		{
+			tsf_u32 pos = 0;
+			TSF_MEMCPY(out, "LIST", 4);
+			tsf_riff_put32(out + 4, pdtaSize - 8);
+			TSF_MEMCPY(out + 8, "pdta", 4);
+			out = tsf_strip_write(&s, TSF_STRIP_PHDR, 24, 41, TSF_STRIP_INST, out + 12);
+			out = tsf_strip_write(&s, TSF_STRIP_INST, 20, 53, TSF_STRIP_SHDR, out);
+			TSF_MEMCPY(out, "shdr", 4);
+			tsf_riff_put32(out + 4, s.keptNum[TSF_STRIP_SHDR] * 46);
+			for (out += 8, i = 0; i + 1 < s.num[TSF_STRIP_SHDR]; i++)
+			{
+				// Move the sample positions by as much as the copied sample points moved
+				tsf_u32 shift = pos - s.sampleStart[i], link, type, field;
+				if (s.kept[TSF_STRIP_SHDR][i] < 0) continue;
+				TSF_MEMCPY(out, TSF_STRIP_RECORD(&s, TSF_STRIP_SHDR, i), 46);
+				for (field = 20; field != 36; field += 4) tsf_riff_put32(out + field, tsf_riff_get32(out + field) + shift);
+				link = tsf_riff_get16(out + 42);
+				type = tsf_riff_get16(out + 44);
+				if (link + 1 < s.num[TSF_STRIP_SHDR] && s.kept[TSF_STRIP_SHDR][link] >= 0) tsf_riff_put16(out + 42, (tsf_u32)s.kept[TSF_STRIP_SHDR][link]);
+				else { tsf_riff_put16(out + 42, 0); if (type & 14) tsf_riff_put16(out + 44, (type & 0x8000) | 1); } // the other channel was left out, make it mono
+				pos += s.sampleEnd[i] - s.sampleStart[i] + SampleGap;
+				out += 46;
+			}
+			TSF_MEMCPY(out, TSF_STRIP_RECORD(&s, TSF_STRIP_SHDR, s.num[TSF_STRIP_SHDR] - 1), 46);
+			out += 46;
 		}
 	}
 
-	v->sourceSamplePosition = tmpSourceSamplePosition;
-	if (tmpLowpass.active || dynamicLowpass) v->lowpass = tmpLowpass;
+	done:
+	for (c = 0; c != TSF_STRIP_CHUNKS; c++) TSF_FREE(s.kept[c]);
+	TSF_FREE(s.sampleStart);
+	TSF_FREE(s.sampleEnd);
+	TSF_FREE(rangePhdrs);
+	tsf_close(f);
+	return res;
+}
+
+static void tsf_bank_free(struct tsf_bank* b)
+{
+	if (!b) return;
+	if (b->baked) TSF_FREE(b->presets);
+	else
+	{
+		tsf_free_presets(b->presets, b->presetNum);
+		TSF_FREE(b->presetLookup);
+		TSF_FREE(b->loopGuards);
+	}
+	if (b->fontSamples && !b->fontSamplesShared) TSF_FREE(b->fontSamples - TSF_INTERP_PADDING);
+	tsf_residency_free(b->residency);
+	TSF_FREE(b);
+}
+
+static tsf* tsf_create(struct tsf_bank* bank)
+{
+	// A new instance with the default settings playing the bank, which counts it as one more user
+	tsf* res = (tsf*)TSF_MALLOC(sizeof(tsf));
+	if (!res) return TSF_NULL;
+	TSF_MEMSET(res, 0, sizeof(tsf));
+	tsf_statics_init();
+	res->bank = bank;
+	res->outSampleRate = 44100.0f;
+	res->kernels = tsf_select_kernels();
+	res->interpolation = TSF_INTERP_LINEAR;
+	TSF_MEMSET(res->voiceHeads, 0xFF, sizeof(res->voiceHeads)); // all -1
+	TSF_MEMSET(res->stealFirst, 0xFF, sizeof(res->stealFirst)); // all -1
+	TSF_MEMSET(res->stealLast, 0xFF, sizeof(res->stealLast));
+	TSF_ATOMIC_INC(&bank->refCount);
+	return res;
 }
 
 TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 {
+	return tsf_load_stream(stream, TSF_NULL, TSF_FALSE, TSF_NULL, 0);
+}
+
+static tsf* tsf_load_stream(struct tsf_stream* stream, struct tsf_stream_memory* memory, TSF_BOOL nocopy, void* file, unsigned int fileHead)
+{
+	// Load from the stream, memory is its state if it reads from memory (the preset data is then decoded in
+	// place), with nocopy set the sample data is taken from there directly as well.
+	// file is the FILE the stream reads to stream the samples from while playing, keeping fileHead sample
+	// points of each sample header loaded. It gets closed unless the decoder took it.
 	tsf* res = TSF_NULL;
 	struct tsf_riffchunk chunkHead;
 	struct tsf_riffchunk chunkList;
 	struct tsf_hydra hydra;
-	float* fontSamples = TSF_NULL;
+	tsf_sample* fontSamples = TSF_NULL;
 	unsigned int fontSampleCount = 0;
+	TSF_BOOL fontSamplesShared = TSF_FALSE;
+	const short* lazySource = TSF_NULL;
+	struct tsf_bank* bank = TSF_NULL;
+	struct tsf_decoder* decoder = TSF_NULL;
+	unsigned char* chunkBuffer = TSF_NULL; // pdta sub-chunk read from the stream
+	tsf_u32 chunkBufferSize = 0;
 
 	if (!tsf_riffchunk_read(TSF_NULL, &chunkHead, stream) || !TSF_FourCCEquals(chunkHead.id, "sfbk"))
 	{
@@ -1260,10 +4232,12 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 				#define HandleChunk(chunkName) (TSF_FourCCEquals(chunk.id, #chunkName) && !(chunk.size % chunkName##SizeInFile)) \
 					{ \
 						int num = chunk.size / chunkName##SizeInFile, i; \
+						const unsigned char* records; \
+						if (!tsf_hydra_chunk(stream, memory, chunk.size, &records, &chunkBuffer, &chunkBufferSize)) goto out_of_memory; \
 						hydra.chunkName##Num = num; \
 						hydra.chunkName##s = (struct tsf_hydra_##chunkName*)TSF_MALLOC(num * sizeof(struct tsf_hydra_##chunkName)); \
 						if (!hydra.chunkName##s) goto out_of_memory; \
-						for (i = 0; i < num; ++i) tsf_hydra_read_##chunkName(&hydra.chunkName##s[i], stream); \
+						for (i = 0; i < num; ++i, records += chunkName##SizeInFile) tsf_hydra_read_##chunkName(&hydra.chunkName##s[i], records); \
 					}
 				enum
 				{
@@ -1284,8 +4258,27 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 			{
 				if (TSF_FourCCEquals(chunk.id, "smpl") && !fontSamples && chunk.size >= sizeof(short))
 				{
+					#ifndef TSF_NO_STDIO
+					if (file)
+					{
+						if (!tsf_load_samples_streaming(&fontSamples, &fontSampleCount, &decoder, &chunk, stream, (FILE*)file)) goto out_of_memory;
+						fontSamplesShared = TSF_TRUE; // the sample buffer belongs to the decoder which now owns the file
+						file = TSF_NULL;
+						continue;
+					}
+					#endif
+					#ifdef TSF_SAMPLES_SHORT
+					if (nocopy && tsf_load_samples_nocopy(&fontSamples, &fontSampleCount, &chunk, memory)) { fontSamplesShared = TSF_TRUE; continue; }
+					#else
+					if (nocopy && tsf_load_samples_lazy(&fontSamples, &fontSampleCount, &lazySource, &chunk, memory)) continue;
+					#endif
 					if (!tsf_load_samples(&fontSamples, &fontSampleCount, &chunk, stream)) goto out_of_memory;
 				}
+				else if (TSF_FourCCEquals(chunk.id, "tsfc") && !fontSamples)
+				{
+					if (!tsf_load_samples_compressed(&fontSamples, &fontSampleCount, &decoder, &chunk, stream, (nocopy ? memory : TSF_NULL))) goto out_of_memory;
+					fontSamplesShared = TSF_TRUE; // the sample buffer belongs to the decoder
+				}
 				else stream->skip(stream->data, chunk.size);
 			}
 		}
@@ -1301,91 +4294,320 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 	}
 	else
 	{
-		res = (tsf*)TSF_MALLOC(sizeof(tsf));
+		struct tsf_residency* residency;
+		bank = (struct tsf_bank*)TSF_MALLOC(sizeof(struct tsf_bank));
+		if (!bank) goto out_of_memory;
+		TSF_MEMSET(bank, 0, sizeof(struct tsf_bank));
+		bank->fontSamples = fontSamples;
+		bank->fontSampleCount = fontSampleCount;
+		bank->fontSamplesShared = fontSamplesShared;
+		fontSamples = TSF_NULL; //freed with the bank from here on
+		if (fontSamplesShared || lazySource)
+		{
+			// Samples are loaded when they get played, track which ones are loaded already
+			bank->residency = tsf_residency_create(lazySource, hydra.shdrNum);
+			if (!bank->residency) goto out_of_memory;
+			bank->residency->decoder = decoder;
+			decoder = TSF_NULL;
+		}
+		if (!tsf_load_presets(bank, &hydra, bank->fontSamples, fontSampleCount)) goto out_of_memory;
+		if ((residency = bank->residency) != TSF_NULL)
+		{
+			int i;
+			for (i = 0; i != residency->rangeNum; i++)
+				if (residency->ranges[i].start < residency->ranges[i].end) residency->totalNum += residency->ranges[i].end - residency->ranges[i].start;
+			#ifndef TSF_NO_STDIO
+			if (residency->decoder && residency->decoder->file) tsf_load_samples_streaming_heads(residency, fileHead);
+			#endif
+		}
+		res = tsf_create(bank);
 		if (!res) goto out_of_memory;
-		TSF_MEMSET(res, 0, sizeof(tsf));
-		if (!tsf_load_presets(res, &hydra, fontSampleCount)) goto out_of_memory;
-		res->fontSamples = fontSamples;
-		fontSamples = TSF_NULL; //don't free below
-		res->outSampleRate = 44100.0f;
 	}
 	if (0)
 	{
 		out_of_memory:
-		TSF_FREE(res);
+		tsf_bank_free(bank);
 		res = TSF_NULL;
 		//if (e) *e = TSF_OUT_OF_MEMORY;
 	}
 	TSF_FREE(hydra.phdrs); TSF_FREE(hydra.pbags); TSF_FREE(hydra.pmods);
 	TSF_FREE(hydra.pgens); TSF_FREE(hydra.insts); TSF_FREE(hydra.ibags);
 	TSF_FREE(hydra.imods); TSF_FREE(hydra.igens); TSF_FREE(hydra.shdrs);
-	TSF_FREE(fontSamples);
+	TSF_FREE(chunkBuffer);
+	if (fontSamples && !fontSamplesShared) TSF_FREE(fontSamples - TSF_INTERP_PADDING);
+	tsf_decoder_free(decoder);
+	#ifndef TSF_NO_STDIO
+	if (file) fclose((FILE*)file);
+	#else
+	(void)file; (void)fileHead;
+	#endif
 	return res;
 }
 
-TSFDEF tsf* tsf_copy(tsf* f)
+// A baked image (see tsf_bake) starts with this header, followed by the sections it points to at offsets
+// from the start of the image aligned to TSF_BAKED_ALIGN: the preset table, the regions and key index of
+// each preset, presetLookup, loopGuards, the sample range of each sample header (start and end, see
+// tsf_residency_add) and the sample buffer with TSF_INTERP_PADDING samples of silence on both ends.
+// Regions, key indices and tables are stored as they are in memory, the build checks reject images that
+// wouldn't match. TSF_BAKED_VERSION needs to be raised whenever one of these structures changes.
+#define TSF_BAKED_VERSION 2
+#define TSF_BAKED_ALIGN 16
+#define TSF_BAKED_BYTEORDER 0x01020304
+struct tsf_baked_header
+{
+	tsf_fourcc magic; // "TSFB"
+	tsf_u32 version, byteOrder, sampleSize, regionSize; // build checks
+	tsf_u32 size, presetNum, presetLookupMask, loopGuardNum, rangeNum, fontSampleCount;
+	tsf_u32 presetsOffset, presetLookupOffset, loopGuardsOffset, rangesOffset, samplesOffset;
+};
+struct tsf_baked_preset { tsf_char20 presetName; tsf_u16 preset, bank; tsf_u32 regionNum, regionsOffset, keyIndexOffset; };
+
+static tsf_u32 tsf_bake_section(unsigned char* image, size_t* offset, const void* data, size_t size)
 {
+	// Place a section at the next aligned offset and copy the data into it if the image is allocated already
+	size_t at = (*offset + TSF_BAKED_ALIGN - 1) & ~(size_t)(TSF_BAKED_ALIGN - 1);
+	if (image && data && size) TSF_MEMCPY(image + at, data, size);
+	*offset = at + size;
+	return (tsf_u32)at;
+}
+
+TSFDEF void* tsf_bake(tsf* f, int* baked_size)
+{
+	struct tsf_baked_header h;
+	struct tsf_residency* ranges;
+	struct tsf_decoder* decoder = (f->bank->residency ? f->bank->residency->decoder : TSF_NULL);
+	const short* source = (f->bank->residency ? f->bank->residency->source : TSF_NULL);
+	struct tsf_region *region, *regionEnd;
+	unsigned char* res = TSF_NULL;
+	tsf_sample* samples;
+	tsf_u32* rangeOut;
+	size_t offset;
+	int i, rangeNum = 0, guardNum = 0;
+
+	// Collect the sample ranges by sample header again, a SoundFont loaded with all samples doesn't keep them
+	for (i = 0; i != f->bank->presetNum; i++)
+		for (region = f->bank->presets[i].regions, regionEnd = region + f->bank->presets[i].regionNum; region != regionEnd; region++)
+		{
+			if (region->sample >= rangeNum) rangeNum = region->sample + 1;
+			if (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end) guardNum++;
+		}
+	ranges = tsf_residency_create(TSF_NULL, rangeNum);
+	if (!ranges) return TSF_NULL;
+	for (i = 0; i != f->bank->presetNum; i++)
+		for (region = f->bank->presets[i].regions, regionEnd = region + f->bank->presets[i].regionNum; region != regionEnd; region++)
+			tsf_residency_add(ranges, region, f->bank->fontSampleCount);
+
+	TSF_MEMSET(&h, 0, sizeof(h));
+	TSF_MEMCPY(h.magic, "TSFB", 4);
+	h.version = TSF_BAKED_VERSION;
+	h.byteOrder = TSF_BAKED_BYTEORDER;
+	h.sampleSize = sizeof(tsf_sample);
+	h.regionSize = sizeof(struct tsf_region);
+	h.presetNum = (tsf_u32)f->bank->presetNum;
+	h.presetLookupMask = f->bank->presetLookupMask;
+	h.loopGuardNum = (tsf_u32)guardNum * (TSF_LOOPGUARD_BEFORE + TSF_LOOPGUARD_AFTER);
+	h.rangeNum = (tsf_u32)rangeNum;
+	h.fontSampleCount = f->bank->fontSampleCount;
+
+	// Lay out the sections to get the size, then again to copy them into the allocated image
+	for (;;)
+	{
+		offset = sizeof(h);
+		h.presetsOffset = tsf_bake_section(TSF_NULL, &offset, TSF_NULL, f->bank->presetNum * sizeof(struct tsf_baked_preset));
+		for (i = 0; i != f->bank->presetNum; i++)
+		{
+			const struct tsf_preset* preset = &f->bank->presets[i];
+			struct tsf_baked_preset p;
+			TSF_MEMCPY(p.presetName, preset->presetName, sizeof(p.presetName));
+			p.preset = preset->preset;
+			p.bank = preset->bank;
+			p.regionNum = (tsf_u32)preset->regionNum;
+			p.regionsOffset = tsf_bake_section(res, &offset, preset->regions, preset->regionNum * sizeof(struct tsf_region));
+			p.keyIndexOffset = tsf_bake_section(res, &offset, preset->keyIndex, (TSF_KEYINDEX_KEYS + 1 + preset->keyIndex[TSF_KEYINDEX_KEYS]) * sizeof(int));
+			if (res) TSF_MEMCPY(res + h.presetsOffset + i * sizeof(p), &p, sizeof(p));
+		}
+		h.presetLookupOffset = tsf_bake_section(res, &offset, f->bank->presetLookup, (f->bank->presetLookupMask + 1) * sizeof(int));
+		h.loopGuardsOffset = tsf_bake_section(res, &offset, f->bank->loopGuards, h.loopGuardNum * sizeof(tsf_sample));
+		h.rangesOffset = tsf_bake_section(res, &offset, TSF_NULL, rangeNum * 2 * sizeof(tsf_u32));
+		h.samplesOffset = tsf_bake_section(res, &offset, TSF_NULL, (f->bank->fontSampleCount + TSF_INTERP_PADDING * 2) * sizeof(tsf_sample));
+		if (res) break;
+		if (offset > 0x7FFFFFFF || !(res = (unsigned char*)TSF_MALLOC(offset))) { tsf_residency_free(ranges); return TSF_NULL; }
+		TSF_MEMSET(res, 0, offset); // alignment gaps and the sample padding
+		h.size = (tsf_u32)offset;
+	}
+	TSF_MEMCPY(res, &h, sizeof(h));
+
+	for (rangeOut = (tsf_u32*)(res + h.rangesOffset), i = 0; i != rangeNum; i++, rangeOut += 2)
+	{
+		rangeOut[0] = ranges->ranges[i].start;
+		rangeOut[1] = ranges->ranges[i].end;
+	}
+	tsf_residency_free(ranges);
+
+	samples = (tsf_sample*)(res + h.samplesOffset) + TSF_INTERP_PADDING;
+	if (decoder)
+	{
+		// One block at a time so the sample cache can't drop blocks before they are copied
+		unsigned int start, end;
+		for (start = 0; start < f->bank->fontSampleCount; start = end)
+		{
+			end = (f->bank->fontSampleCount - start > TSF_DECODE_BLOCK ? start + TSF_DECODE_BLOCK : f->bank->fontSampleCount);
+			tsf_decoder_fetch(decoder, start, end, start, end, TSF_TRUE);
+			TSF_MEMCPY(samples + start, f->bank->fontSamples + start, (end - start) * sizeof(tsf_sample));
+			tsf_decoder_unpin(decoder, start, end);
+		}
+	}
+	else if (source)
+	{
+		unsigned int j;
+		for (j = 0; j != f->bank->fontSampleCount; j++) samples[j] = TSF_SAMPLE_FROM_SHORT(source[j]);
+	}
+	else TSF_MEMCPY(samples, f->bank->fontSamples, f->bank->fontSampleCount * sizeof(tsf_sample));
+
+	*baked_size = (int)h.size;
+	return res;
+}
+
+static TSF_BOOL tsf_baked_fits(const struct tsf_baked_header* h, tsf_u32 offset, tsf_u32 num, size_t size)
+{
+	return (!(offset & (TSF_BAKED_ALIGN - 1)) && offset <= h->size && num <= (h->size - offset) / size);
+}
+
+TSFDEF tsf* tsf_load_baked(const void* image, int size)
+{
+	const unsigned char* in = (const unsigned char*)image;
+	const struct tsf_baked_preset* p;
+	const tsf_u32* rangeIn;
+	struct tsf_baked_header h;
+	struct tsf_residency* residency;
+	struct tsf_bank* bank;
 	tsf* res;
-	if (!f) return TSF_NULL;
-	if (!f->refCount)
+	tsf_u32 i;
+
+	if (size < (int)sizeof(h) || ((size_t)in & 3)) return TSF_NULL;
+	TSF_MEMCPY(&h, in, sizeof(h));
+	if (!TSF_FourCCEquals(h.magic, "TSFB") || h.version != TSF_BAKED_VERSION || h.byteOrder != TSF_BAKED_BYTEORDER
+		|| h.sampleSize != sizeof(tsf_sample) || h.regionSize != sizeof(struct tsf_region) || h.size > (tsf_u32)size) return TSF_NULL;
+	if ((h.presetLookupMask & (h.presetLookupMask + 1)) || h.fontSampleCount > 0x7FFFFFFF
+		|| !tsf_baked_fits(&h, h.presetsOffset, h.presetNum, sizeof(struct tsf_baked_preset))
+		|| !tsf_baked_fits(&h, h.presetLookupOffset, h.presetLookupMask + 1, sizeof(int))
+		|| !tsf_baked_fits(&h, h.loopGuardsOffset, h.loopGuardNum, sizeof(tsf_sample))
+		|| !tsf_baked_fits(&h, h.rangesOffset, h.rangeNum, 2 * sizeof(tsf_u32))
+		|| !tsf_baked_fits(&h, h.samplesOffset, h.fontSampleCount + TSF_INTERP_PADDING * 2, sizeof(tsf_sample))) return TSF_NULL;
+
+	bank = (struct tsf_bank*)TSF_MALLOC(sizeof(struct tsf_bank));
+	if (!bank) return TSF_NULL;
+	TSF_MEMSET(bank, 0, sizeof(struct tsf_bank));
+	bank->baked = TSF_TRUE;
+	bank->presets = (struct tsf_preset*)TSF_MALLOC(h.presetNum * sizeof(struct tsf_preset));
+	bank->residency = residency = tsf_residency_create(TSF_NULL, (int)h.rangeNum);
+	if (!bank->presets || !residency) goto invalid;
+	for (p = (const struct tsf_baked_preset*)(in + h.presetsOffset), i = 0; i != h.presetNum; i++, p++)
+	{
+		struct tsf_preset* preset = &bank->presets[i];
+		int entryNum;
+		if (!tsf_baked_fits(&h, p->regionsOffset, p->regionNum, sizeof(struct tsf_region)) || !tsf_baked_fits(&h, p->keyIndexOffset, TSF_KEYINDEX_KEYS + 1, sizeof(int))) goto invalid;
+		TSF_MEMCPY(preset->presetName, p->presetName, sizeof(preset->presetName));
+		preset->presetName[sizeof(preset->presetName)-1] = '\0';
+		preset->preset = p->preset;
+		preset->bank = p->bank;
+		preset->regions = (struct tsf_region*)(in + p->regionsOffset);
+		preset->regionNum = (int)p->regionNum;
+		preset->keyIndex = (int*)(in + p->keyIndexOffset);
+		entryNum = preset->keyIndex[TSF_KEYINDEX_KEYS];
+		if (entryNum < 0 || !tsf_baked_fits(&h, p->keyIndexOffset, TSF_KEYINDEX_KEYS + 1 + (tsf_u32)entryNum, sizeof(int))) goto invalid;
+	}
+	for (rangeIn = (const tsf_u32*)(in + h.rangesOffset), i = 0; i != h.rangeNum; i++, rangeIn += 2)
 	{
-		f->refCount = (int*)TSF_MALLOC(sizeof(int));
-		if (!f->refCount) return TSF_NULL;
-		*f->refCount = 1;
+		struct tsf_sample_range* range = &residency->ranges[i];
+		if (rangeIn[0] >= rangeIn[1] || rangeIn[1] > h.fontSampleCount) continue;
+		range->start = rangeIn[0];
+		range->end = rangeIn[1];
+		residency->totalNum += range->end - range->start;
 	}
-	res = (tsf*)TSF_MALLOC(sizeof(tsf));
+	bank->presetNum = (int)h.presetNum;
+	bank->presetLookup = (int*)(in + h.presetLookupOffset);
+	bank->presetLookupMask = h.presetLookupMask;
+	bank->loopGuards = (tsf_sample*)(in + h.loopGuardsOffset);
+	bank->fontSamples = (tsf_sample*)(in + h.samplesOffset) + TSF_INTERP_PADDING;
+	bank->fontSampleCount = h.fontSampleCount;
+	bank->fontSamplesShared = TSF_TRUE;
+	if ((res = tsf_create(bank)) != TSF_NULL) return res;
+
+	invalid:
+	tsf_bank_free(bank);
+	return TSF_NULL;
+}
+
+TSFDEF tsf* tsf_copy(tsf* f)
+{
+	tsf* res;
+	if (!f) return TSF_NULL;
+	res = tsf_create(f->bank);
 	if (!res) return TSF_NULL;
-	TSF_MEMCPY(res, f, sizeof(tsf));
-	res->voices = TSF_NULL;
-	res->voiceNum = 0;
-	res->channels = TSF_NULL;
-	(*res->refCount)++;
+	// Only the settings are read from f, so it can go on playing or rendering on another thread
+	res->stealing = f->stealing;
+	res->cullGain = f->cullGain;
+	res->maxVoiceNum = f->maxVoiceNum;
+	res->outputmode = f->outputmode;
+	res->outSampleRate = f->outSampleRate;
+	res->globalGainDB = f->globalGainDB;
+	res->kernels = f->kernels;
+	res->interpolation = f->interpolation;
+	res->fastMath = f->fastMath;
 	return res;
 }
 
 TSFDEF void tsf_close(tsf* f)
 {
 	if (!f) return;
-	if (!f->refCount || !--(*f->refCount))
+	if (f->bank->residency)
 	{
-		struct tsf_preset *preset = f->presets, *presetEnd = preset + f->presetNum;
-		for (; preset != presetEnd; preset++) TSF_FREE(preset->regions);
-		TSF_FREE(f->presets);
-		TSF_FREE(f->fontSamples);
-		TSF_FREE(f->refCount);
+		// Let go of the decoded blocks held by the voices of this instance, copies share the decoder
+		int i;
+		for (i = 0; i != f->voiceNum; i++)
+			if (f->voices[i].pinned) tsf_residency_unpin(f, f->voices[i].region);
 	}
+	if (!TSF_ATOMIC_DEC(&f->bank->refCount)) tsf_bank_free(f->bank);
+	tsf_render_pool_free(f->renderPool);
 	TSF_FREE(f->channels);
+	TSF_FREE(f->activeVoices);
 	TSF_FREE(f->voices);
 	TSF_FREE(f);
 }
 
 TSFDEF void tsf_reset(tsf* f)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
+	int *i, *iEnd;
+	tsf_active_voices_prune(f);
+	for (i = f->activeVoices, iEnd = i + f->activeVoiceNum; i != iEnd; i++)
+	{
+		struct tsf_voice* v = &f->voices[*i];
+		if (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release)
 			tsf_voice_endquick(f, v);
+	}
 	if (f->channels) { TSF_FREE(f->channels); f->channels = TSF_NULL; }
 }
 
 TSFDEF int tsf_get_presetindex(const tsf* f, int bank, int preset_number)
 {
-	const struct tsf_preset *presets;
-	int i, iMax;
-	for (presets = f->presets, i = 0, iMax = f->presetNum; i < iMax; i++)
-		if (presets[i].preset == preset_number && presets[i].bank == bank)
+	unsigned int slot;
+	int i;
+	if (bank < 0 || bank > 0xFFFF || preset_number < 0 || preset_number > 0xFFFF) return -1;
+	for (slot = TSF_PRESETLOOKUP_HASH(bank, preset_number) & f->bank->presetLookupMask; (i = f->bank->presetLookup[slot]) != -1; slot = (slot + 1) & f->bank->presetLookupMask)
+		if (f->bank->presets[i].preset == preset_number && f->bank->presets[i].bank == bank)
 			return i;
 	return -1;
 }
 
 TSFDEF int tsf_get_presetcount(const tsf* f)
 {
-	return f->presetNum;
+	return f->bank->presetNum;
 }
 
 TSFDEF const char* tsf_get_presetname(const tsf* f, int preset)
 {
-	return (preset < 0 || preset >= f->presetNum ? TSF_NULL : f->presets[preset].presetName);
+	return (preset < 0 || preset >= f->bank->presetNum ? TSF_NULL : f->bank->presets[preset].presetName);
 }
 
 TSFDEF const char* tsf_bank_get_presetname(const tsf* f, int bank, int preset_number)
@@ -1393,11 +4615,73 @@ TSFDEF const char* tsf_bank_get_presetname(const tsf* f, int bank, int preset_nu
 	return tsf_get_presetname(f, tsf_get_presetindex(f, bank, preset_number));
 }
 
+TSFDEF void tsf_prefetch_preset(tsf* f, int preset_index, int lokey, int hikey)
+{
+	int key, *keyIndex, *entry, *entryEnd;
+	if (!f->bank->residency || preset_index < 0 || preset_index >= f->bank->presetNum) return;
+	if (lokey < 0) lokey = 0;
+	if (hikey >= TSF_KEYINDEX_KEYS) hikey = TSF_KEYINDEX_KEYS - 1;
+	keyIndex = f->bank->presets[preset_index].keyIndex;
+	for (key = lokey; key <= hikey; key++)
+	{
+		entry = keyIndex + TSF_KEYINDEX_KEYS + 1 + keyIndex[key];
+		entryEnd = keyIndex + TSF_KEYINDEX_KEYS + 1 + keyIndex[key + 1];
+		for (; entry != entryEnd; entry++) tsf_residency_fetch(f, &f->bank->presets[preset_index].regions[*entry], TSF_FALSE);
+	}
+}
+
+TSFDEF int tsf_get_resident_samples(const tsf* f, int* total_samples)
+{
+	struct tsf_residency* r = f->bank->residency;
+	unsigned int resident;
+	if (!r)
+	{
+		if (total_samples) *total_samples = (int)f->bank->fontSampleCount;
+		return (int)f->bank->fontSampleCount;
+	}
+	if (total_samples) *total_samples = (int)r->totalNum;
+	if (r->decoder) return (int)tsf_decoder_resident(r->decoder);
+	tsf_residency_lock(r);
+	resident = r->residentNum;
+	tsf_residency_unlock(r);
+	return (int)resident;
+}
+
+TSFDEF void tsf_set_sample_cache(tsf* f, int max_bytes)
+{
+	struct tsf_decoder* d = (f->bank->residency ? f->bank->residency->decoder : TSF_NULL);
+	if (!d) return;
+	tsf_decoder_lock(d);
+	d->maxResident = (max_bytes > 0 ? max_bytes / (int)(TSF_DECODE_BLOCK * sizeof(tsf_sample)) : 0);
+	tsf_decoder_trim(d, -1);
+	tsf_decoder_unlock(d);
+}
+
+TSFDEF int tsf_get_keyindex_size(const tsf* f)
+{
+	int i, size = 0;
+	for (i = 0; i != f->bank->presetNum; i++)
+		size += (TSF_KEYINDEX_KEYS + 1 + f->bank->presets[i].keyIndex[TSF_KEYINDEX_KEYS]) * sizeof(int);
+	return size;
+}
+
 TSFDEF void tsf_set_output(tsf* f, enum TSFOutputMode outputmode, int samplerate, float global_gain_db)
 {
 	f->outputmode = outputmode;
 	f->outSampleRate = (float)(samplerate >= 1 ? samplerate : 44100.0f);
 	f->globalGainDB = global_gain_db;
+	f->kernels = tsf_select_kernels();
+}
+
+TSFDEF void tsf_set_interpolation(tsf* f, enum TSFInterpolation interpolation)
+{
+	if (interpolation < TSF_INTERP_NEAREST || interpolation > TSF_INTERP_SINC) return;
+	f->interpolation = interpolation;
+}
+
+TSFDEF void tsf_set_fast_math(tsf* f, int enable)
+{
+	f->fastMath = (enable ? TSF_TRUE : TSF_FALSE);
 }
 
 TSFDEF void tsf_set_volume(tsf* f, float global_volume)
@@ -1407,63 +4691,99 @@ TSFDEF void tsf_set_volume(tsf* f, float global_volume)
 
 TSFDEF int tsf_set_max_voices(tsf* f, int max_voices)
 {
-	int i = f->voiceNum;
 	int newVoiceNum = (f->voiceNum > max_voices ? f->voiceNum : max_voices);
-	struct tsf_voice *newVoices = (struct tsf_voice*)TSF_REALLOC(f->voices, newVoiceNum * sizeof(struct tsf_voice));
-	if (!newVoices) return 0;
-	f->voices = newVoices;
-	f->voiceNum = f->maxVoiceNum = newVoiceNum;
-	for (; i < max_voices; i++)
-		f->voices[i].playingPreset = -1;
+	if (newVoiceNum != f->voiceNum && !tsf_voice_grow(f, newVoiceNum)) return 0;
+	f->maxVoiceNum = newVoiceNum;
 	return 1;
 }
 
+TSFDEF void tsf_set_voice_stealing(tsf* f, enum TSFVoiceStealing stealing)
+{
+	f->stealing = stealing;
+	tsf_active_voices_prune(f);
+	tsf_voice_quiet_rebuild(f);
+}
+
+TSFDEF void tsf_set_audibility_floor(tsf* f, float floor_db)
+{
+	f->cullGain = (floor_db < 0 ? TSF_POWF(10.0f, floor_db * 0.05f) : 0.0f);
+}
+
+TSFDEF int tsf_set_render_threads(tsf* f, int threads)
+{
+	#ifdef TSF_NO_THREADS
+	if (threads > 1) return 0;
+	#endif
+	if (threads < 0 || threads > TSF_RENDER_MAXTHREADS) return 0;
+	tsf_render_pool_free(f->renderPool);
+	f->renderPool = (threads ? tsf_render_pool_create(threads) : TSF_NULL);
+	return (!threads || f->renderPool);
+}
+
 TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 {
 	short midiVelocity = (short)(vel * 127);
-	int voicePlayIndex;
-	struct tsf_region *region, *regionEnd;
+	int voicePlayIndex, *keyIndex, *entry, *entryEnd;
+	struct tsf_region *region;
 
-	if (preset_index < 0 || preset_index >= f->presetNum) return 1;
+	if (preset_index < 0 || preset_index >= f->bank->presetNum) return 1;
 	if (vel <= 0.0f) { tsf_note_off(f, preset_index, key); return 1; }
+	if (key < 0 || key >= TSF_KEYINDEX_KEYS) return 1;
+	tsf_active_voices_prune(f);
 
-	// Play all matching regions.
+	// Play all matching regions, the key index lists the regions of the key.
 	voicePlayIndex = f->voicePlayIndex++;
-	for (region = f->presets[preset_index].regions, regionEnd = region + f->presets[preset_index].regionNum; region != regionEnd; region++)
+	keyIndex = f->bank->presets[preset_index].keyIndex;
+	entry = keyIndex + TSF_KEYINDEX_KEYS + 1 + keyIndex[key];
+	entryEnd = keyIndex + TSF_KEYINDEX_KEYS + 1 + keyIndex[key + 1];
+	for (; entry != entryEnd; entry++)
 	{
-		struct tsf_voice *voice, *v, *vEnd; TSF_BOOL doLoop; float lowpassFilterQDB, lowpassFc;
-		if (key < region->lokey || key > region->hikey || midiVelocity < region->lovel || midiVelocity > region->hivel) continue;
+		struct tsf_voice *voice, *v; TSF_BOOL doLoop; float lowpassFilterQDB, lowpassFc;
+		region = &f->bank->presets[preset_index].regions[*entry];
+		if (midiVelocity < region->lovel || midiVelocity > region->hivel) continue;
 
-		voice = TSF_NULL, v = f->voices, vEnd = v + f->voiceNum;
 		if (region->group)
 		{
-			for (; v != vEnd; v++)
+			int i;
+			for (i = f->voiceHeads[TSF_VOICEHEAD_GROUP(region->group)]; i != -1; i = v->listNext[TSF_VOICELIST_GROUP])
+			{
+				v = &f->voices[i];
 				if (v->playingPreset == preset_index && v->region->group == region->group) tsf_voice_endquick(f, v);
-				else if (v->playingPreset == -1 && !voice) voice = v;
+			}
+		}
+
+		if (f->maxVoiceNum && f->stealing != TSF_STEAL_NONE && f->freeVoiceNum <= TSF_STEAL_HEADROOM)
+		{
+			// Fade out a voice to keep the headroom of free voices for the next notes
+			v = tsf_voice_steal_victim(f, voicePlayIndex);
+			if (v) tsf_voice_endquick(f, v);
+			if (!f->freeVoiceNum)
+			{
+				// No free voice left, cut off a voice that is fading out (the one ended first) or the victim
+				struct tsf_voice* cut = tsf_voice_steal_first(f, TSF_STEALLINK_AGE, TSF_STEALLIST_FADING, (unsigned int)voicePlayIndex);
+				if (!cut) cut = v;
+				if (cut) { tsf_voice_kill(cut); tsf_active_voices_prune(f); }
+			}
 		}
-		else for (; v != vEnd; v++) if (v->playingPreset == -1) { voice = v; break; }
 
-		if (!voice)
+		if (!f->freeVoiceNum)
 		{
-			struct tsf_voice* newVoices;
 			if (f->maxVoiceNum)
 			{
 				// voices have been pre-allocated and limited to a maximum, unable to start playing this voice
 				continue;
 			}
-			f->voiceNum += 4;
-			newVoices = (struct tsf_voice*)TSF_REALLOC(f->voices, f->voiceNum * sizeof(struct tsf_voice));
-			if (!newVoices) return 0;
-			f->voices = newVoices;
-			voice = &f->voices[f->voiceNum - 4];
-			voice[1].playingPreset = voice[2].playingPreset = voice[3].playingPreset = -1;
+			if (!tsf_voice_grow(f, f->voiceNum + 4)) return 0;
 		}
+		voice = &f->voices[f->freeVoices[--f->freeVoiceNum]];
 
 		voice->region = region;
 		voice->playingPreset = preset_index;
 		voice->playingKey = key;
 		voice->playIndex = voicePlayIndex;
 		voice->noteGainDB = f->globalGainDB - region->attenuation - tsf_gainToDecibels(1.0f / vel);
+		voice->playingChannel = -1;
+		voice->culled = TSF_FALSE;
 
 		if (f->channels)
 		{
@@ -1478,7 +4798,7 @@ TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 		}
 
 		// Offset/end.
-		voice->sourceSamplePosition = region->offset;
+		voice->sourceSamplePosition = (tsf_u64)region->offset << 32;
 
 		// Loop.
 		doLoop = (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end);
@@ -1495,11 +4815,14 @@ TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 		voice->lowpass.QInv = 1.0 / TSF_POW(10.0, (lowpassFilterQDB / 20.0));
 		voice->lowpass.z1 = voice->lowpass.z2 = 0;
 		voice->lowpass.active = (lowpassFc < 0.499f);
-		if (voice->lowpass.active) tsf_voice_lowpass_setup(&voice->lowpass, lowpassFc);
+		if (voice->lowpass.active) tsf_voice_lowpass_setup(&voice->lowpass, lowpassFc, f->fastMath);
 
 		// Setup LFO filters.
 		tsf_voice_lfo_setup(&voice->modlfo, region->delayModLFO, region->freqModLFO, f->outSampleRate);
 		tsf_voice_lfo_setup(&voice->viblfo, region->delayVibLFO, region->freqVibLFO, f->outSampleRate);
+
+		voice->pinned = (f->bank->residency && tsf_residency_fetch(f, region, TSF_TRUE));
+		tsf_voice_start(f, voice);
 	}
 	return 1;
 }
@@ -1513,20 +4836,23 @@ TSFDEF int tsf_bank_note_on(tsf* f, int bank, int preset_number, int key, float
 
 TSFDEF void tsf_note_off(tsf* f, int preset_index, int key)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum, *vMatchFirst = TSF_NULL, *vMatchLast = TSF_NULL;
-	for (; v != vEnd; v++)
+	struct tsf_voice *v, *vMatch = TSF_NULL;
+	int i, first;
+	unsigned int playIndex;
+	tsf_active_voices_prune(f);
+	for (i = first = f->voiceHeads[TSF_VOICEHEAD_KEY(preset_index, key)]; i != -1; i = v->listNext[TSF_VOICELIST_KEY])
 	{
-		//Find the first and last entry in the voices list with matching preset, key and look up the smallest play index
+		//Look up the smallest play index of the active voices with matching preset and key
+		v = &f->voices[i];
 		if (v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
-		else if (!vMatchFirst || v->playIndex < vMatchFirst->playIndex) vMatchFirst = vMatchLast = v;
-		else if (v->playIndex == vMatchFirst->playIndex) vMatchLast = v;
+		else if (!vMatch || v->playIndex < vMatch->playIndex) vMatch = v;
 	}
-	if (!vMatchFirst) return;
-	for (v = vMatchFirst; v <= vMatchLast; v++)
+	if (!vMatch) return;
+	for (playIndex = vMatch->playIndex, i = first; i != -1; i = v->listNext[TSF_VOICELIST_KEY])
 	{
 		//Stop all voices with matching preset, key and the smallest play index which was enumerated above
-		if (v != vMatchFirst && v != vMatchLast &&
-			(v->playIndex != vMatchFirst->playIndex || v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE)) continue;
+		v = &f->voices[i];
+		if (v->playIndex != playIndex || v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
 		tsf_voice_end(f, v);
 	}
 }
@@ -1541,23 +4867,34 @@ TSFDEF int tsf_bank_note_off(tsf* f, int bank, int preset_number, int key)
 
 TSFDEF void tsf_note_off_all(tsf* f)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) if (v->playingPreset != -1 && v->ampenv.segment < TSF_SEGMENT_RELEASE)
-		tsf_voice_end(f, v);
+	int *i, *iEnd;
+	tsf_active_voices_prune(f);
+	for (i = f->activeVoices, iEnd = i + f->activeVoiceNum; i != iEnd; i++)
+		if (f->voices[*i].ampenv.segment < TSF_SEGMENT_RELEASE)
+			tsf_voice_end(f, &f->voices[*i]);
 }
 
 TSFDEF int tsf_active_voice_count(tsf* f)
 {
-	int count = 0;
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) if (v->playingPreset != -1) count++;
-	return count;
+	tsf_active_voices_prune(f);
+	return f->activeVoiceNum;
+}
+
+TSFDEF int tsf_culled_voice_count(tsf* f)
+{
+	return f->culledVoiceNum;
+}
+
+TSFDEF int tsf_underrun_count(tsf* f)
+{
+	return f->underrunNum;
 }
 
 TSFDEF void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing)
 {
 	float outputSamples[TSF_RENDER_SHORTBUFFERBLOCK];
 	int channels = (f->outputmode == TSF_MONO ? 1 : 2), maxChannelSamples = TSF_RENDER_SHORTBUFFERBLOCK / channels;
+	unsigned int denormalMode = tsf_denormals_disable();
 	while (samples > 0)
 	{
 		int channelSamples = (samples > maxChannelSamples ? maxChannelSamples : samples);
@@ -1580,15 +4917,18 @@ TSFDEF void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing
 				*buffer++ = (v < -1.00004566f ? (short)-32768 : (v > 1.00001514f ? (short)32767 : (short)(v * 32767.5f)));
 			}
 	}
+	tsf_denormals_restore(denormalMode);
 }
 
 TSFDEF void tsf_render_float(tsf* f, float* buffer, int samples, int flag_mixing)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
+	unsigned int denormalMode = tsf_denormals_disable();
 	if (!flag_mixing) TSF_MEMSET(buffer, 0, (f->outputmode == TSF_MONO ? 1 : 2) * sizeof(float) * samples);
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1)
-			tsf_voice_render(f, v, buffer, samples);
+	tsf_render_voices_sync(f);
+	if (f->renderPool) tsf_render_pool_run(f, f->renderPool, buffer, samples);
+	else tsf_render_voices(f, f->renderVoices, f->renderVoiceNum, buffer, samples);
+	tsf_render_voices_compact(f);
+	tsf_denormals_restore(denormalMode);
 }
 
 static void tsf_channel_setup_voice(tsf* f, struct tsf_voice* v)
@@ -1641,10 +4981,12 @@ static struct tsf_channel* tsf_channel_init(tsf* f, int channel)
 
 static void tsf_channel_applypitch(tsf* f, int channel, struct tsf_channel* c)
 {
-	struct tsf_voice *v, *vEnd;
+	struct tsf_voice* v;
+	int i;
 	float pitchShift = (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning));
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingChannel == channel && v->playingPreset != -1)
+	tsf_active_voices_prune(f);
+	for (i = f->voiceHeads[TSF_VOICEHEAD_CHANNEL(channel)]; i != -1; i = v->listNext[TSF_VOICELIST_CHANNEL])
+		if ((v = &f->voices[i])->playingChannel == channel)
 			tsf_voice_calcpitchratio(v, pitchShift, f->outSampleRate);
 }
 
@@ -1700,11 +5042,13 @@ TSFDEF int tsf_channel_set_bank_preset(tsf* f, int channel, int bank, int preset
 
 TSFDEF int tsf_channel_set_pan(tsf* f, int channel, float pan)
 {
-	struct tsf_voice *v, *vEnd;
+	struct tsf_voice* v;
+	int i;
 	struct tsf_channel *c = tsf_channel_init(f, channel);
 	if (!c) return 0;
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingChannel == channel && v->playingPreset != -1)
+	tsf_active_voices_prune(f);
+	for (i = f->voiceHeads[TSF_VOICEHEAD_CHANNEL(channel)]; i != -1; i = v->listNext[TSF_VOICELIST_CHANNEL])
+		if ((v = &f->voices[i])->playingChannel == channel)
 		{
 			float newpan = v->region->pan + pan - 0.5f;
 			if      (newpan <= -0.5f) { v->panFactorLeft = 1.0f; v->panFactorRight = 0.0f; }
@@ -1718,12 +5062,14 @@ TSFDEF int tsf_channel_set_pan(tsf* f, int channel, float pan)
 TSFDEF int tsf_channel_set_volume(tsf* f, int channel, float volume)
 {
 	float gainDB = tsf_gainToDecibels(volume), gainDBChange;
-	struct tsf_voice *v, *vEnd;
+	struct tsf_voice* v;
+	int i;
 	struct tsf_channel *c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (gainDB == c->gainDB) return 1;
-	for (v = f->voices, vEnd = v + f->voiceNum, gainDBChange = gainDB - c->gainDB; v != vEnd; v++)
-		if (v->playingChannel == channel && v->playingPreset != -1)
+	tsf_active_voices_prune(f);
+	for (i = f->voiceHeads[TSF_VOICEHEAD_CHANNEL(channel)], gainDBChange = gainDB - c->gainDB; i != -1; i = v->listNext[TSF_VOICELIST_CHANNEL])
+		if ((v = &f->voices[i])->playingChannel == channel)
 			v->noteGainDB += gainDBChange;
 	c->gainDB = gainDB;
 	return 1;
@@ -1768,37 +5114,44 @@ TSFDEF int tsf_channel_note_on(tsf* f, int channel, int key, float vel)
 
 TSFDEF void tsf_channel_note_off(tsf* f, int channel, int key)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum, *vMatchFirst = TSF_NULL, *vMatchLast = TSF_NULL;
-	for (; v != vEnd; v++)
+	struct tsf_voice *v, *vMatch = TSF_NULL;
+	int i, first;
+	unsigned int playIndex;
+	tsf_active_voices_prune(f);
+	for (i = first = f->voiceHeads[TSF_VOICEHEAD_CHANNEL(channel)]; i != -1; i = v->listNext[TSF_VOICELIST_CHANNEL])
 	{
-		//Find the first and last entry in the voices list with matching channel, key and look up the smallest play index
-		if (v->playingPreset == -1 || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
-		else if (!vMatchFirst || v->playIndex < vMatchFirst->playIndex) vMatchFirst = vMatchLast = v;
-		else if (v->playIndex == vMatchFirst->playIndex) vMatchLast = v;
+		//Look up the smallest play index of the active voices with matching channel and key
+		v = &f->voices[i];
+		if (v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
+		else if (!vMatch || v->playIndex < vMatch->playIndex) vMatch = v;
 	}
-	if (!vMatchFirst) return;
-	for (v = vMatchFirst; v <= vMatchLast; v++)
+	if (!vMatch) return;
+	for (playIndex = vMatch->playIndex, i = first; i != -1; i = v->listNext[TSF_VOICELIST_CHANNEL])
 	{
 		//Stop all voices with matching channel, key and the smallest play index which was enumerated above
-		if (v != vMatchFirst && v != vMatchLast &&
-			(v->playIndex != vMatchFirst->playIndex || v->playingPreset == -1 || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE)) continue;
+		v = &f->voices[i];
+		if (v->playIndex != playIndex || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
 		tsf_voice_end(f, v);
 	}
 }
 
 TSFDEF void tsf_channel_note_off_all(tsf* f, int channel)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && v->ampenv.segment < TSF_SEGMENT_RELEASE)
+	struct tsf_voice* v;
+	int i;
+	tsf_active_voices_prune(f);
+	for (i = f->voiceHeads[TSF_VOICEHEAD_CHANNEL(channel)]; i != -1; i = v->listNext[TSF_VOICELIST_CHANNEL])
+		if ((v = &f->voices[i])->playingChannel == channel && v->ampenv.segment < TSF_SEGMENT_RELEASE)
 			tsf_voice_end(f, v);
 }
 
 TSFDEF void tsf_channel_sounds_off_all(tsf* f, int channel)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
+	struct tsf_voice* v;
+	int i;
+	tsf_active_voices_prune(f);
+	for (i = f->voiceHeads[TSF_VOICEHEAD_CHANNEL(channel)]; i != -1; i = v->listNext[TSF_VOICELIST_CHANNEL])
+		if ((v = &f->voices[i])->playingChannel == channel && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
 			tsf_voice_endquick(f, v);
 }
 
@@ -1863,7 +5216,7 @@ TSFDEF int tsf_channel_get_preset_bank(tsf* f, int channel)
 
 TSFDEF int tsf_channel_get_preset_number(tsf* f, int channel)
 {
-	return (f->channels && channel < f->channels->channelNum ? f->presets[f->channels->channels[channel].presetIndex].preset : 0);
+	return (f->channels && channel < f->channels->channelNum ? f->bank->presets[f->channels->channels[channel].presetIndex].preset : 0);
 }
 
 TSFDEF float tsf_channel_get_pan(tsf* f, int channel)
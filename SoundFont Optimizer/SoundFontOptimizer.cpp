@@ -0,0 +1,188 @@
+﻿// Writes a smaller SoundFont which only keeps the presets, zones and sample data
+// that can be reached by the given key and velocity ranges.
+//
+//   SoundFontOptimizer input.sf2 output.sf2 [-compress] preset[:lokey-hikey[:lovel-hivel]] ...
+//
+// Keyboard Lyre only plays preset 0 over the keys 47 to 84, so its resource is made with
+//   SoundFontOptimizer 风物之诗琴.sf2 风物之诗琴.min.sf2 0:47-84
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Same sample format as Keyboard Lyre, so the load times below are the ones of the app
+#define TSF_IMPLEMENTATION
+#define TSF_SAMPLES_SHORT
+#include "../Keyboard Lyre/tsf.h"
+
+static bool ReadFile(const char* filename, std::vector<unsigned char>& data)
+{
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    data.resize(size > 0 ? size : 0);
+    bool ok = (size > 0 && fread(&data[0], 1, size, file) == (size_t)size);
+    fclose(file);
+    return ok;
+}
+
+static bool WriteFile(const char* filename, const void* data, int size)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file) return false;
+    bool ok = (fwrite(data, 1, size, file) == (size_t)size);
+    return (fclose(file) == 0 && ok);
+}
+
+static bool ParseRange(const char* arg, tsf_strip_range& range)
+{
+    char end;
+    range.lokey = 0; range.hikey = 127; range.lovel = 0; range.hivel = 127;
+    int n = sscanf(arg, "%d:%d-%d:%d-%d%c", &range.preset_index, &range.lokey, &range.hikey, &range.lovel, &range.hivel, &end);
+    if (n != 1 && n != 3 && n != 5) return false;
+    return (range.preset_index >= 0 && range.lokey >= 0 && range.lokey <= range.hikey && range.hikey <= 127 && range.lovel >= 0 && range.lovel <= range.hivel && range.hivel <= 127);
+}
+
+// Average time in milliseconds to load a SoundFont from memory the way Keyboard Lyre does
+static double LoadTime(const void* data, int size)
+{
+    const int runs = 10;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i != runs; i++)
+        tsf_close(tsf_load_memory_nocopy(data, size));
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() / runs;
+}
+
+// Play every key of a range on both SoundFonts and count the notes that don't sound the same
+static int CompareRange(tsf* original, tsf* stripped, const tsf_strip_range& range, int strippedIndex, int& notes)
+{
+    static float a[44100 * 2], b[44100 * 2];
+    int differ = 0;
+    for (int key = range.lokey; key <= range.hikey; key++)
+    {
+        for (int vel = range.lovel; vel <= range.hivel; vel += (range.hivel - range.lovel) / 3 + 1)
+        {
+            tsf_reset(original);
+            tsf_reset(stripped);
+            tsf_note_on(original, range.preset_index, key, vel / 127.0f);
+            tsf_note_on(stripped, strippedIndex, key, vel / 127.0f);
+            tsf_render_float(original, a, 22050, 0);
+            tsf_render_float(stripped, b, 22050, 0);
+            tsf_note_off(original, range.preset_index, key);
+            tsf_note_off(stripped, strippedIndex, key);
+            tsf_render_float(original, a + 44100, 22050, 0);
+            tsf_render_float(stripped, b + 44100, 22050, 0);
+            if (memcmp(a, b, sizeof(a))) differ++;
+            notes++;
+        }
+    }
+    return differ;
+}
+
+int main(int argc, char** argv)
+{
+    int argi = 3;
+    bool compress = (argc > 3 && !strcmp(argv[3], "-compress"));
+    if (compress) argi++;
+    if (argc <= argi)
+    {
+        fprintf(stderr, "Usage: %s input.sf2 output.sf2 [-compress] preset[:lokey-hikey[:lovel-hivel]] ...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<tsf_strip_range> ranges(argc - argi);
+    std::vector<int> presets;
+    for (int i = argi; i != argc; i++)
+    {
+        if (!ParseRange(argv[i], ranges[i - argi]))
+        {
+            fprintf(stderr, "Invalid range '%s'\n", argv[i]);
+            return 1;
+        }
+        presets.push_back(ranges[i - argi].preset_index);
+    }
+    std::sort(presets.begin(), presets.end());
+    presets.erase(std::unique(presets.begin(), presets.end()), presets.end());
+
+    std::vector<unsigned char> input;
+    if (!ReadFile(argv[1], input))
+    {
+        fprintf(stderr, "Could not read '%s'\n", argv[1]);
+        return 1;
+    }
+    tsf* original = tsf_load_memory(&input[0], (int)input.size());
+    if (!original)
+    {
+        fprintf(stderr, "'%s' is not a valid SoundFont\n", argv[1]);
+        return 1;
+    }
+    for (const tsf_strip_range& range : ranges)
+    {
+        if (range.preset_index >= tsf_get_presetcount(original))
+        {
+            fprintf(stderr, "Preset %d does not exist, '%s' has %d presets\n", range.preset_index, argv[1], tsf_get_presetcount(original));
+            return 1;
+        }
+    }
+
+    int strippedSize;
+    void* stripped = tsf_strip_memory(&input[0], (int)input.size(), &ranges[0], (int)ranges.size(), &strippedSize);
+    if (!stripped)
+    {
+        fprintf(stderr, "Could not strip '%s'\n", argv[1]);
+        return 1;
+    }
+
+    // Check that every note of the ranges still sounds the same before anything gets written
+    tsf* result = tsf_load_memory(stripped, strippedSize);
+    if (!result)
+    {
+        fprintf(stderr, "Could not load the stripped SoundFont, nothing written\n");
+        return 1;
+    }
+    int notes = 0, differ = 0;
+    tsf_set_output(original, TSF_STEREO_INTERLEAVED, 44100, 0);
+    tsf_set_output(result, TSF_STEREO_INTERLEAVED, 44100, 0);
+    for (const tsf_strip_range& range : ranges)
+    {
+        // Kept presets are numbered in the order of their index in the input
+        int strippedIndex = (int)(std::lower_bound(presets.begin(), presets.end(), range.preset_index) - presets.begin());
+        differ += CompareRange(original, result, range, strippedIndex, notes);
+    }
+    tsf_close(result);
+    tsf_close(original);
+    if (differ)
+    {
+        fprintf(stderr, "%d of %d notes sound different after stripping, nothing written\n", differ, notes);
+        return 1;
+    }
+
+    void* output = stripped;
+    int outputSize = strippedSize;
+    if (compress)
+    {
+        output = tsf_compress_memory(stripped, strippedSize, &outputSize);
+        if (!output)
+        {
+            fprintf(stderr, "Could not compress the stripped SoundFont\n");
+            return 1;
+        }
+    }
+    if (!WriteFile(argv[2], output, outputSize))
+    {
+        fprintf(stderr, "Could not write '%s'\n", argv[2]);
+        return 1;
+    }
+
+    double inputTime = LoadTime(&input[0], (int)input.size()), outputTime = LoadTime(output, outputSize);
+    printf("%d notes checked\n", notes);
+    printf("Size:      %10d -> %10d bytes (%.1f%% of the input)\n", (int)input.size(), outputSize, 100.0 * outputSize / input.size());
+    printf("Load time: %10.2f -> %10.2f ms (%.1f%% of the input)\n", inputTime, outputTime, 100.0 * outputTime / inputTime);
+    if (output != stripped) free(output);
+    free(stripped);
+    return 0;
+}
@@ -0,0 +1,171 @@
+﻿// Builds SoundFonts in memory for the tests and the benchmark, so they don't need any files.
+// Each preset plays an instrument of its own (or one of a smaller set of shared instruments), which
+// splits the keyboard into zones that each play one of the samples (a looped tone with a few harmonics).
+#pragma once
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Each zone has 6 generators, the SF2 generator and zone indices are 16-bit so instruments * (zones * 6 + 3)
+// has to stay below 65536
+struct TestSoundFontDesc
+{
+    int presets = 1;
+    int instruments = 0;         // preset p plays instrument p % instruments, 0 for one instrument per preset
+    int zones = 16;              // key ranges of each instrument
+    int samples = 64;
+    int sampleLength = 2000;     // sample points of each sample
+    bool loop = true;
+    int silentTail = 0;           // sample points of silence after the tone, looped instead of the tone if not 0
+    int releaseTimecents = -2000; // volume envelope release of all zones (-2000 is about 0.3 seconds)
+    int filterCents = 13500;      // lowpass cutoff of all zones (13500 and above is no filter)
+    int modEnvToFilterCents = 0;  // sweep of the cutoff by the modulation envelope
+    int vibratoCents = 0;         // depth of the vibrato LFO
+};
+
+namespace TestSoundFont
+{
+    static void Put16(std::vector<unsigned char>& out, unsigned int value)
+    {
+        out.push_back((unsigned char)value);
+        out.push_back((unsigned char)(value >> 8));
+    }
+
+    static void Put32(std::vector<unsigned char>& out, unsigned int value)
+    {
+        Put16(out, value & 0xFFFF);
+        Put16(out, value >> 16);
+    }
+
+    static void PutName(std::vector<unsigned char>& out, const char* name)
+    {
+        char padded[20] = { 0 };
+        strncpy(padded, name, 19);
+        out.insert(out.end(), padded, padded + 20);
+    }
+
+    static void PutChunk(std::vector<unsigned char>& out, const char* id, const std::vector<unsigned char>& data)
+    {
+        out.insert(out.end(), id, id + 4);
+        Put32(out, (unsigned int)data.size());
+        out.insert(out.end(), data.begin(), data.end());
+        if (data.size() & 1) out.push_back(0);
+    }
+
+    static void PutList(std::vector<unsigned char>& out, const char* id, const std::vector<unsigned char>& data)
+    {
+        std::vector<unsigned char> list(id, id + 4);
+        list.insert(list.end(), data.begin(), data.end());
+        PutChunk(out, "LIST", list);
+    }
+
+    static void PutGen(std::vector<unsigned char>& gen, int& genNum, int oper, int amount)
+    {
+        Put16(gen, oper);
+        Put16(gen, amount & 0xFFFF);
+        genNum++;
+    }
+}
+
+static std::vector<unsigned char> MakeTestSoundFont(const TestSoundFontDesc& desc)
+{
+    using namespace TestSoundFont;
+    enum { GenVibLfoToPitch = 6, GenInitialFilterFc = 8, GenModEnvToFilterFc = 11, GenPan = 17, GenDecayModEnv = 28, GenReleaseVolEnv = 38, GenInstrument = 41, GenKeyRange = 43, GenVelRange = 44, GenCoarseTune = 51, GenSampleID = 53, GenSampleModes = 54 };
+    const double pi = 3.14159265358979323846;
+    char name[32]; // cut to 19 characters by PutName
+
+    std::vector<unsigned char> smpl, shdr;
+    for (int s = 0; s != desc.samples; s++)
+    {
+        unsigned int start = (unsigned int)(smpl.size() / 2), end = start + desc.sampleLength + desc.silentTail;
+        double freq = 55.0 * pow(2.0, (s % 60) / 12.0);
+        for (int i = 0; i != desc.sampleLength; i++)
+        {
+            double t = 2 * pi * freq * i / 44100.0;
+            Put16(smpl, (unsigned int)(int)(20000.0 * (0.7 * sin(t) + 0.2 * sin(2 * t) + 0.1 * sin(3 * t))));
+        }
+        for (int i = 0; i != desc.silentTail; i++) Put16(smpl, 0);
+        for (int i = 0; i != 46; i++) Put16(smpl, 0);
+        snprintf(name, sizeof(name), "S%d", s);
+        PutName(shdr, name);
+        Put32(shdr, start);
+        Put32(shdr, end);
+        Put32(shdr, !desc.loop ? 0 : (desc.silentTail ? start + desc.sampleLength : start + desc.sampleLength / 4));
+        Put32(shdr, !desc.loop ? 0 : (desc.silentTail ? end : end - 4));
+        Put32(shdr, 44100);
+        shdr.push_back((unsigned char)(33 + s % 60)); // original key of 55 Hz * 2^(s/12)
+        shdr.push_back(0);
+        Put16(shdr, 0);
+        Put16(shdr, 1); // mono
+    }
+    PutName(shdr, "EOS");
+    for (int i = 0; i != 46 - 20; i++) shdr.push_back(0);
+
+    std::vector<unsigned char> inst, ibag, igen, phdr, pbag, pgen;
+    int ibagNum = 0, igenNum = 0, pbagNum = 0, pgenNum = 0;
+    int instruments = (desc.instruments ? desc.instruments : desc.presets);
+    for (int i = 0; i != instruments; i++)
+    {
+        snprintf(name, sizeof(name), "Instrument %d", i);
+        PutName(inst, name);
+        Put16(inst, ibagNum);
+        Put16(ibag, igenNum); Put16(ibag, 0); ibagNum++; // global zone
+        PutGen(igen, igenNum, GenReleaseVolEnv, desc.releaseTimecents);
+        if (desc.filterCents < 13500) PutGen(igen, igenNum, GenInitialFilterFc, desc.filterCents);
+        if (desc.modEnvToFilterCents) PutGen(igen, igenNum, GenModEnvToFilterFc, desc.modEnvToFilterCents);
+        if (desc.modEnvToFilterCents) PutGen(igen, igenNum, GenDecayModEnv, 0); // sweeps down over a second
+        if (desc.vibratoCents) PutGen(igen, igenNum, GenVibLfoToPitch, desc.vibratoCents);
+        for (int z = 0; z != desc.zones; z++)
+        {
+            Put16(ibag, igenNum); Put16(ibag, 0); ibagNum++;
+            PutGen(igen, igenNum, GenKeyRange, (z * 128 / desc.zones) | (((z + 1) * 128 / desc.zones - 1) << 8));
+            PutGen(igen, igenNum, GenVelRange, 127 << 8);
+            PutGen(igen, igenNum, GenPan, (z * 37) % 1000 - 500);
+            PutGen(igen, igenNum, GenCoarseTune, -(z % 3));
+            PutGen(igen, igenNum, GenSampleModes, desc.loop ? 1 : 0);
+            PutGen(igen, igenNum, GenSampleID, (i + z) % desc.samples);
+        }
+    }
+    for (int p = 0; p != desc.presets; p++)
+    {
+        snprintf(name, sizeof(name), "Preset %d", p);
+        PutName(phdr, name);
+        Put16(phdr, p % 128);
+        Put16(phdr, p / 128);
+        Put16(phdr, pbagNum);
+        Put32(phdr, 0); Put32(phdr, 0); Put32(phdr, 0);
+        Put16(pbag, pgenNum); Put16(pbag, 0); pbagNum++;
+        PutGen(pgen, pgenNum, GenInstrument, p % instruments);
+    }
+    PutName(inst, "EOI");
+    Put16(inst, ibagNum);
+    Put16(ibag, igenNum); Put16(ibag, 0);
+    Put32(igen, 0);
+    PutName(phdr, "EOP");
+    Put16(phdr, 0); Put16(phdr, 0); Put16(phdr, pbagNum);
+    Put32(phdr, 0); Put32(phdr, 0); Put32(phdr, 0);
+    Put16(pbag, pgenNum); Put16(pbag, 0);
+    Put32(pgen, 0);
+    std::vector<unsigned char> mod(10, 0);
+
+    std::vector<unsigned char> ifil, info, sdta, pdta, riff(4, 0), result;
+    Put16(ifil, 2); Put16(ifil, 1);
+    PutChunk(info, "ifil", ifil);
+    PutChunk(sdta, "smpl", smpl);
+    PutChunk(pdta, "phdr", phdr);
+    PutChunk(pdta, "pbag", pbag);
+    PutChunk(pdta, "pmod", mod);
+    PutChunk(pdta, "pgen", pgen);
+    PutChunk(pdta, "inst", inst);
+    PutChunk(pdta, "ibag", ibag);
+    PutChunk(pdta, "imod", mod);
+    PutChunk(pdta, "igen", igen);
+    PutChunk(pdta, "shdr", shdr);
+    memcpy(&riff[0], "sfbk", 4);
+    PutList(riff, "INFO", info);
+    PutList(riff, "sdta", sdta);
+    PutList(riff, "pdta", pdta);
+    PutChunk(result, "RIFF", riff);
+    return result;
+}
@@ -0,0 +1,177 @@
+﻿// Checks of tsf.h that can't be heard by playing Keyboard Lyre. Runs all tests, prints their results
+// and exits with 1 if any of them failed.
+//
+//   Tests [test name]
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#define TSF_IMPLEMENTATION
+#define TSF_SAMPLES_SHORT
+#include "../Keyboard Lyre/tsf.h"
+
+#include "TestSoundFont.h"
+
+// Loads, configures, plays and closes instances on several threads at once. The shared tables are set up
+// by whichever thread gets there first, and copies of one tsf share its bank and close it from any thread.
+static bool TestParallelInstances()
+{
+    const int threadNum = 8, iterations = 2000;
+    TestSoundFontDesc desc;
+    desc.presets = 8;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    int compressedSize;
+    void* compressed = tsf_compress_memory(&font[0], (int)font.size(), &compressedSize);
+    if (!compressed) { printf("  could not compress the SoundFont\n"); return false; }
+
+    // Compressed (decoded into shared pages) and in place samples, the two kinds of banks with shared state
+    tsf* originals[2] = { tsf_load_memory(compressed, compressedSize), tsf_load_memory_nocopy(&font[0], (int)font.size()) };
+    if (!originals[0] || !originals[1]) { printf("  could not load the SoundFont\n"); return false; }
+
+    std::atomic<int> waiting(threadNum + 1), failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t != threadNum; t++)
+    {
+        threads.emplace_back([&, t]()
+        {
+            tsf* mine = tsf_copy(originals[t & 1]);
+            if (--waiting) while (waiting) std::this_thread::yield();
+            float buffer[2 * 256];
+            for (int i = 0; i != iterations; i++)
+            {
+                // Every 16th instance is loaded instead of copied, so loads run at the same time as well
+                tsf* f = ((i & 15) ? tsf_copy(mine) : tsf_load_memory(&font[0], (int)font.size()));
+                if (!f) { failures++; continue; }
+                tsf_set_output(f, TSF_STEREO_INTERLEAVED, 44100, 0);
+                tsf_set_interpolation(f, (enum TSFInterpolation)(i % 4));
+                tsf_set_fast_math(f, i & 1);
+                int presets = tsf_get_presetcount(f);
+                for (int n = 0; n != 4; n++)
+                    tsf_note_on(f, (t * 7 + i + n) % presets, 36 + (t * 13 + i * 5 + n * 7) % 60, 0.8f);
+                tsf_render_float(f, buffer, 256, 0);
+                tsf_note_off_all(f);
+                tsf_render_float(f, buffer, 256, 0);
+                tsf_close(f);
+            }
+            tsf_close(mine);
+        });
+    }
+    // Once all threads have their copy, the copies keep the banks alive and the last one to close frees them
+    if (--waiting) while (waiting) std::this_thread::yield();
+    tsf_close(originals[0]);
+    tsf_close(originals[1]);
+    for (std::thread& thread : threads) thread.join();
+    free(compressed);
+    printf("  %d threads created and closed %d instances\n", threadNum, threadNum * iterations);
+    return (failures == 0);
+}
+
+// Renders the same notes with and without tsf_set_fast_math. The approximations are much more precise than
+// the float samples (see tsf_set_fast_math), so the outputs may only differ by the rounding of the samples.
+static bool TestFastMath()
+{
+    const int sampleRate = 44100, blockSize = 64;
+    const float tolerance = 1e-4f; // of the peak level, cubic and sinc can pick the neighbouring phase of their tables
+    TestSoundFontDesc desc;
+    desc.presets = 4;
+    desc.filterCents = 6000;
+    desc.modEnvToFilterCents = 4000;
+    desc.vibratoCents = 50;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    bool ok = true;
+    for (int interpolation = TSF_INTERP_NEAREST; interpolation <= TSF_INTERP_SINC; interpolation++)
+    {
+        tsf* precise = tsf_load_memory(&font[0], (int)font.size());
+        if (!precise) { printf("  could not load the SoundFont\n"); return false; }
+        tsf* fast = tsf_copy(precise);
+        tsf_set_output(precise, TSF_STEREO_INTERLEAVED, sampleRate, 0);
+        tsf_set_output(fast, TSF_STEREO_INTERLEAVED, sampleRate, 0);
+        tsf_set_interpolation(precise, (enum TSFInterpolation)interpolation);
+        tsf_set_interpolation(fast, (enum TSFInterpolation)interpolation);
+        tsf_set_fast_math(fast, 1);
+
+        float a[2 * blockSize], b[2 * blockSize], peak = 0, maxDiff = 0;
+        for (int block = 0; block != 3 * sampleRate / blockSize; block++)
+        {
+            if (block % 100 == 0)
+            {
+                // A chord every 100 blocks, the one before is released
+                for (tsf* f : { precise, fast })
+                {
+                    tsf_note_off_all(f);
+                    for (int n = 0; n != 4; n++) tsf_note_on(f, (block / 100 + n) % desc.presets, 30 + (block / 10 + n * 17) % 70, 0.3f + 0.2f * n);
+                }
+            }
+            tsf_render_float(precise, a, blockSize, 0);
+            tsf_render_float(fast, b, blockSize, 0);
+            for (int i = 0; i != 2 * blockSize; i++)
+            {
+                float diff = fabsf(a[i] - b[i]), level = fabsf(a[i]);
+                if (diff > maxDiff) maxDiff = diff;
+                if (level > peak) peak = level;
+            }
+        }
+        printf("  interpolation %d: peak %.3f, largest difference %.3g\n", interpolation, peak, maxDiff);
+        if (peak == 0 || maxDiff > tolerance * peak) ok = false;
+        tsf_close(fast);
+        tsf_close(precise);
+    }
+    return ok;
+}
+
+// Compressed fonts with a sample count in the tsfc header close to 2^32, where the block count and page size
+// used to wrap around. The block table can't be that large so they must not load, and a note played anyway
+// must stay inside the samples (which shows when built with a sanitizer).
+static bool TestCompressedSampleCount()
+{
+    TestSoundFontDesc desc;
+    std::vector<unsigned char> font = MakeTestSoundFont(desc);
+    int compressedSize;
+    unsigned char* compressed = (unsigned char*)tsf_compress_memory(&font[0], (int)font.size(), &compressedSize);
+    if (!compressed) { printf("  could not compress the SoundFont\n"); return false; }
+    unsigned char* chunk = compressed;
+    while (chunk + 12 <= compressed + compressedSize && memcmp(chunk, "tsfc", 4)) chunk++;
+    if (chunk + 12 > compressed + compressedSize) { printf("  no tsfc chunk\n"); free(compressed); return false; }
+
+    bool ok = true;
+    for (unsigned int sampleCount : { 0xFFFFFFFFu, 0xFFFFF001u, 0xFFFFFFF8u, 0x80000000u })
+    {
+        for (int i = 0; i != 4; i++) chunk[8 + i] = (unsigned char)(sampleCount >> (i * 8));
+        tsf* f = tsf_load_memory(compressed, compressedSize);
+        printf("  sample count 0x%08X: %s\n", sampleCount, f ? "loaded" : "rejected");
+        if (!f) continue;
+        ok = false;
+        float buffer[2 * 256];
+        tsf_set_output(f, TSF_STEREO_INTERLEAVED, 44100, 0);
+        tsf_note_on(f, 0, 60, 1.0f);
+        tsf_render_float(f, buffer, 256, 0);
+        tsf_close(f);
+    }
+    free(compressed);
+    return ok;
+}
+
+static const struct { const char* name; bool (*run)(); } tests[] =
+{
+    { "ParallelInstances", TestParallelInstances },
+    { "FastMath", TestFastMath },
+    { "CompressedSampleCount", TestCompressedSampleCount },
+};
+
+int main(int argc, char** argv)
+{
+    int failed = 0;
+    for (const auto& test : tests)
+    {
+        if (argc > 1 && strcmp(argv[1], test.name)) continue;
+        printf("%s\n", test.name);
+        bool ok = test.run();
+        printf("  %s\n", ok ? "passed" : "FAILED");
+        if (!ok) failed++;
+    }
+    if (failed) printf("%d tests failed\n", failed);
+    return (failed ? 1 : 0);
+}